@@ -0,0 +1,42 @@
+#ifndef BITOPS_H
+#define BITOPS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Bit-level kernels behind the bitmap commands. Bit 0 is the most significant
+ * bit of the first byte, as in Redis. Long inputs are processed 32 bytes at a
+ * time with AVX2 (Harley-Seal for popcount) when the CPU has it, chosen at
+ * run time; otherwise 64-bit words with the popcnt instruction if present.
+ */
+enum BitOp { BITOP_AND, BITOP_OR, BITOP_XOR, BITOP_NOT };
+
+uint64_t popcount(const uint8_t* data, size_t len);
+// Set bits among bit positions [startBit, endBit]
+uint64_t popcountBits(const uint8_t* data, uint64_t startBit, uint64_t endBit);
+// First position in [startBit, endBit] holding bit, -1 if there is none
+int64_t findBit(const uint8_t* data, uint64_t startBit, uint64_t endBit, int bit);
+// dst = dst op src over len bytes; BITOP_NOT sets dst = ~src
+void bitwiseInto(BitOp op, uint8_t* dst, const uint8_t* src, size_t len);
+
+// BITFIELD
+enum BitFieldOverflow { OVERFLOW_WRAP, OVERFLOW_SAT, OVERFLOW_FAIL };
+
+struct BitFieldOp {
+    enum Kind { GET, SET, INCRBY } kind;
+    bool isSigned;
+    unsigned bits;          // i1..i64, u1..u63
+    uint64_t offset;        // in bits
+    int64_t value;          // SET value or INCRBY increment
+    BitFieldOverflow overflow;
+};
+
+// Value of the field op reads; bits past len bytes read as 0
+int64_t readBitField(const BitFieldOp& op, const uint8_t* data, size_t len);
+// Run op on data of len bytes, which covers the field for SET and INCRBY.
+// reply is the value for GET, the old value for SET and the new one for
+// INCRBY; false (nothing written) if the result overflows with OVERFLOW_FAIL
+bool applyBitField(const BitFieldOp& op, uint8_t* data, size_t len, int64_t& reply);
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <atomic>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Hash slot of a key: CRC16 of the key, or of its {hash tag} if it has one
+int keyHashSlot(const std::string& key);
+
+// Where a slot is served, as seen by this node; node indexes, -1 for none
+struct SlotRoute {
+    int owner = -1;
+    int migratingTo = -1;       // this node is moving the slot to that node
+    int importingFrom = -1;     // this node is taking the slot over from that node
+};
+
+/*
+ * Cluster configuration shared by all shards of one process.
+ * The 16384 hash slots are assigned to nodes (server processes). Nodes are
+ * named by address and their ids derived from it, so every process agrees
+ * on them without a gossip protocol; the layout is given at startup
+ * (--cluster-nodes) or built with CLUSTER MEET / ADDSLOTS / SETSLOT and
+ * saved to a config file on every change. Node 0 is always this process.
+ */
+class Cluster {
+public:
+    static const int kSlots = 16384;
+
+    Cluster();
+
+    bool enabled() const { return enabled_; }
+    void enable(const std::string& host, int port, const std::string& configFile);
+    // Split all slots evenly, in order, across the given "host:port" addresses
+    bool assignEvenly(const std::vector<std::string>& addresses);
+    bool loadConfig();
+
+    SlotRoute route(int slot);
+    std::string nodeAddress(int node);
+    std::string myId();
+
+    // CLUSTER subcommands; false with error set on invalid input
+    bool meet(const std::string& host, int port);
+    bool forget(const std::string& id, std::string& error);
+    bool addSlots(const std::vector<int>& slots, std::string& error);
+    bool delSlots(const std::vector<int>& slots, std::string& error);
+    // state is NODE, MIGRATING, IMPORTING or STABLE
+    bool setSlot(int slot, const std::string& state, const std::string& nodeId, std::string& error);
+
+    std::string infoText();
+    std::string nodesText();
+    std::string slotsReply();
+
+private:
+    struct Node {
+        std::string id;         // empty once forgotten
+        std::string host;
+        int port;
+    };
+
+    std::atomic<bool> enabled_;
+    std::string configFile_;
+    std::shared_mutex mutex_;
+    std::vector<Node> nodes_;
+    std::vector<int> owner_;        // per slot, node index or -1
+    std::vector<int> migrating_;
+    std::vector<int> importing_;
+
+    int findNode(const std::string& id) const;
+    int addNode(const std::string& host, int port);
+    std::string describeNodes(bool withTransfers) const;
+    void saveConfig() const;
+};
+
+#endif
@@ -4,14 +4,54 @@
 #include <string>
 #include <vector>
 
+class KVStore;
+
 // Parse RESP protocol input into command tokens
 std::vector<std::string> parseProtocol(const std::string& input);
 
+// Extract one complete command from buf starting at pos.
+// Returns bytes consumed, 0 if more data is needed, -1 on protocol error.
+long parseCommand(const std::string& buf, size_t pos, std::vector<std::string>& tokens);
+
+// Redis-style glob match: * ? [abc] [^a-z] and \\ escapes
+bool globMatch(const std::string& pattern, const std::string& str);
+
+// Command routing flags
+enum CommandFlags : unsigned {
+    CMD_WRITE      = 1 << 0,  // modifies the keyspace
+    CMD_ALL_SHARDS = 1 << 1,  // runs on every shard, replies are merged
+    CMD_BLOCKING   = 1 << 2,  // a null reply parks the client until a key is pushed to
+};
+
+// Static description of a command, used to route it to the shard owning its keys
+struct CommandInfo {
+    const char* name;
+    int arity;      // exact argument count including the name, or -N for at least N
+    int firstKey;   // index of the first key argument, 0 if keyless
+    int lastKey;    // index of the last key argument, -1 for the final argument
+    int keyStep;
+    unsigned flags;
+};
+
+// Look up a command by its upper-cased name; nullptr if unknown
+const CommandInfo* lookupCommand(const std::string& name);
+
+// Whether argc arguments (including the command name) satisfy the command's arity
+bool checkArity(const CommandInfo& info, size_t argc);
+
+// Key arguments of a command according to its CommandInfo
+std::vector<std::string> commandKeys(const CommandInfo& info, const std::vector<std::string>& args);
+
 class CommandProcessor {
 public:
     CommandProcessor();
+    explicit CommandProcessor(KVStore& store);
     // Execute a command and return RESP-formatted response
     std::string execute(const std::string& rawInput);
+    std::string execute(const std::vector<std::string>& args);
+
+private:
+    KVStore& store_;
 };
 
 #endif
@@ -0,0 +1,28 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <string>
+
+// LZ4 block format, self-contained. Compressed bytes are appended to out.
+void lz4Compress(const char* src, size_t len, std::string& out);
+// False if src is not a valid block that decodes to exactly rawLen bytes
+bool lz4Decompress(const char* src, size_t len, char* dst, size_t rawLen);
+
+/*
+ * Stored form of string values and list items.
+ * Values of at least threshold bytes that compress well are kept as a frame:
+ *   "\0LZ4" <method byte> <u32 raw length> <data>
+ * A value that would itself look like a frame is wrapped in an uncompressed
+ * frame, so every other value is stored as is and decodes for free.
+ * Frames are also what snapshots, DUMP payloads and full resyncs carry.
+ */
+// threshold 0 disables compression (frames are still produced for escaping)
+std::string encodeValue(std::string raw, size_t threshold);
+bool isEncodedValue(const std::string& stored);
+// Raw value of a stored value; false (out unchanged) if a frame is corrupt
+bool decodeValue(const std::string& stored, std::string& out);
+// Whether stored holds the value raw, without decoding it when the lengths differ
+bool storedEquals(const std::string& stored, const std::string& raw);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef EPOLL_BACKEND_H
+#define EPOLL_BACKEND_H
+
+#include "IoBackend.h"
+
+#include <unordered_map>
+
+// Readiness-based backend: nonblocking recv/send driven by epoll
+class EpollBackend : public IoBackend {
+public:
+    explicit EpollBackend(IoHandler& handler);
+    ~EpollBackend() override;
+
+    const char* name() const override { return "epoll"; }
+    bool init(int listenFd, int wakeupFd) override;
+    void addClient(Client& client) override;
+    void removeClient(Client& client) override;
+    FlushResult flush(Client& client) override;
+    void poll(int timeoutMs) override;
+
+private:
+    IoHandler& handler_;
+    int epollFd_;
+    int listenFd_;
+    int wakeupFd_;
+    std::unordered_map<uint64_t, int> fds_;  // client id -> socket
+
+    void acceptClients();
+    void readClient(uint64_t clientId, int fd);
+};
+
+#endif
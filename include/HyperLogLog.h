@@ -0,0 +1,49 @@
+#ifndef HYPER_LOG_LOG_H
+#define HYPER_LOG_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * HyperLogLog with 16384 6-bit registers (standard error 0.81%), hashed with
+ * MurmurHash64A as in Redis. Small sketches are sparse: a vector of
+ * (register << 8 | value) entries sorted by register. Past kMaxSparseEntries
+ * it converts to the dense form, the registers packed into 12 KB.
+ * The estimate is cached until a register changes.
+ */
+class HyperLogLog {
+public:
+    static const int kPrecision = 14;
+    static const size_t kRegisters = size_t(1) << kPrecision;
+    static const size_t kDenseBytes = kRegisters * 6 / 8;
+    static const size_t kMaxSparseEntries = 750;    // 3 KB, as Redis' hll-sparse-max-bytes
+
+    // Returns true if a register changed
+    bool add(const std::string& element);
+    uint64_t count() const;
+    bool isSparse() const { return dense_.empty(); }
+
+    // Raise registers (kRegisters bytes, one per register) to this sketch's values
+    void maxInto(uint8_t* registers) const;
+    // Replace the sketch with registers (kRegisters bytes)
+    void assign(const uint8_t* registers);
+    // Cardinality estimate of unpacked registers
+    static uint64_t estimate(const uint8_t* registers);
+
+    // Encoding byte followed by the sparse entries or the dense registers
+    std::string serialize() const;
+    bool deserialize(const std::string& data);
+
+private:
+    std::vector<uint32_t> sparse_;
+    std::vector<uint8_t> dense_;        // kDenseBytes + 1 padding byte when dense
+    mutable uint64_t cachedCount_ = 0;
+    mutable bool cacheValid_ = true;    // an empty sketch counts 0
+
+    bool setRegister(size_t index, uint8_t value);
+    void toDense();
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct Client;
+
+// Receives network events from an IoBackend; implemented by Shard
+class IoHandler {
+public:
+    virtual ~IoHandler() = default;
+    virtual void onAccept(int fd) = 0;
+    virtual void onData(uint64_t clientId, const char* data, size_t len) = 0;
+    // Peer closed the connection or an I/O error occurred
+    virtual void onClosed(uint64_t clientId) = 0;
+    // The backend can take more output for this client
+    virtual void onWritable(uint64_t clientId) = 0;
+};
+
+enum class FlushResult { Drained, Pending, Failed };
+
+struct IoOptions {
+    std::string backend = "epoll";   // "epoll" or "io_uring"
+    bool registeredBuffers = false;  // io_uring only: send small replies from registered buffers
+};
+
+/*
+ * Network I/O strategy of a shard's event loop.
+ * Readiness-based (epoll) and completion-based (io_uring) backends expose
+ * the same interface: the shard hands over client output with flush() and
+ * receives input, accepts and write-readiness through IoHandler callbacks.
+ */
+class IoBackend {
+public:
+    virtual ~IoBackend() = default;
+    virtual const char* name() const = 0;
+    virtual bool init(int listenFd, int wakeupFd) = 0;
+    virtual void addClient(Client& client) = 0;
+    // Stops I/O on the client and closes its socket once no operation references it
+    virtual void removeClient(Client& client) = 0;
+    // Write or queue as much of the client's output (outQueue, then outBuf) as possible
+    virtual FlushResult flush(Client& client) = 0;
+    // Wait up to timeoutMs for events and dispatch them to the handler
+    virtual void poll(int timeoutMs) = 0;
+};
+
+// Create the requested backend, falling back to epoll when io_uring is unavailable
+std::unique_ptr<IoBackend> createIoBackend(const IoOptions& options, IoHandler& handler,
+                                           int listenFd, int wakeupFd);
+
+#endif
@@ -1,19 +1,113 @@
 #ifndef KV_SERVER_H
 #define KV_SERVER_H
 
+#include <iosfwd>
 #include <string>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "Cluster.h"
+#include "IoBackend.h"
+#include "Replication.h"
+#include "TrafficCapture.h"
+
+class KVStore;
+class Shard;
+
+// Client classes with separate output buffer limits
+enum ClientClass { CLIENT_NORMAL, CLIENT_PUBSUB, CLIENT_REPLICA, CLIENT_CLASS_COUNT };
+
+// Pending output above hard, or above soft for softSeconds, disconnects a client; 0 disables a limit
+struct OutputBufferLimit {
+    size_t hard;
+    size_t soft;
+    int softSeconds;
+};
+
+struct ServerConfig {
+    int port = 6379;
+    // threads > 1 enables shared-nothing mode: one event loop and key partition per thread
+    int threads = 1;
+    IoOptions io;
+    // Replication: bytes of write stream kept for partial resync, and the primary to follow
+    size_t replBacklogSize = 1024 * 1024;
+    std::string replicaOfHost;
+    int replicaOfPort = 0;
+    // Output buffer limits per ClientClass
+    OutputBufferLimit outputLimits[CLIENT_CLASS_COUNT] = {
+        {0, 0, 0},
+        {32 * 1024 * 1024, 8 * 1024 * 1024, 60},
+        {256 * 1024 * 1024, 64 * 1024 * 1024, 60},
+    };
+    // Unparsed input at which a client is disconnected
+    size_t maxQueryBuffer = 1024 * 1024 * 1024;
+    // Seconds without input after which a normal client is closed, 0 never
+    int idleTimeout = 0;
+    // Elements (or 64 KB units of a string) above which removed values are freed in the background
+    size_t lazyFreeThreshold = 64;
+    // Cluster mode: hash slots split across server processes ("host:port" list), layout persisted to
+    // clusterConfigFile
+    bool clusterEnabled = false;
+    std::vector<std::string> clusterNodes;
+    std::string clusterConfigFile = "nodes.conf";
+    // Tiered storage: value log path prefix (one file per shard), empty disables it.
+    // String values of at least tieredMinValue bytes beyond tieredMemory per shard are spilled
+    std::string tieredPath;
+    size_t tieredMinValue = 4096;
+    size_t tieredMemory = 1024UL * 1024 * 1024;
+    size_t tieredCache = 64 * 1024 * 1024;
+    // String values and list items of at least this many bytes are stored LZ4-compressed, 0 disables it
+    size_t compressionThreshold = 0;
+    // Record client commands to this file from startup (see CAPTURE), stopping past captureMaxBytes (0: no limit)
+    std::string capturePath;
+    uint64_t captureMaxBytes = 0;
+    // Keys remembered for CLIENT TRACKING across all shards before random ones are invalidated (0: no limit)
+    size_t trackingTableMaxKeys = 1000000;
+};
 
 class KVServer {
 public:
-    explicit KVServer(int port);
+    explicit KVServer(const ServerConfig& config);
+    ~KVServer();
     void start();
     void stop();
 
+    bool isRunning() const { return isRunning_; }
+    int shardCount() const { return static_cast<int>(shards_.size()); }
+    int shardForKey(const std::string& key) const;
+    Shard& shard(int idx) { return *shards_[idx]; }
+    uint64_t nextClientId() { return ++lastClientId_; }
+    // Shard serving each connection, for CLIENT TRACKING REDIRECT; -1 if the id is unknown
+    void registerClient(uint64_t id, int shard);
+    void unregisterClient(uint64_t id);
+    int clientShard(uint64_t id);
+    int port() const { return config_.port; }
+    const ServerConfig& config() const { return config_; }
+    Replication& replication() { return replication_; }
+    Cluster& cluster() { return cluster_; }
+    TrafficCapture& capture() { return capture_; }
+
+    // Persist or restore every partition through a single snapshot file
+    bool saveSnapshot(const std::string& filepath);
+    bool loadSnapshot(const std::string& filepath);
+    bool saveSnapshot(std::ostream& out);
+    bool loadSnapshot(std::istream& in);
+
 private:
-    int port_;
-    int listenSocket_;
+    ServerConfig config_;
     std::atomic<bool> isRunning_;
+    std::atomic<uint64_t> lastClientId_;
+    std::mutex clientsMutex_;
+    std::unordered_map<uint64_t, int> clientShards_;
+    Replication replication_;
+    Cluster cluster_;
+    TrafficCapture capture_;
+    std::vector<std::unique_ptr<KVStore>> ownedStores_;
+    std::vector<std::unique_ptr<Shard>> shards_;
 
     void installSignalHandlers();
 };
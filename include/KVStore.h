@@ -1,19 +1,63 @@
 #ifndef KV_STORE_H
 #define KV_STORE_H
 
+#include <atomic>
+#include <cstdint>
+#include <list>
 #include <string>
 #include <mutex>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <iosfwd>
+
+#include "SortedSet.h"
+#include "HyperLogLog.h"
+#include "Bitops.h"
+#include "ValueLog.h"
+#include "Tracking.h"
 
 class KVStore {
 public: 
-    // Singleton accessor
+    // Singleton accessor; the process-wide store used by shard 0
     static KVStore& instance();
 
+    // Additional stores own disjoint key partitions in thread-per-core mode
+    KVStore() = default;
+    ~KVStore() = default;
+
+    // Hold the store lock across several calls (MULTI/EXEC); calls made by
+    // the holding thread re-enter it without contending
+    std::unique_lock<std::recursive_mutex> acquireLock();
+
+    // Optimistic locking (WATCH): versions are kept only for watched keys
+    uint64_t watchKey(const std::string& key);
+    void unwatchKey(const std::string& key);
+    uint64_t keyVersion(const std::string& key);
+    void touchKeys(const std::vector<std::string>& keys);
+    void touchAllKeys();
+    bool hasWatchedKeys() const { return watchedCount_ > 0; }
+
+    // Client-side caching (CLIENT TRACKING): keys read by tracking connections
+    // and broadcast prefixes; writes queue invalidations the owning shard sends
+    void setTrackingMaxKeys(size_t maxKeys);
+    void trackKeys(const std::vector<std::string>& keys, const Tracker& tracker);
+    void invalidateKeys(const std::vector<std::string>& keys);
+    void trackPrefixes(uint64_t owner, const Tracker& target, const std::vector<std::string>& prefixes);
+    void untrackPrefixes(uint64_t owner);
+    bool hasTracking() const { return trackingActive_; }
+    bool hasInvalidations() const { return invalidationsPending_; }
+    std::vector<Invalidation> takeInvalidations();
+    // The owning shard is woken when invalidations are first queued, e.g. by an EXEC from another shard
+    void setInvalidationWakeup(std::function<void()> wakeup);
+
     // General Commands
-    bool clearAll();
+    // async hands the old keyspace to the lazy free thread (FLUSHALL ASYNC)
+    bool clearAll(bool async = false);
 
     // String Operations
     void setString(const std::string& key, const std::string& val);
@@ -21,9 +65,15 @@ public:
     std::vector<std::string> getAllKeys();
     std::string getKeyType(const std::string& key);
     bool removeKey(const std::string& key);
+    // Detach the key in O(1) and free large values in the background
+    bool unlinkKey(const std::string& key);
     bool setExpiry(const std::string& key, int ttlSeconds);
     void cleanupExpired();
+    // Drop keys whose TTL passed without waiting for the next call that touches the store
+    void expireKeys();
     bool renameKey(const std::string& oldKey, const std::string& newKey);
+    // Remaining time to live in milliseconds, 0 if the key has no expiry
+    int64_t getTtlMs(const std::string& key);
 
     // List Operations
     std::vector<std::string> getList(const std::string& key);
@@ -32,6 +82,7 @@ public:
     void listPushBack(const std::string& key, const std::string& val);
     bool listPopFront(const std::string& key, std::string& val);
     bool listPopBack(const std::string& key, std::string& val);
+    bool listMove(const std::string& src, const std::string& dst, bool fromFront, bool toFront, std::string& val);
     int listRemove(const std::string& key, int count, const std::string& val);
     bool listGetAt(const std::string& key, int idx, std::string& val);
     bool listSetAt(const std::string& key, int idx, const std::string& val);
@@ -47,21 +98,128 @@ public:
     ssize_t hashSize(const std::string& key);
     bool hashSetMultiple(const std::string& key, const std::vector<std::pair<std::string, std::string>>& pairs);
 
+    // Sorted Set Operations
+    // Returns the number of new members; changed also counts score updates
+    size_t zsetAdd(const std::string& key, const std::vector<ScoredMember>& members, unsigned flags, size_t& changed);
+    // Returns false if flags prevented the update or the result would be NaN
+    bool zsetIncrBy(const std::string& key, const std::string& member, double delta, unsigned flags, double& result);
+    size_t zsetRemove(const std::string& key, const std::vector<std::string>& members);
+    size_t zsetSize(const std::string& key);
+    bool zsetScore(const std::string& key, const std::string& member, double& score);
+    long zsetRank(const std::string& key, const std::string& member, bool reverse);
+    // start/stop may be negative (from the end), as in ZRANGE
+    std::vector<ScoredMember> zsetRangeByRank(const std::string& key, long start, long stop, bool reverse);
+    std::vector<ScoredMember> zsetRangeByScore(const std::string& key, const ScoreRange& range, bool reverse,
+                                               size_t offset, long count);
+
+    // Bitmap Operations on string values
+    // Returns the previous bit; the value is zero-padded up to offset
+    int setBit(const std::string& key, uint64_t offset, int bit);
+    int getBit(const std::string& key, uint64_t offset);
+    // start/end are inclusive byte (or bit) indexes, negative counting from the end
+    uint64_t bitCount(const std::string& key, int64_t start, int64_t end, bool bitUnits);
+    // First position of bit in the range, -1 if none; without an end, clear bits
+    // are found past the end of the value as in BITPOS
+    int64_t bitPos(const std::string& key, int bit, int64_t start, int64_t end, bool endGiven, bool bitUnits);
+    // Store op over the values of keys in dest (removed if the result is empty); returns its length
+    size_t bitOp(BitOp op, const std::string& dest, const std::vector<std::string>& keys);
+    // BITFIELD subcommands in order; no value where OVERFLOW FAIL prevented a write
+    std::vector<std::optional<int64_t>> bitField(const std::string& key, const std::vector<BitFieldOp>& ops);
+
+    // HyperLogLog Operations
+    // Returns true if the key was created or a register changed (PFADD)
+    bool hllAdd(const std::string& key, const std::vector<std::string>& elements);
+    // Estimated cardinality of the union of keys; a single key's estimate is cached
+    uint64_t hllCount(const std::vector<std::string>& keys);
+    // Store the union of dest and sources in dest
+    void hllMerge(const std::string& dest, const std::vector<std::string>& sources);
+
+    // Cluster: a per-slot key index, kept only once enabled
+    void enableSlotIndex();
+    size_t countKeysInSlot(int slot);
+    std::vector<std::string> getKeysInSlot(int slot, size_t count);
+
+    // Serialize one key (DUMP) as a snapshot section; false if it does not exist
+    bool dumpKey(const std::string& key, std::string& payload);
+    // Create key from a dumpKey payload (RESTORE); ttlMs 0 means no expiry
+    bool restoreKey(const std::string& key, const std::string& payload, int64_t ttlMs, bool replace, std::string& error);
+    // Fill this empty scratch store from a payload of snapshot sections (DUMP, BULKRESTORE); false if malformed
+    bool decodePayload(const std::string& payload);
+    // Move sourceKey's value out of a decoded payload store into key; ttlMs 0 means no expiry
+    bool adoptKey(KVStore& decoded, const std::string& sourceKey, const std::string& key, int64_t ttlMs,
+                  bool replace, std::string& error);
+    // Presize the table of one type ("string", "list", "hash", "zset", "hyperloglog") for keys more keys
+    bool reserveKeys(const std::string& type, size_t keys);
+
+    // Tiered storage: once string values of at least minValue bytes take more than
+    // residentBytes, the least recently read ones move to a value log at path
+    void enableTiering(const std::string& path, size_t minValue, size_t residentBytes, size_t cacheBytes);
+    // String values and list items of at least threshold bytes are stored LZ4-compressed (0 disables)
+    void setCompressionThreshold(size_t threshold) { compressThreshold_ = threshold; }
+
     // Persistence
     bool saveToDisk(const std::string& filepath);
     bool loadFromDisk(const std::string& filepath);
+    bool saveToStream(std::ostream& outFile);
+    // Only keys accepted by keyFilter are loaded (all keys if it is empty)
+    bool loadFromStream(std::istream& inFile, const std::function<bool(const std::string&)>& keyFilter);
 
 private:
-    KVStore() = default;
-    ~KVStore() = default;
     KVStore(const KVStore&) = delete;
     KVStore& operator=(const KVStore&) = delete;
 
-    std::mutex storeMutex_;
+    std::recursive_mutex storeMutex_;
     std::unordered_map<std::string, std::string> stringData_;
     std::unordered_map<std::string, std::vector<std::string>> listData_;
     std::unordered_map<std::string, std::unordered_map<std::string, std::string>> hashData_;
+    std::unordered_map<std::string, SortedSet> zsetData_;
+    std::unordered_map<std::string, HyperLogLog> hllData_;
     std::unordered_map<std::string, std::chrono::steady_clock::time_point> expiryTimes_;
+    // No key expires before this; cleanupExpired only scans once it passed
+    std::chrono::steady_clock::time_point nextExpiry_ = std::chrono::steady_clock::time_point::max();
+    std::vector<std::unordered_set<std::string>> slotKeys_;
+
+    // Tiered storage; a spilled string keeps an empty stringData_ entry
+    std::unique_ptr<ValueLog> valueLog_;
+    size_t tierMinValue_ = 0;
+    size_t tierResidentLimit_ = 0;
+    size_t residentLarge_ = 0;      // bytes of large values still in memory
+    size_t spillAfter_ = 0;         // after a failed spill, the resident bytes to wait for
+    std::list<std::string> largeOrder_;     // resident large values, least recently used first
+    std::unordered_map<std::string, std::list<std::string>::iterator> largeValues_;
+    std::unordered_map<std::string, uint64_t> spilled_;        // key -> value log handle
+
+    // Set once at startup, read without the lock so values compress outside it
+    std::atomic<size_t> compressThreshold_{0};
+
+    struct WatchedKey {
+        uint64_t version = 0;
+        int watchers = 0;
+    };
+    std::unordered_map<std::string, WatchedKey> watchedKeys_;
+    std::atomic<size_t> watchedCount_{0};
+
+    TrackingTable tracking_;
+    std::vector<Invalidation> invalidations_;
+    std::atomic<bool> trackingActive_{false};
+    std::atomic<bool> invalidationsPending_{false};
+    std::function<void()> invalidationWakeup_;
+    void trackingChanged();
+
+    bool keyExists(const std::string& key) const;
+    void setExpiryTime(const std::string& key, std::chrono::steady_clock::time_point when);
+    void indexKey(const std::string& key);
+    void unindexKey(const std::string& key);
+    void rebuildSlotIndex();
+    void trackString(const std::string& key, const std::string& val);
+    void untrackString(const std::string& key);
+    void spillColdValues();
+    const std::string& readString(const std::string& key, const std::string& stored, std::string& scratch);
+    void storeString(const std::string& key, std::string stored);
+    const std::string* peekString(const std::string& key, std::string& scratch);
+    std::string& mutableString(const std::string& key);
+    void commitString(const std::string& key, std::string& value);
+    bool loadBinary(std::istream& inFile, const std::function<bool(const std::string&)>& keyFilter);
 };
 
 #endif
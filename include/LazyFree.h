@@ -0,0 +1,70 @@
+#ifndef LAZY_FREE_H
+#define LAZY_FREE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+/*
+ * Background reclamation of detached values (UNLINK, FLUSHALL ASYNC,
+ * overwrites). The caller moves the value out of the keyspace in O(1) while
+ * holding the store lock; destroying it, which for a large list, hash or
+ * sorted set means one free per element, happens on this thread instead.
+ * Values whose free effort is at or below the threshold are destroyed inline.
+ */
+class LazyFree {
+public:
+    static LazyFree& instance();
+    ~LazyFree();
+
+    // Free effort above which values are handed to the background thread
+    void setThreshold(size_t threshold) { threshold_ = threshold; }
+    size_t threshold() const { return threshold_; }
+    // Objects queued and not yet destroyed
+    size_t pending() const { return pending_; }
+
+    // Destroy value in the background if effort exceeds the threshold
+    template <typename T>
+    void release(T&& value, size_t effort) {
+        if (effort > threshold_)
+            defer(std::forward<T>(value));
+    }
+
+    // Always destroy value in the background
+    template <typename T>
+    void defer(T&& value) {
+        enqueue(std::unique_ptr<Garbage>(new GarbageOf<typename std::decay<T>::type>(std::forward<T>(value))));
+    }
+
+private:
+    struct Garbage {
+        virtual ~Garbage() = default;
+    };
+    template <typename T>
+    struct GarbageOf : Garbage {
+        explicit GarbageOf(T&& v) : value(std::move(v)) {}
+        T value;
+    };
+
+    LazyFree();
+    LazyFree(const LazyFree&) = delete;
+    LazyFree& operator=(const LazyFree&) = delete;
+
+    std::atomic<size_t> threshold_;
+    std::atomic<size_t> pending_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<Garbage>> queue_;
+    std::thread worker_;
+    bool stopping_;
+
+    void enqueue(std::unique_ptr<Garbage> garbage);
+    void run();
+};
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Circular buffer holding the most recent bytes of the replication stream
+class ReplicationBacklog {
+public:
+    explicit ReplicationBacklog(size_t capacity);
+    void append(const std::string& data);
+    // Drop all history and continue the stream at offset
+    void reset(uint64_t offset);
+    uint64_t startOffset() const { return end_ - size_; }
+    uint64_t endOffset() const { return end_; }
+    // Append up to maxLen bytes starting at offset; false if offset is no longer buffered
+    bool copyFrom(uint64_t offset, size_t maxLen, std::string& out) const;
+
+private:
+    std::vector<char> buf_;
+    uint64_t end_;   // stream offset one past the newest byte
+    size_t size_;    // bytes currently buffered
+};
+
+/*
+ * Replication state shared by all shards.
+ * A primary encodes every applied write into the backlog; replicas attached
+ * with PSYNC either continue from their offset (partial resync) or receive
+ * a snapshot first (full resync), then stream from the backlog.
+ * A replica applies the primary's stream and re-feeds it into its own
+ * backlog under the primary's replication id, so offsets stay comparable.
+ */
+class Replication {
+public:
+    explicit Replication(size_t backlogSize);
+
+    // Serialises "apply write + feed backlog" once feeding is enabled
+    std::mutex& writeMutex() { return writeMutex_; }
+    // Encode an applied write into the backlog; caller holds writeMutex()
+    void feed(const std::vector<std::string>& args);
+    // Set once every shard feeds its writes
+    bool feedEnabled() const { return feedEnabled_; }
+    void enableFeed() { feedEnabled_ = true; }
+
+    std::string replId();
+    uint64_t offset();
+    bool readBacklog(uint64_t offset, size_t maxLen, std::string& out);
+    // Decide between partial and full resync; caller holds writeMutex()
+    bool canContinue(const std::string& replId, uint64_t offset);
+    // Replica side: adopt the primary's history after a full resync
+    void resetStream(const std::string& replId, uint64_t offset);
+    // Bumped by resetStream; replicas attached to an older stream must resync
+    uint64_t streamEpoch() const { return streamEpoch_; }
+
+    // Shards hosting replica connections are woken when the stream grows
+    void setWakeup(std::function<void()> wakeup);
+
+    // Replica configuration (REPLICAOF); an empty host means primary role
+    void setPrimary(const std::string& host, int port);
+    bool isReplica() const { return isReplica_; }
+    uint64_t primaryGeneration() const { return primaryGeneration_; }
+    void primaryAddress(std::string& host, int& port);
+    // State of the link to the primary as reported by ROLE
+    void setLinkState(const std::string& state);
+    std::string linkState();
+
+    // Attached replicas as reported by ROLE
+    struct ReplicaInfo {
+        std::string ip;
+        int port;
+        uint64_t ackOffset;
+    };
+    void addReplica(uint64_t clientId, const std::string& ip, int port);
+    void ackReplica(uint64_t clientId, uint64_t offset);
+    void removeReplica(uint64_t clientId);
+    std::vector<ReplicaInfo> replicas();
+
+private:
+    std::mutex writeMutex_;
+    std::atomic<bool> feedEnabled_;
+    std::string replId_;
+    std::mutex backlogMutex_;
+    ReplicationBacklog backlog_;
+    std::atomic<uint64_t> streamEpoch_;
+    std::function<void()> wakeup_;
+
+    std::mutex configMutex_;
+    std::string primaryHost_;
+    int primaryPort_;
+    std::atomic<bool> isReplica_;
+    std::atomic<uint64_t> primaryGeneration_;
+    std::string linkState_;
+    std::map<uint64_t, ReplicaInfo> replicas_;
+};
+
+// RESP array encoding of a command, as carried on the replication stream
+std::string encodeCommand(const std::vector<std::string>& args);
+
+#endif
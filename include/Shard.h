@@ -0,0 +1,302 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "CommandProcessor.h"
+#include "IoBackend.h"
+#include "SpscQueue.h"
+#include "Tracking.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class KVServer;
+class KVStore;
+
+// Message exchanged between shards over SPSC queues
+struct ShardMessage {
+    // EnableFeed asks a shard to start feeding its writes to the replication backlog,
+    // Unblock withdraws a parked blocking command whose client disconnected,
+    // Publish delivers payload to the shard's subscribers of channel args[0],
+    // KeysTouched reports keys (args) a transaction on another shard wrote to,
+    // ClientList asks for the shard's CLIENT LIST lines,
+    // Invalidate sends client-side caching invalidations for keys args (none: flush everything)
+    enum class Kind { None, Request, Reply, EnableFeed, Unblock, Publish, KeysTouched, ClientList, Invalidate };
+    Kind kind = Kind::None;
+    int fromShard = 0;
+    uint64_t clientId = 0;
+    bool blocking = false;          // Request may park until its keys are pushed to
+    Tracker tracker;                // Request of a tracking connection: reads register keys for it (id 0: none)
+    std::vector<std::string> args;
+    std::string reply;
+    std::shared_ptr<const std::string> payload;
+};
+
+// A blocking command parked on keys of the shard that owns them
+struct BlockedRequest {
+    int fromShard = 0;              // shard the client is connected to
+    std::vector<std::string> args;
+    std::vector<std::string> keys;
+    std::string timeoutReply;       // null reply sent when the deadline passes
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// Totals of a BULKLOAD session, reported by BULKLOAD END
+struct BulkStats {
+    uint64_t commands = 0;
+    uint64_t restoredKeys = 0;      // keys created by BULKRESTORE
+    uint64_t errors = 0;
+    std::string firstError;
+
+    void fail(const std::string& error) {
+        if (errors++ == 0) firstError = error;
+    }
+};
+
+// Per-connection state owned by a single shard
+struct Client {
+    int fd = -1;
+    uint64_t id = 0;
+    std::string addr;               // peer ip:port
+    std::string name;               // set with CLIENT SETNAME
+    std::string lastCommand;
+    std::chrono::steady_clock::time_point createdAt;
+    std::chrono::steady_clock::time_point lastActive;     // last input received
+    // When pending output first exceeded the class soft limit; default while below it
+    std::chrono::steady_clock::time_point softLimitSince;
+    std::string inBuf;
+    std::string outBuf;             // private replies, sent after outQueue
+    size_t outPos = 0;              // bytes of outBuf already written
+    // Shared immutable buffers (pub/sub messages) queued ahead of outBuf
+    std::deque<std::shared_ptr<const std::string>> outQueue;
+    size_t outQueuePos = 0;         // bytes of outQueue.front() already written
+    size_t outQueueBytes = 0;       // total size of the buffers in outQueue
+    bool writeRegistered = false;   // epoll backend: EPOLLOUT is armed
+    bool closeAfterWrite = false;
+    // A forwarded command is in flight; input is not processed until it replies
+    bool awaitingReply = false;
+    int blockedShard = -1;          // remote shard holding this client's blocking command
+    int fanoutPending = 0;
+    std::vector<std::string> fanoutReplies;
+
+    // Replica attached with PSYNC and fed from the backlog
+    bool isReplica = false;
+    uint64_t replOffset = 0;        // next stream byte to send
+    uint64_t replEpoch = 0;         // stream generation the offset belongs to
+    int replListenPort = 0;
+    std::vector<std::string> psyncArgs;   // PSYNC waiting for every shard to feed writes
+    bool psyncContinue = false;           // backlog was complete when PSYNC arrived
+    // MULTI/EXEC
+    bool inMulti = false;
+    bool multiError = false;        // a command was rejected while queueing, EXEC aborts
+    std::vector<std::vector<std::string>> multiQueue;
+    std::vector<std::pair<std::string, uint64_t>> watchedKeys;   // key and its version at WATCH
+
+    // Cluster: ASKING was sent, the next command may use a slot being imported
+    bool asking = false;
+
+    // BULKLOAD BEGIN ... END: commands run in batches without replies
+    bool bulkLoading = false;
+    BulkStats bulk;
+
+    // CLIENT TRACKING: keys read are remembered (or, with BCAST, prefixes are
+    // registered) and invalidations are sent to the REDIRECT target
+    bool tracking = false;
+    bool trackingBcast = false;
+    Tracker trackingTarget;
+
+    // This server's own connection to its primary; replies to it are suppressed
+    bool isPrimaryLink = false;
+
+    // Pub/Sub subscriptions; while any exist only subscription commands are accepted
+    std::unordered_set<std::string> channels;
+    std::unordered_set<std::string> patterns;
+    bool closeNow = false;          // output or input limit exceeded, drop without flushing
+
+    size_t pendingOutput() const { return outQueueBytes - outQueuePos + outBuf.size() - outPos; }
+
+    // Drop n written bytes from the front of the output
+    void consumeOutput(size_t n) {
+        while (n > 0 && !outQueue.empty()) {
+            size_t left = outQueue.front()->size() - outQueuePos;
+            if (n < left) {
+                outQueuePos += n;
+                return;
+            }
+            n -= left;
+            outQueueBytes -= outQueue.front()->size();
+            outQueue.pop_front();
+            outQueuePos = 0;
+        }
+        outPos += n;
+    }
+};
+
+// Subscribers of one glob pattern and the pmessage prefix encoded for it
+struct PatternSubscription {
+    std::shared_ptr<const std::string> header;
+    std::vector<Client*> clients;
+};
+
+/*
+ * One event loop owning one key partition.
+ * Each shard runs on its own thread with its own SO_REUSEPORT listener,
+ * I/O backend and KVStore. Commands for keys owned by another shard
+ * are forwarded over lock-free SPSC queues and the reply routed back.
+ */
+class Shard : public IoHandler {
+public:
+    Shard(KVServer& server, int index, KVStore& store);
+    ~Shard() override;
+
+    bool init(int port);
+    void run(const IoOptions& ioOptions);
+
+    KVStore& store() { return store_; }
+
+    // Called once all shards exist, before any of them runs
+    void connectPeers(int shardCount);
+    // Signal the shard that its inbox has new messages
+    void wakeup();
+    bool hostsReplicas() const { return replicaCount_ > 0; }
+    bool hasSubscribers() const { return subscriberCount_ > 0; }
+
+private:
+    KVServer& server_;
+    int index_;
+    KVStore& store_;
+    CommandProcessor processor_;
+
+    int listenSocket_;
+    int wakeupFd_;
+    std::unique_ptr<IoBackend> backend_;
+    std::atomic<bool> sleeping_;
+
+    std::unordered_map<uint64_t, std::unique_ptr<Client>> clients_;
+    std::vector<uint64_t> pendingWrites_;
+
+    // inbox_[src] is written only by shard src and read only by this shard
+    std::vector<std::unique_ptr<SpscQueue<ShardMessage>>> inbox_;
+    // Messages that did not fit into a peer's inbox, retried every iteration
+    std::vector<std::deque<ShardMessage>> overflow_;
+    std::vector<bool> notifyPeer_;
+
+    // Blocking commands parked on this shard's keys, by client id
+    std::unordered_map<uint64_t, BlockedRequest> blocked_;
+    std::unordered_map<std::string, std::deque<uint64_t>> blockedKeys_;   // waiters per key, oldest first
+    std::set<std::pair<std::chrono::steady_clock::time_point, uint64_t>> blockedDeadlines_;
+    std::vector<std::string> readyKeys_;    // waited-on keys written since the last serveBlocked
+
+    // Pub/Sub subscribers connected to this shard
+    std::unordered_map<std::string, std::vector<Client*>> channelSubs_;
+    std::unordered_map<std::string, PatternSubscription> patternSubs_;
+    std::atomic<int> subscriberCount_;
+
+    // Replication, primary side: writes are fed to the backlog once a replica attached
+    bool feedReplication_;
+    std::vector<uint64_t> replicaIds_;
+    std::atomic<int> replicaCount_;
+    bool replicasPending_;          // some replica can take more of the stream right now
+
+    // Replication, replica side: link to the primary, owned by shard 0
+    enum class LinkState { None, Connecting, Handshake, Snapshot, Streaming };
+    LinkState linkState_;
+    int linkFd_;
+    uint64_t linkClientId_;
+    uint64_t linkGeneration_;
+    std::string linkReplId_;
+    uint64_t linkOffset_;
+    std::chrono::steady_clock::time_point nextConnect_;
+    std::chrono::steady_clock::time_point nextAck_;
+    // A MULTI ... EXEC block of the primary's stream, applied as a whole at EXEC
+    bool replInMulti_;
+    std::vector<std::vector<std::string>> replMulti_;
+
+    std::chrono::steady_clock::time_point nextCron_;
+
+    // IoHandler
+    void onAccept(int fd) override;
+    void onData(uint64_t clientId, const char* data, size_t len) override;
+    void onClosed(uint64_t clientId) override;
+    void onWritable(uint64_t clientId) override;
+
+    void writeClient(Client& client);
+    void closeClient(uint64_t id);
+    void processInput(Client& client);
+    void dispatch(Client& client, std::vector<std::string>& args);
+    void reply(Client& client, const std::string& response);
+    void queueOutput(Client& client, const std::string& data);
+    std::string execute(const std::vector<std::string>& args, bool origin, const Tracker* tracker = nullptr);
+    void completeFanout(Client& client);
+    void runLocal(Client& client, std::vector<std::string>& args, const CommandInfo& info);
+
+    bool blockIfEmpty(const std::vector<std::string>& args, int fromShard, uint64_t clientId,
+                      const std::string& response);
+    bool unblock(uint64_t clientId, BlockedRequest& request);
+    void serveBlocked();
+    void expireBlocked();
+    void deliverBlocked(int fromShard, uint64_t clientId, const std::string& response);
+
+    void sendToShard(int target, ShardMessage&& msg);
+    bool drainInbox();
+    bool inboxEmpty() const;
+    bool hasOverflow() const;
+    void flushPeers();
+    void flushWrites();
+
+    bool transactionCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    void queueTransaction(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    void unwatchAll(Client& client);
+    std::string execBatch(const std::vector<std::vector<std::string>>& commands,
+                          const std::vector<std::pair<std::string, uint64_t>>* watched, bool feed,
+                          const Tracker* tracker = nullptr);
+    void markReady(int shard, std::vector<std::string>&& keys);
+
+    bool pubsubCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    void subscribe(Client& client, const std::string& name, bool pattern);
+    void unsubscribe(Client& client, const std::string& name, bool pattern, bool notify);
+    int deliverMessage(const std::string& channel, const std::shared_ptr<const std::string>& body);
+    void queueMessage(Client& client, const std::shared_ptr<const std::string>& header,
+                      const std::shared_ptr<const std::string>& body);
+
+    bool replicationCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    void startPsync(Client& client, std::vector<std::string>& args);
+    void finishPsync(Client& client);
+    void serveReplicas();
+    void maintainPrimaryLink();
+    void connectPrimary();
+    void linkEstablished();
+    void dropPrimaryLink();
+    void processPrimaryStream(Client& client);
+    void applyReplicated(const std::vector<std::string>& args);
+
+    bool clientCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    std::string listClients();
+    void checkOutputLimit(Client& client);
+    void clientsCron();
+    void stopTracking(Client& client);
+    void sendInvalidations();
+    void deliverInvalidation(uint64_t clientId, const std::vector<std::string>& keys);
+
+    bool captureCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+
+    bool bulkCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    void applyBulk(Client& client, std::vector<std::vector<std::string>>& commands);
+    void runBulkBatch(const std::vector<std::vector<std::string>>& commands, std::vector<std::vector<size_t>>& byShard,
+                      const std::vector<const CommandInfo*>& infos, bool feed, BulkStats& stats);
+    void bulkRestore(const std::vector<std::string>& args, bool origin, BulkStats& stats);
+
+    bool clusterCommand(Client& client, const std::string& cmd, std::vector<std::string>& args);
+    std::string clusterRedirect(const std::vector<std::string>& keys, bool asking);
+    std::string migrate(const std::vector<std::string>& args);
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef SORTED_SET_H
+#define SORTED_SET_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ScoredMember {
+    double score;
+    std::string member;
+};
+
+// Score interval of ZRANGE BYSCORE; "(" bounds are exclusive
+struct ScoreRange {
+    double min;
+    double max;
+    bool minExclusive = false;
+    bool maxExclusive = false;
+};
+
+// ZADD conditions
+enum ZAddFlags : unsigned {
+    ZADD_NX = 1 << 0,   // only add new members
+    ZADD_XX = 1 << 1,   // only update existing members
+    ZADD_GT = 1 << 2,   // only update when the new score is greater
+    ZADD_LT = 1 << 3,   // only update when the new score is less
+};
+
+/*
+ * Skiplist ordered by (score, member). Every forward link stores its span,
+ * the number of level-0 nodes it skips, so ranks are summed on the way down
+ * and an element is found by rank in O(log n).
+ */
+class SkipList {
+public:
+    SkipList();
+    ~SkipList();
+    SkipList(const SkipList&) = delete;
+    SkipList& operator=(const SkipList&) = delete;
+
+    size_t size() const { return length_; }
+    void insert(double score, const std::string& member);
+    bool remove(double score, const std::string& member);
+    // 0-based rank of an element known to be in the list
+    size_t rank(double score, const std::string& member) const;
+    // Elements [start, start + count) in ascending or descending order
+    void rangeByRank(size_t start, size_t count, bool reverse, std::vector<ScoredMember>& out) const;
+    // Number of elements below / at most the range bound
+    size_t countBelow(const ScoreRange& range) const;
+    size_t countUpTo(const ScoreRange& range) const;
+
+private:
+    struct Node;
+    struct Level {
+        Node* forward;
+        size_t span;
+    };
+    struct Node {
+        double score;
+        std::string member;
+        Node* backward;
+        std::vector<Level> levels;
+    };
+
+    static const int kMaxLevel = 32;
+
+    Node* header_;
+    Node* tail_;
+    size_t length_;
+    int level_;
+
+    static int randomLevel();
+    Node* nodeByRank(size_t rank) const;    // 1-based
+};
+
+/*
+ * Sorted set: small sets are a vector sorted by (score, member) scanned
+ * linearly, which is compact and cache friendly. Past kMaxCompactEntries
+ * entries or kMaxCompactMember bytes per member it converts to a skiplist
+ * plus a member -> score hash for O(1) score lookups and O(log n) updates.
+ */
+class SortedSet {
+public:
+    static const size_t kMaxCompactEntries = 128;
+    static const size_t kMaxCompactMember = 64;
+
+    size_t size() const;
+    bool score(const std::string& member, double& score) const;
+    // Returns true if the member was added or its score changed
+    bool set(const std::string& member, double score);
+    bool remove(const std::string& member);
+    // 0-based rank, -1 if the member is absent
+    long rank(const std::string& member, bool reverse) const;
+
+    // Ranks are 0-based and inclusive, already clamped to the set
+    std::vector<ScoredMember> rangeByRank(size_t start, size_t stop, bool reverse) const;
+    std::vector<ScoredMember> rangeByScore(const ScoreRange& range, bool reverse, size_t offset, long count) const;
+
+    // All members in ascending order (persistence)
+    std::vector<ScoredMember> entries() const;
+
+private:
+    std::vector<ScoredMember> compact_;
+    std::unique_ptr<SkipList> list_;
+    std::unordered_map<std::string, double> dict_;
+
+    void convert();
+};
+
+#endif
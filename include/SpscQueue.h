@@ -0,0 +1,70 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/*
+ * Bounded lock-free single-producer/single-consumer ring buffer.
+ * Exactly one thread may call push() and exactly one thread may call pop().
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : head_(0), tail_(0) {
+        size_t cap = 2;
+        while (cap < capacity) cap <<= 1;
+        slots_.resize(cap);
+        mask_ = cap - 1;
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer side: returns false if the queue is full
+    bool push(T&& item) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cachedHead_ > mask_) {
+            cachedHead_ = head_.load(std::memory_order_acquire);
+            if (tail - cachedHead_ > mask_) return false;
+        }
+        slots_[tail & mask_] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: returns false if the queue is empty
+    bool pop(T& item) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cachedTail_) {
+            cachedTail_ = tail_.load(std::memory_order_acquire);
+            if (head == cachedTail_) return false;
+        }
+        item = std::move(slots_[head & mask_]);
+        slots_[head & mask_] = T();
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Safe to call from either side; the answer may be stale
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> slots_;
+    size_t mask_;
+
+    // Consumer-owned
+    alignas(64) std::atomic<size_t> head_;
+    size_t cachedTail_ = 0;
+
+    // Producer-owned
+    alignas(64) std::atomic<size_t> tail_;
+    size_t cachedHead_ = 0;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Client-side caching (CLIENT TRACKING). Each store remembers which
+ * connections read which of its keys; once such a key is written, expires or
+ * is pushed out of the full table, every reader is sent an invalidation and
+ * forgotten until it reads the key again. Connections in broadcast mode
+ * register key prefixes instead and hear about every write to a matching key.
+ * Invalidations go to the connection named as REDIRECT target, identified by
+ * its id and the shard serving it.
+ */
+struct Tracker {
+    uint64_t clientId = 0;
+    int shard = 0;
+
+    bool operator==(const Tracker& other) const { return clientId == other.clientId && shard == other.shard; }
+};
+
+struct Invalidation {
+    Tracker target;
+    std::string key;
+    bool flush = false;             // every key: the keyspace was flushed
+};
+
+class TrackingTable {
+public:
+    // Keys remembered at most; past it random keys are invalidated early (0: no limit)
+    void setMaxKeys(size_t maxKeys) { maxKeys_ = maxKeys; }
+    bool empty() const { return keys_.empty() && prefixes_.empty(); }
+    size_t keys() const { return keys_.size(); }
+
+    // tracker read key
+    void track(const std::string& key, const Tracker& tracker, std::vector<Invalidation>& out);
+    // key changed: its readers and the matching prefixes are invalidated
+    void invalidate(const std::string& key, std::vector<Invalidation>& out);
+    // Keyspace flushed: everyone tracking anything gets a flush
+    void invalidateAll(std::vector<Invalidation>& out);
+
+    // Broadcast mode: target hears about writes to keys starting with prefix ("" for all) for owner
+    void addPrefix(uint64_t owner, const Tracker& target, const std::string& prefix);
+    void removePrefixes(uint64_t owner);
+
+private:
+    struct PrefixEntry {
+        std::string prefix;
+        uint64_t owner;             // connection that turned tracking on
+        Tracker target;
+    };
+    // Most keys have one or two readers; a vector beats a set in size and speed
+    std::unordered_map<std::string, std::vector<Tracker>> keys_;
+    std::vector<PrefixEntry> prefixes_;
+    size_t maxKeys_ = 0;
+    std::minstd_rand rng_;
+
+    void evictRandomKey(std::vector<Invalidation>& out);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef TRAFFIC_CAPTURE_H
+#define TRAFFIC_CAPTURE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Recording of client commands for replay with kv-replay.
+ * A capture file is the magic "KVCP", a version byte and the wall-clock
+ * start time (u64 LE microseconds since the epoch), then one record per
+ * command: varint microseconds since the start, varint connection id,
+ * varint argument count and every argument as varint length + bytes.
+ * Each shard appends to its own buffer and writes it out in blocks, so
+ * records of different connections are not in time order; the commands of
+ * one connection, always served by the same shard, are.
+ */
+class TrafficCapture {
+public:
+    explicit TrafficCapture(int shards);
+    ~TrafficCapture();
+
+    // Start recording to path, stopping by itself past maxBytes (0: no limit).
+    // False if a capture is running or the file cannot be created
+    bool start(const std::string& path, uint64_t maxBytes);
+    // Write out buffered records and close the file
+    void stop();
+    bool active() const { return active_.load(std::memory_order_relaxed); }
+
+    // Called by shard for every command its clients send
+    void record(int shard, uint64_t clientId, const std::vector<std::string>& args);
+    // Write out a shard's buffered records, called once a second so an idle capture stays current
+    void flush(int shard);
+
+    // Path, records and bytes written so far of the current or last capture
+    std::string status();
+
+private:
+    struct ShardBuffer {
+        std::mutex mutex;
+        std::string data;
+        uint64_t records = 0;
+    };
+    std::vector<std::unique_ptr<ShardBuffer>> buffers_;
+    std::atomic<bool> active_;
+    std::chrono::steady_clock::time_point startedAt_;
+
+    std::mutex fileMutex_;          // taken after a shard's buffer mutex, never before
+    std::ofstream file_;
+    std::string path_;
+    uint64_t maxBytes_;
+    uint64_t bytesWritten_;
+    uint64_t recordsWritten_;
+    bool truncated_;                // stopped at maxBytes
+
+    void writeBuffer(ShardBuffer& buffer);
+};
+
+// One command read back from a capture file
+struct CapturedCommand {
+    uint64_t micros = 0;
+    uint64_t clientId = 0;
+    std::vector<std::string> args;
+};
+
+class CaptureReader {
+public:
+    // False if path is not a capture file
+    bool open(const std::string& path);
+    // False at the end of the file or on a truncated record
+    bool next(CapturedCommand& command);
+    uint64_t startTime() const { return startTime_; }
+
+private:
+    std::ifstream in_;
+    uint64_t startTime_ = 0;
+};
+
+#endif
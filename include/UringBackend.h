@@ -0,0 +1,102 @@
+#ifndef URING_BACKEND_H
+#define URING_BACKEND_H
+
+#include "IoBackend.h"
+
+#include <deque>
+#include <linux/io_uring.h>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Completion-based backend on raw io_uring (no liburing dependency).
+ * Uses a multishot accept, multishot recv into a provided buffer ring and
+ * batches every submission of a loop iteration into the single
+ * io_uring_enter that also waits for completions.
+ */
+class UringBackend : public IoBackend {
+public:
+    UringBackend(IoHandler& handler, bool registeredBuffers);
+    ~UringBackend() override;
+
+    const char* name() const override { return "io_uring"; }
+    bool init(int listenFd, int wakeupFd) override;
+    void addClient(Client& client) override;
+    void removeClient(Client& client) override;
+    FlushResult flush(Client& client) override;
+    void poll(int timeoutMs) override;
+
+private:
+    struct Connection {
+        int fd = -1;
+        int pendingOps = 0;     // operations the kernel may still complete
+        bool closing = false;
+        bool sending = false;
+        std::string sendBuf;    // output owned by the in-flight send
+        size_t sendPos = 0;
+        int slab = -1;          // registered buffer used by the in-flight send
+        // Shared buffers owned by an in-flight sendmsg
+        std::deque<std::shared_ptr<const std::string>> sendQueue;
+        size_t sendQueuePos = 0;
+        std::vector<iovec> iov;
+        msghdr msg{};
+    };
+
+    IoHandler& handler_;
+    bool useRegisteredBuffers_;
+    int ringFd_;
+    int listenFd_;
+    int wakeupFd_;
+    uint64_t wakeupValue_;
+
+    // Submission queue
+    void* sqRing_;
+    size_t sqRingSize_;
+    unsigned* sqHead_;
+    unsigned* sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    unsigned sqLocalTail_;
+    io_uring_sqe* sqes_;
+    size_t sqesSize_;
+
+    // Completion queue
+    void* cqRing_;
+    size_t cqRingSize_;
+    unsigned* cqHead_;
+    unsigned* cqTail_;
+    unsigned cqMask_;
+    io_uring_cqe* cqes_;
+
+    // Provided buffer ring feeding multishot recv
+    io_uring_buf* bufRing_;
+    size_t bufRingSize_;
+    char* bufPool_;
+    unsigned short bufTail_;
+
+    // Registered send buffers
+    char* slabPool_;
+    std::vector<int> freeSlabs_;
+
+    std::unordered_map<uint64_t, Connection> conns_;
+
+    bool setupRing();
+    bool setupBufferRing();
+    void setupRegisteredBuffers();
+    void recycleBuffer(unsigned short bid);
+
+    io_uring_sqe* getSqe();
+    void enter(unsigned minComplete, int timeoutMs);
+    void reap();
+    void armAccept();
+    void armWakeup();
+    void armRecv(uint64_t id, Connection& conn);
+    void submitSend(uint64_t id, Connection& conn);
+    void release(uint64_t id);
+};
+
+#endif
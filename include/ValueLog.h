@@ -0,0 +1,71 @@
+#ifndef VALUE_LOG_H
+#define VALUE_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * Append-only on-disk log of cold values (tiered storage).
+ * Values are appended with pwrite and read back through an mmap of the file;
+ * callers keep an opaque handle instead of an offset, so the background
+ * compaction, which copies live values into a fresh file once more than half
+ * of it is garbage, can relocate values without touching the keyspace.
+ * Recently read values are kept in a small LRU cache.
+ * The log only extends memory: snapshots still hold every value, and the
+ * file is discarded on shutdown.
+ */
+class ValueLog {
+public:
+    ValueLog(const std::string& path, size_t cacheBytes);
+    ~ValueLog();
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    bool isOpen() const { return fd_ != -1; }
+    // Returns the value's handle, 0 if it could not be written
+    uint64_t append(const std::string& value);
+    bool read(uint64_t handle, std::string& value);
+    // The value is no longer referenced; its space is reclaimed by compaction
+    void release(uint64_t handle);
+    void clear();
+
+private:
+    struct Location {
+        uint64_t offset;
+        uint32_t length;
+    };
+    using CacheList = std::list<std::pair<uint64_t, std::string>>;
+
+    std::string path_;
+    std::mutex mutex_;
+    int fd_;
+    char* map_;
+    size_t mapSize_;
+    uint64_t end_;                  // file length
+    uint64_t liveBytes_;
+    uint64_t nextHandle_;
+    std::unordered_map<uint64_t, Location> index_;
+
+    size_t cacheLimit_;
+    size_t cacheBytes_;
+    CacheList cacheOrder_;          // most recently read first
+    std::unordered_map<uint64_t, CacheList::iterator> cache_;
+
+    std::thread compactor_;
+    bool compacting_;
+    uint64_t compactAfter_;         // after a failed compaction, the length to wait for
+
+    bool mapFile();
+    void cacheValue(uint64_t handle, const std::string& value);
+    void uncache(uint64_t handle);
+    void maybeCompact();
+    void compact();
+};
+
+#endif
@@ -0,0 +1,341 @@
+#include "../include/Bitops.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__x86_64__)
+static bool hasAvx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+
+static bool hasPopcnt() {
+    static const bool popcnt = __builtin_cpu_supports("popcnt");
+    return popcnt;
+}
+#endif
+
+static uint64_t loadWord(const uint8_t* p) {
+    uint64_t w;
+    std::memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+//----------------------
+// Popcount
+//----------------------
+static uint64_t popcountScalar(const uint8_t* data, size_t len) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        count += __builtin_popcountll(loadWord(data + i));
+    for (; i < len; i++)
+        count += __builtin_popcount(data[i]);
+    return count;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("popcnt")))
+static uint64_t popcountHardware(const uint8_t* data, size_t len) {
+    uint64_t count = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+        count += __builtin_popcountll(loadWord(data + i));
+    for (; i < len; i++)
+        count += __builtin_popcount(data[i]);
+    return count;
+}
+
+// Per-byte counts from a nibble lookup table, summed into four 64-bit lanes
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, lowMask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), lowMask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+// Carry-save adder: h:l = a + b + c, bit by bit
+__attribute__((target("avx2")))
+static inline void csa(__m256i& h, __m256i& l, __m256i a, __m256i b, __m256i c) {
+    __m256i u = _mm256_xor_si256(a, b);
+    h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    l = _mm256_xor_si256(u, c);
+}
+
+/*
+ * Harley-Seal (Mula, Kurz, Lemire): a tree of carry-save adders reduces 16
+ * vectors to one "sixteens" vector, so only one in 16 vectors goes through
+ * the lookup-table popcount.
+ */
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcountAvx2(const uint8_t* data, size_t len) {
+    const __m256i* v = reinterpret_cast<const __m256i*>(data);
+    size_t words = len / 32;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+    __m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256();
+    __m256i sixteens, twosA, twosB, foursA, foursB, eightsA, eightsB;
+    size_t i = 0;
+    for (; i + 16 <= words; i += 16) {
+        csa(twosA, ones, ones, _mm256_loadu_si256(v + i), _mm256_loadu_si256(v + i + 1));
+        csa(twosB, ones, ones, _mm256_loadu_si256(v + i + 2), _mm256_loadu_si256(v + i + 3));
+        csa(foursA, twos, twos, twosA, twosB);
+        csa(twosA, ones, ones, _mm256_loadu_si256(v + i + 4), _mm256_loadu_si256(v + i + 5));
+        csa(twosB, ones, ones, _mm256_loadu_si256(v + i + 6), _mm256_loadu_si256(v + i + 7));
+        csa(foursB, twos, twos, twosA, twosB);
+        csa(eightsA, fours, fours, foursA, foursB);
+        csa(twosA, ones, ones, _mm256_loadu_si256(v + i + 8), _mm256_loadu_si256(v + i + 9));
+        csa(twosB, ones, ones, _mm256_loadu_si256(v + i + 10), _mm256_loadu_si256(v + i + 11));
+        csa(foursA, twos, twos, twosA, twosB);
+        csa(twosA, ones, ones, _mm256_loadu_si256(v + i + 12), _mm256_loadu_si256(v + i + 13));
+        csa(twosB, ones, ones, _mm256_loadu_si256(v + i + 14), _mm256_loadu_si256(v + i + 15));
+        csa(foursB, twos, twos, twosA, twosB);
+        csa(eightsB, fours, fours, foursA, foursB);
+        csa(sixteens, eights, eights, eightsA, eightsB);
+        total = _mm256_add_epi64(total, popcount256(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount256(twos), 1));
+    total = _mm256_add_epi64(total, popcount256(ones));
+    for (; i < words; i++)
+        total = _mm256_add_epi64(total, popcount256(_mm256_loadu_si256(v + i)));
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), total);
+    uint64_t count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (size_t j = words * 32; j < len; j++)
+        count += __builtin_popcount(data[j]);
+    return count;
+}
+#endif
+
+uint64_t popcount(const uint8_t* data, size_t len) {
+#if defined(__x86_64__)
+    // Below one Harley-Seal block the adder tree never runs
+    if (len >= 512 && hasAvx2()) return popcountAvx2(data, len);
+    if (hasPopcnt()) return popcountHardware(data, len);
+#endif
+    return popcountScalar(data, len);
+}
+
+uint64_t popcountBits(const uint8_t* data, uint64_t startBit, uint64_t endBit) {
+    uint64_t first = startBit / 8, last = endBit / 8;
+    uint8_t firstMask = static_cast<uint8_t>(0xff >> (startBit % 8));
+    uint8_t lastMask = static_cast<uint8_t>(0xff << (7 - endBit % 8));
+    if (first == last)
+        return __builtin_popcount(data[first] & firstMask & lastMask);
+    return __builtin_popcount(data[first] & firstMask) + __builtin_popcount(data[last] & lastMask) +
+           popcount(data + first + 1, last - first - 1);
+}
+
+//----------------------
+// Bit Search
+//----------------------
+static int bitAt(const uint8_t* data, uint64_t pos) {
+    return (data[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static size_t skipBytesAvx2(const uint8_t* data, size_t i, size_t end, int bit) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    for (; i + 32 <= end; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        if (bit ? !_mm256_testz_si256(v, v) : !_mm256_testc_si256(v, ones)) break;
+    }
+    return i;
+}
+#endif
+
+// First byte in [i, end) that holds bit
+static size_t skipBytes(const uint8_t* data, size_t i, size_t end, int bit) {
+#if defined(__x86_64__)
+    if (hasAvx2()) i = skipBytesAvx2(data, i, end, bit);
+#endif
+    uint64_t skipWord = bit ? 0 : ~uint64_t(0);
+    for (; i + 8 <= end && loadWord(data + i) == skipWord; i += 8) {}
+    uint8_t skipByte = bit ? 0 : 0xff;
+    for (; i < end && data[i] == skipByte; i++) {}
+    return i;
+}
+
+int64_t findBit(const uint8_t* data, uint64_t startBit, uint64_t endBit, int bit) {
+    uint64_t pos = startBit;
+    for (; pos <= endBit && pos % 8 != 0; pos++) {
+        if (bitAt(data, pos) == bit) return static_cast<int64_t>(pos);
+    }
+    // Whole bytes inside the range are skipped in bulk
+    uint64_t wholeEnd = (endBit + 1) / 8;
+    if (pos <= endBit && pos / 8 < wholeEnd)
+        pos = skipBytes(data, pos / 8, wholeEnd, bit) * 8;
+    for (; pos <= endBit; pos++) {
+        if (bitAt(data, pos) == bit) return static_cast<int64_t>(pos);
+    }
+    return -1;
+}
+
+//----------------------
+// BITOP
+//----------------------
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static size_t bitwiseAvx2(BitOp op, uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i r;
+        switch (op) {
+        case BITOP_AND: r = _mm256_and_si256(_mm256_loadu_si256(out), s); break;
+        case BITOP_OR: r = _mm256_or_si256(_mm256_loadu_si256(out), s); break;
+        case BITOP_XOR: r = _mm256_xor_si256(_mm256_loadu_si256(out), s); break;
+        default: r = _mm256_xor_si256(s, _mm256_set1_epi8(-1)); break;
+        }
+        _mm256_storeu_si256(out, r);
+    }
+    return i;
+}
+#endif
+
+void bitwiseInto(BitOp op, uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+#if defined(__x86_64__)
+    if (hasAvx2()) i = bitwiseAvx2(op, dst, src, len);
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t d = loadWord(dst + i), s = loadWord(src + i);
+        switch (op) {
+        case BITOP_AND: d &= s; break;
+        case BITOP_OR: d |= s; break;
+        case BITOP_XOR: d ^= s; break;
+        case BITOP_NOT: d = ~s; break;
+        }
+        std::memcpy(dst + i, &d, sizeof(d));
+    }
+    for (; i < len; i++) {
+        switch (op) {
+        case BITOP_AND: dst[i] &= src[i]; break;
+        case BITOP_OR: dst[i] |= src[i]; break;
+        case BITOP_XOR: dst[i] ^= src[i]; break;
+        case BITOP_NOT: dst[i] = static_cast<uint8_t>(~src[i]); break;
+        }
+    }
+}
+
+//----------------------
+// BITFIELD
+//----------------------
+static uint64_t getField(const uint8_t* data, size_t len, uint64_t offset, unsigned bits) {
+    uint64_t value = 0;
+    for (unsigned j = 0; j < bits; j++) {
+        uint64_t pos = offset + j;
+        int bit = (pos >> 3) < len ? bitAt(data, pos) : 0;
+        value = (value << 1) | static_cast<uint64_t>(bit);
+    }
+    return value;
+}
+
+static void setField(uint8_t* data, uint64_t offset, unsigned bits, uint64_t value) {
+    for (unsigned j = 0; j < bits; j++) {
+        uint64_t pos = offset + j;
+        uint8_t mask = static_cast<uint8_t>(1 << (7 - (pos & 7)));
+        if ((value >> (bits - 1 - j)) & 1)
+            data[pos >> 3] |= mask;
+        else
+            data[pos >> 3] &= static_cast<uint8_t>(~mask);
+    }
+}
+
+static int64_t signExtend(uint64_t value, unsigned bits) {
+    if (bits < 64 && ((value >> (bits - 1)) & 1))
+        value |= ~uint64_t(0) << bits;
+    return static_cast<int64_t>(value);
+}
+
+// Overflow checks as in Redis: non-zero if value + incr leaves the type's
+// range, with the wrapped or saturated result in limit
+static int unsignedOverflow(uint64_t value, int64_t incr, unsigned bits, BitFieldOverflow overflow, uint64_t& limit) {
+    uint64_t max = bits == 64 ? UINT64_MAX : (uint64_t(1) << bits) - 1;
+    int64_t maxIncr = static_cast<int64_t>(max - value);
+    int64_t minIncr = static_cast<int64_t>(uint64_t(0) - value);
+    int result = 0;
+    if (value > max || (incr > 0 && incr > maxIncr)) {
+        limit = max;
+        result = 1;
+    } else if (incr < 0 && incr < minIncr) {
+        limit = 0;
+        result = -1;
+    }
+    if (result && overflow == OVERFLOW_WRAP)
+        limit = (value + static_cast<uint64_t>(incr)) & max;
+    return result;
+}
+
+static int signedOverflow(int64_t value, int64_t incr, unsigned bits, BitFieldOverflow overflow, int64_t& limit) {
+    int64_t max = bits == 64 ? INT64_MAX : (int64_t(1) << (bits - 1)) - 1;
+    int64_t min = -max - 1;
+    int64_t maxIncr = static_cast<int64_t>(static_cast<uint64_t>(max) - static_cast<uint64_t>(value));
+    int64_t minIncr = static_cast<int64_t>(static_cast<uint64_t>(min) - static_cast<uint64_t>(value));
+    int result = 0;
+    if (value > max || (bits != 64 && incr > maxIncr) || (value >= 0 && incr > 0 && incr > maxIncr)) {
+        limit = max;
+        result = 1;
+    } else if (value < min || (bits != 64 && incr < minIncr) || (value < 0 && incr < 0 && incr < minIncr)) {
+        limit = min;
+        result = -1;
+    }
+    if (result && overflow == OVERFLOW_WRAP) {
+        uint64_t sum = static_cast<uint64_t>(value) + static_cast<uint64_t>(incr);
+        limit = signExtend(bits == 64 ? sum : sum & ((uint64_t(1) << bits) - 1), bits);
+    }
+    return result;
+}
+
+int64_t readBitField(const BitFieldOp& op, const uint8_t* data, size_t len) {
+    uint64_t value = getField(data, len, op.offset, op.bits);
+    return op.isSigned ? signExtend(value, op.bits) : static_cast<int64_t>(value);
+}
+
+bool applyBitField(const BitFieldOp& op, uint8_t* data, size_t len, int64_t& reply) {
+    if (op.kind == BitFieldOp::GET) {
+        reply = readBitField(op, data, len);
+        return true;
+    }
+    uint64_t current = getField(data, len, op.offset, op.bits);
+    // SET checks its value against the type, INCRBY the sum
+    int64_t incr = op.kind == BitFieldOp::SET ? 0 : op.value;
+    uint64_t updated;
+    if (op.isSigned) {
+        int64_t old = signExtend(current, op.bits);
+        int64_t base = op.kind == BitFieldOp::SET ? op.value : old;
+        int64_t limit;
+        if (signedOverflow(base, incr, op.bits, op.overflow, limit)) {
+            if (op.overflow == OVERFLOW_FAIL) return false;
+            updated = static_cast<uint64_t>(limit);
+        } else {
+            updated = static_cast<uint64_t>(base) + static_cast<uint64_t>(incr);
+        }
+        reply = op.kind == BitFieldOp::SET ? old : signExtend(updated, 64);
+    } else {
+        uint64_t base = op.kind == BitFieldOp::SET ? static_cast<uint64_t>(op.value) : current;
+        uint64_t limit;
+        if (unsignedOverflow(base, incr, op.bits, op.overflow, limit)) {
+            if (op.overflow == OVERFLOW_FAIL) return false;
+            updated = limit;
+        } else {
+            updated = base + static_cast<uint64_t>(incr);
+        }
+        reply = op.kind == BitFieldOp::SET ? static_cast<int64_t>(current) : static_cast<int64_t>(updated);
+    }
+    setField(data, op.offset, op.bits, updated);
+    return true;
+}
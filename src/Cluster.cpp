@@ -0,0 +1,361 @@
+#include "../include/Cluster.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+//----------------------
+// Hash Slots
+//----------------------
+// CRC16-CCITT (XMODEM), polynomial 0x1021, the variant Redis Cluster uses
+static const std::vector<uint16_t>& crc16Table() {
+    static const std::vector<uint16_t> table = [] {
+        std::vector<uint16_t> t(256);
+        for (int i = 0; i < 256; i++) {
+            uint16_t crc = static_cast<uint16_t>(i << 8);
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+            t[i] = crc;
+        }
+        return t;
+    }();
+    return table;
+}
+
+static uint16_t crc16(const char* data, size_t len) {
+    const auto& table = crc16Table();
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+        crc = static_cast<uint16_t>((crc << 8) ^ table[((crc >> 8) ^ static_cast<uint8_t>(data[i])) & 0xff]);
+    return crc;
+}
+
+// Only the part between the first '{' and the following '}' is hashed, if non-empty
+int keyHashSlot(const std::string& key) {
+    size_t open = key.find('{');
+    if (open != std::string::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string::npos && close != open + 1)
+            return crc16(key.data() + open + 1, close - open - 1) & (Cluster::kSlots - 1);
+    }
+    return crc16(key.data(), key.size()) & (Cluster::kSlots - 1);
+}
+
+//----------------------
+// Cluster
+//----------------------
+static std::string bulkString(const std::string& value) {
+    return "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+}
+
+// 40 hex characters derived from the address, identical in every process
+static std::string nodeIdFor(const std::string& host, int port) {
+    std::string addr = host + ":" + std::to_string(port);
+    std::string id;
+    for (uint64_t seed : {14695981039346656037ULL, 1099511628211ULL, 0x9e3779b97f4a7c15ULL}) {
+        uint64_t hash = seed;
+        for (char c : addr) {
+            hash ^= static_cast<uint8_t>(c);
+            hash *= 1099511628211ULL;
+        }
+        // fmix64 so that similar addresses give unrelated ids
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ULL;
+        hash ^= hash >> 33;
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        id += hex;
+    }
+    return id.substr(0, 40);
+}
+
+static bool parseAddress(const std::string& addr, std::string& host, int& port) {
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos || colon == 0) return false;
+    host = addr.substr(0, colon);
+    port = std::atoi(addr.c_str() + colon + 1);
+    return port > 0 && port <= 65535;
+}
+
+Cluster::Cluster()
+    : enabled_(false), owner_(kSlots, -1), migrating_(kSlots, -1), importing_(kSlots, -1) {}
+
+void Cluster::enable(const std::string& host, int port, const std::string& configFile) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    nodes_.clear();
+    nodes_.push_back(Node{nodeIdFor(host, port), host, port});
+    configFile_ = configFile;
+    enabled_ = true;
+}
+
+int Cluster::findNode(const std::string& id) const {
+    for (size_t i = 0; i < nodes_.size(); i++) {
+        if (!nodes_[i].id.empty() && nodes_[i].id == id) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+int Cluster::addNode(const std::string& host, int port) {
+    int existing = findNode(nodeIdFor(host, port));
+    if (existing >= 0) return existing;
+    nodes_.push_back(Node{nodeIdFor(host, port), host, port});
+    return static_cast<int>(nodes_.size()) - 1;
+}
+
+bool Cluster::assignEvenly(const std::vector<std::string>& addresses) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    std::vector<int> members;
+    for (const auto& addr : addresses) {
+        std::string host;
+        int port;
+        if (!parseAddress(addr, host, port)) return false;
+        bool isSelf = port == nodes_[0].port && (host == nodes_[0].host || host == "localhost");
+        members.push_back(isSelf ? 0 : addNode(host, port));
+    }
+    if (members.empty()) return false;
+    for (size_t i = 0; i < members.size(); i++) {
+        int first = static_cast<int>(i * kSlots / members.size());
+        int last = static_cast<int>((i + 1) * kSlots / members.size());
+        for (int slot = first; slot < last; slot++)
+            owner_[slot] = members[i];
+    }
+    saveConfig();
+    return true;
+}
+
+// The config file holds CLUSTER NODES lines; the "myself" line is this process
+bool Cluster::loadConfig() {
+    std::ifstream in(configFile_);
+    if (!in) return false;
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> tokens;
+        std::string token;
+        while (fields >> token)
+            tokens.push_back(token);
+        if (tokens.size() < 8) continue;
+
+        std::string host;
+        int port;
+        if (!parseAddress(tokens[1].substr(0, tokens[1].find('@')), host, port)) continue;
+        int node = tokens[2].find("myself") != std::string::npos ? 0 : addNode(host, port);
+        for (size_t i = 8; i < tokens.size(); i++) {
+            int first = 0, last = 0;
+            if (std::sscanf(tokens[i].c_str(), "%d-%d", &first, &last) == 1)
+                last = first;
+            for (int slot = std::max(0, first); slot <= last && slot < kSlots; slot++)
+                owner_[slot] = node;
+        }
+    }
+    return true;
+}
+
+void Cluster::saveConfig() const {
+    if (configFile_.empty()) return;
+    std::string tmp = configFile_ + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out) return;
+        out << describeNodes(false);
+    }
+    std::rename(tmp.c_str(), configFile_.c_str());
+}
+
+SlotRoute Cluster::route(int slot) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    SlotRoute route;
+    route.owner = owner_[slot];
+    route.migratingTo = migrating_[slot];
+    route.importingFrom = importing_[slot];
+    return route;
+}
+
+std::string Cluster::nodeAddress(int node) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return nodes_[node].host + ":" + std::to_string(nodes_[node].port);
+}
+
+std::string Cluster::myId() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return nodes_[0].id;
+}
+
+bool Cluster::meet(const std::string& host, int port) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    addNode(host, port);
+    saveConfig();
+    return true;
+}
+
+bool Cluster::forget(const std::string& id, std::string& error) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    int node = findNode(id);
+    if (node == 0) {
+        error = "ERR I tried hard but I can't forget myself...";
+        return false;
+    }
+    if (node < 0) {
+        error = "ERR Unknown node " + id;
+        return false;
+    }
+    // Indexes stay stable; the entry is only blanked
+    nodes_[node].id.clear();
+    for (int slot = 0; slot < kSlots; slot++) {
+        if (owner_[slot] == node) owner_[slot] = -1;
+        if (migrating_[slot] == node) migrating_[slot] = -1;
+        if (importing_[slot] == node) importing_[slot] = -1;
+    }
+    saveConfig();
+    return true;
+}
+
+bool Cluster::addSlots(const std::vector<int>& slots, std::string& error) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (int slot : slots) {
+        if (owner_[slot] != -1) {
+            error = "ERR Slot " + std::to_string(slot) + " is already busy";
+            return false;
+        }
+    }
+    for (int slot : slots)
+        owner_[slot] = 0;
+    saveConfig();
+    return true;
+}
+
+bool Cluster::delSlots(const std::vector<int>& slots, std::string& error) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (int slot : slots) {
+        if (owner_[slot] == -1) {
+            error = "ERR Slot " + std::to_string(slot) + " is already unassigned";
+            return false;
+        }
+    }
+    for (int slot : slots) {
+        owner_[slot] = -1;
+        migrating_[slot] = importing_[slot] = -1;
+    }
+    saveConfig();
+    return true;
+}
+
+bool Cluster::setSlot(int slot, const std::string& state, const std::string& nodeId, std::string& error) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    if (state == "STABLE") {
+        migrating_[slot] = importing_[slot] = -1;
+        return true;
+    }
+    int node = findNode(nodeId);
+    if (node < 0) {
+        error = "ERR I don't know about node " + nodeId;
+        return false;
+    }
+    if (state == "MIGRATING") {
+        if (owner_[slot] != 0) {
+            error = "ERR I'm not the owner of hash slot " + std::to_string(slot);
+            return false;
+        }
+        migrating_[slot] = node;
+    } else if (state == "IMPORTING") {
+        if (owner_[slot] == 0) {
+            error = "ERR I'm already the owner of hash slot " + std::to_string(slot);
+            return false;
+        }
+        importing_[slot] = node;
+    } else if (state == "NODE") {
+        owner_[slot] = node;
+        migrating_[slot] = importing_[slot] = -1;
+        saveConfig();
+    } else {
+        error = "ERR Invalid CLUSTER SETSLOT action or number of arguments";
+        return false;
+    }
+    return true;
+}
+
+std::string Cluster::infoText() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    int assigned = 0, known = 0;
+    std::vector<bool> hasSlots(nodes_.size(), false);
+    for (int slot = 0; slot < kSlots; slot++) {
+        if (owner_[slot] < 0) continue;
+        assigned++;
+        hasSlots[owner_[slot]] = true;
+    }
+    int size = 0;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+        if (nodes_[i].id.empty()) continue;
+        known++;
+        if (hasSlots[i]) size++;
+    }
+    std::ostringstream oss;
+    oss << "cluster_enabled:1\r\n"
+        << "cluster_state:" << (assigned == kSlots ? "ok" : "fail") << "\r\n"
+        << "cluster_slots_assigned:" << assigned << "\r\n"
+        << "cluster_slots_ok:" << assigned << "\r\n"
+        << "cluster_known_nodes:" << known << "\r\n"
+        << "cluster_size:" << size << "\r\n";
+    return oss.str();
+}
+
+std::string Cluster::nodesText() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return describeNodes(true);
+}
+
+// CLUSTER NODES format: id addr@cport flags master ping pong epoch link slots...
+std::string Cluster::describeNodes(bool withTransfers) const {
+    std::ostringstream oss;
+    for (size_t node = 0; node < nodes_.size(); node++) {
+        if (nodes_[node].id.empty()) continue;
+        const Node& n = nodes_[node];
+        oss << n.id << " " << n.host << ":" << n.port << "@" << n.port + 10000 << " "
+            << (node == 0 ? "myself,master" : "master") << " - 0 0 0 connected";
+        for (int slot = 0; slot < kSlots; slot++) {
+            if (owner_[slot] != static_cast<int>(node)) continue;
+            int last = slot;
+            while (last + 1 < kSlots && owner_[last + 1] == static_cast<int>(node))
+                last++;
+            oss << " " << slot;
+            if (last > slot) oss << "-" << last;
+            slot = last;
+        }
+        if (withTransfers && node == 0) {
+            for (int slot = 0; slot < kSlots; slot++) {
+                if (migrating_[slot] >= 0)
+                    oss << " [" << slot << "->-" << nodes_[migrating_[slot]].id << "]";
+                if (importing_[slot] >= 0)
+                    oss << " [" << slot << "-<-" << nodes_[importing_[slot]].id << "]";
+            }
+        }
+        oss << "\n";
+    }
+    return oss.str();
+}
+
+std::string Cluster::slotsReply() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    std::string body;
+    int ranges = 0;
+    for (int slot = 0; slot < kSlots; slot++) {
+        int node = owner_[slot];
+        if (node < 0) continue;
+        int last = slot;
+        while (last + 1 < kSlots && owner_[last + 1] == node)
+            last++;
+        const Node& n = nodes_[node];
+        body += "*3\r\n:" + std::to_string(slot) + "\r\n:" + std::to_string(last) + "\r\n" +
+                "*3\r\n" + bulkString(n.host) + ":" + std::to_string(n.port) + "\r\n" + bulkString(n.id);
+        ranges++;
+        slot = last;
+    }
+    return "*" + std::to_string(ranges) + "\r\n" + body;
+}
@@ -4,8 +4,13 @@
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <exception>
 #include <iostream>
+#include <stdexcept>
+#include <unordered_map>
 
 /*
  * RESP Protocol Parser
@@ -53,6 +58,204 @@ std::vector<std::string> parseProtocol(const std::string& input) {
     return tokens;
 }
 
+// Parse a non-negative decimal integer terminated by CRLF at buf[pos..].
+// Returns the position after CRLF, 0 if incomplete, -1 if malformed.
+static long parseLength(const std::string& buf, size_t pos, long& value) {
+    size_t crlfPos = buf.find("\r\n", pos);
+    if (crlfPos == std::string::npos)
+        return buf.size() - pos > 32 ? -1 : 0;
+    if (crlfPos == pos || crlfPos - pos > 18) return -1;
+    value = 0;
+    for (size_t i = pos; i < crlfPos; i++) {
+        if (buf[i] < '0' || buf[i] > '9') return -1;
+        value = value * 10 + (buf[i] - '0');
+    }
+    return static_cast<long>(crlfPos + 2);
+}
+
+long parseCommand(const std::string& buf, size_t pos, std::vector<std::string>& tokens) {
+    tokens.clear();
+    if (pos >= buf.size()) return 0;
+
+    // Inline command: a single whitespace separated line
+    if (buf[pos] != '*') {
+        size_t newline = buf.find('\n', pos);
+        if (newline == std::string::npos)
+            return buf.size() - pos > 64 * 1024 ? -1 : 0;
+        std::istringstream stream(buf.substr(pos, newline - pos));
+        std::string token;
+        while (stream >> token)
+            tokens.push_back(token);
+        return static_cast<long>(newline + 1 - pos);
+    }
+
+    long elementCount = 0;
+    long next = parseLength(buf, pos + 1, elementCount);
+    if (next <= 0) return next;
+    if (elementCount > 1024 * 1024) return -1;
+
+    size_t cursor = next;
+    tokens.reserve(elementCount);
+    for (long i = 0; i < elementCount; i++) {
+        if (cursor >= buf.size()) return 0;
+        if (buf[cursor] != '$') return -1;
+        long strLen = 0;
+        next = parseLength(buf, cursor + 1, strLen);
+        if (next <= 0) return next;
+        if (strLen > 512L * 1024 * 1024) return -1;
+        cursor = next;
+        if (cursor + strLen + 2 > buf.size()) return 0;
+        tokens.emplace_back(buf, cursor, strLen);
+        cursor += strLen + 2; // skip token and CRLF
+    }
+    return static_cast<long>(cursor - pos);
+}
+
+static bool globMatchAt(const char* p, const char* pEnd, const char* s, const char* sEnd) {
+    while (p < pEnd) {
+        switch (*p) {
+        case '*':
+            while (p + 1 < pEnd && p[1] == '*') p++;
+            if (p + 1 == pEnd) return true;
+            for (const char* rest = s; rest <= sEnd; rest++) {
+                if (globMatchAt(p + 1, pEnd, rest, sEnd)) return true;
+            }
+            return false;
+        case '?':
+            if (s == sEnd) return false;
+            s++;
+            break;
+        case '[': {
+            if (s == sEnd) return false;
+            p++;
+            bool negate = p < pEnd && *p == '^';
+            if (negate) p++;
+            bool matched = false;
+            while (p < pEnd && *p != ']') {
+                if (*p == '\\' && p + 1 < pEnd) {
+                    p++;
+                    matched |= *p == *s;
+                } else if (p + 2 < pEnd && p[1] == '-' && p[2] != ']') {
+                    char lo = std::min(p[0], p[2]), hi = std::max(p[0], p[2]);
+                    matched |= *s >= lo && *s <= hi;
+                    p += 2;
+                } else {
+                    matched |= *p == *s;
+                }
+                p++;
+            }
+            if (matched == negate) return false;
+            s++;
+            break;
+        }
+        case '\\':
+            if (p + 1 < pEnd) p++;
+            // fall through
+        default:
+            if (s == sEnd || *p != *s) return false;
+            s++;
+            break;
+        }
+        if (p < pEnd) p++;
+    }
+    return s == sEnd;
+}
+
+bool globMatch(const std::string& pattern, const std::string& str) {
+    return globMatchAt(pattern.data(), pattern.data() + pattern.size(), str.data(), str.data() + str.size());
+}
+
+//----------------------
+// Command Table
+//----------------------
+static const CommandInfo commandTable[] = {
+    // General Commands
+    {"PING",     -1, 0, 0, 0, 0},
+    {"ECHO",     -2, 0, 0, 0, 0},
+    {"FLUSHALL", -1, 0, 0, 0, CMD_WRITE | CMD_ALL_SHARDS},
+    // String Operations
+    {"SET",      -3, 1, 1, 1, CMD_WRITE},
+    {"GET",      -2, 1, 1, 1, 0},
+    {"KEYS",     -1, 0, 0, 0, CMD_ALL_SHARDS},
+    {"TYPE",     -2, 1, 1, 1, 0},
+    {"DEL",      -2, 1, 1, 1, CMD_WRITE},
+    {"UNLINK",   -2, 1, -1, 1, CMD_WRITE},
+    {"EXPIRE",   -3, 1, 1, 1, CMD_WRITE},
+    {"RENAME",   -3, 1, 2, 1, CMD_WRITE},
+    {"DUMP",     -2, 1, 1, 1, 0},
+    {"RESTORE",  -4, 1, 1, 1, CMD_WRITE},
+    // List Operations
+    {"LGET",     -2, 1, 1, 1, 0},
+    {"LLEN",     -2, 1, 1, 1, 0},
+    {"LPUSH",    -3, 1, 1, 1, CMD_WRITE},
+    {"RPUSH",    -3, 1, 1, 1, CMD_WRITE},
+    {"LPOP",     -2, 1, 1, 1, CMD_WRITE},
+    {"RPOP",     -2, 1, 1, 1, CMD_WRITE},
+    {"LREM",     -4, 1, 1, 1, CMD_WRITE},
+    {"LINDEX",   -3, 1, 1, 1, 0},
+    {"LSET",     -4, 1, 1, 1, CMD_WRITE},
+    {"LMOVE",    -5, 1, 2, 1, CMD_WRITE},
+    {"BLPOP",    -3, 1, -2, 1, CMD_WRITE | CMD_BLOCKING},
+    {"BRPOP",    -3, 1, -2, 1, CMD_WRITE | CMD_BLOCKING},
+    {"BLMOVE",    6, 1, 2, 1, CMD_WRITE | CMD_BLOCKING},
+    // Hash Operations
+    {"HSET",     -4, 1, 1, 1, CMD_WRITE},
+    {"HGET",     -3, 1, 1, 1, 0},
+    {"HEXISTS",  -3, 1, 1, 1, 0},
+    {"HDEL",     -3, 1, 1, 1, CMD_WRITE},
+    {"HGETALL",  -2, 1, 1, 1, 0},
+    {"HKEYS",    -2, 1, 1, 1, 0},
+    {"HVALS",    -2, 1, 1, 1, 0},
+    {"HLEN",     -2, 1, 1, 1, 0},
+    {"HMSET",    -4, 1, 1, 1, CMD_WRITE},
+    // Sorted Set Operations
+    {"ZADD",     -4, 1, 1, 1, CMD_WRITE},
+    {"ZINCRBY",   4, 1, 1, 1, CMD_WRITE},
+    {"ZREM",     -3, 1, 1, 1, CMD_WRITE},
+    {"ZCARD",    -2, 1, 1, 1, 0},
+    {"ZSCORE",   -3, 1, 1, 1, 0},
+    {"ZRANK",    -3, 1, 1, 1, 0},
+    {"ZREVRANK", -3, 1, 1, 1, 0},
+    {"ZRANGE",   -4, 1, 1, 1, 0},
+    {"ZREVRANGE",-4, 1, 1, 1, 0},
+    // Bitmap Operations
+    {"SETBIT",    4, 1, 1, 1, CMD_WRITE},
+    {"GETBIT",    3, 1, 1, 1, 0},
+    {"BITCOUNT", -2, 1, 1, 1, 0},
+    {"BITPOS",   -3, 1, 1, 1, 0},
+    {"BITOP",    -4, 2, -1, 1, CMD_WRITE},
+    {"BITFIELD", -2, 1, 1, 1, CMD_WRITE},
+    // HyperLogLog Operations
+    {"PFADD",    -2, 1, 1, 1, CMD_WRITE},
+    {"PFCOUNT",  -2, 1, -1, 1, 0},
+    {"PFMERGE",  -2, 1, -1, 1, CMD_WRITE},
+};
+
+const CommandInfo* lookupCommand(const std::string& name) {
+    static const std::unordered_map<std::string, const CommandInfo*> index = [] {
+        std::unordered_map<std::string, const CommandInfo*> byName;
+        for (const auto& info : commandTable)
+            byName[info.name] = &info;
+        return byName;
+    }();
+    auto it = index.find(name);
+    return it != index.end() ? it->second : nullptr;
+}
+
+bool checkArity(const CommandInfo& info, size_t argc) {
+    int count = static_cast<int>(argc);
+    return info.arity >= 0 ? count == info.arity : count >= -info.arity;
+}
+
+std::vector<std::string> commandKeys(const CommandInfo& info, const std::vector<std::string>& args) {
+    std::vector<std::string> keys;
+    if (info.firstKey <= 0) return keys;
+    int last = info.lastKey < 0 ? static_cast<int>(args.size()) + info.lastKey : info.lastKey;
+    for (int i = info.firstKey; i <= last && i < static_cast<int>(args.size()); i += info.keyStep)
+        keys.push_back(args[i]);
+    return keys;
+}
+
 //----------------------
 // General Commands
 //----------------------
@@ -66,8 +269,19 @@ static std::string cmdEcho(const std::vector<std::string>& args, KVStore& /*stor
     return "+" + args[1] + "\r\n";
 }
 
-static std::string cmdFlushAll(const std::vector<std::string>& /*args*/, KVStore& store) {
-    store.clearAll();
+// FLUSHALL [ASYNC|SYNC]: ASYNC frees the old keyspace in the background
+static std::string cmdFlushAll(const std::vector<std::string>& args, KVStore& store) {
+    bool async = false;
+    if (args.size() > 2)
+        return "-ERR syntax error\r\n";
+    if (args.size() == 2) {
+        std::string mode = args[1];
+        std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+        if (mode != "ASYNC" && mode != "SYNC")
+            return "-ERR syntax error\r\n";
+        async = mode == "ASYNC";
+    }
+    store.clearAll(async);
     return "+OK\r\n";
 }
 
@@ -112,6 +326,16 @@ static std::string cmdDel(const std::vector<std::string>& args, KVStore& store)
     return ":" + std::to_string(removed ? 1 : 0) + "\r\n";
 }
 
+static std::string cmdUnlink(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR UNLINK requires key\r\n";
+    size_t removed = 0;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (store.unlinkKey(args[i])) removed++;
+    }
+    return ":" + std::to_string(removed) + "\r\n";
+}
+
 static std::string cmdExpire(const std::vector<std::string>& args, KVStore& store) {
     if (args.size() < 3)
         return "-ERR EXPIRE requires key and seconds\r\n";
@@ -134,6 +358,38 @@ static std::string cmdRename(const std::vector<std::string>& args, KVStore& stor
     return "-ERR Key not found or rename failed\r\n";
 }
 
+// DUMP key: serialized value as a bulk string, null if the key does not exist
+static std::string cmdDump(const std::vector<std::string>& args, KVStore& store) {
+    std::string payload;
+    if (!store.dumpKey(args[1], payload))
+        return "$-1\r\n";
+    return "$" + std::to_string(payload.size()) + "\r\n" + payload + "\r\n";
+}
+
+// RESTORE key ttl-ms payload [REPLACE]
+static std::string cmdRestore(const std::vector<std::string>& args, KVStore& store) {
+    long long ttlMs;
+    try {
+        size_t used;
+        ttlMs = std::stoll(args[2], &used);
+        if (used != args[2].size() || ttlMs < 0) throw std::invalid_argument(args[2]);
+    } catch (const std::exception&) {
+        return "-ERR Invalid TTL value, must be >= 0\r\n";
+    }
+    bool replace = false;
+    for (size_t i = 4; i < args.size(); i++) {
+        std::string option = args[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option != "REPLACE")
+            return "-ERR syntax error\r\n";
+        replace = true;
+    }
+    std::string error;
+    if (!store.restoreKey(args[1], args[3], ttlMs, replace, error))
+        return "-" + error + "\r\n";
+    return "+OK\r\n";
+}
+
 //----------------------
 // List Operations
 //----------------------
@@ -160,6 +416,8 @@ static std::string cmdLlen(const std::vector<std::string>& args, KVStore& store)
 static std::string cmdLpush(const std::vector<std::string>& args, KVStore& store) {
     if (args.size() < 3) 
         return "-ERR LPUSH requires key and value\r\n";
+    // One lock acquisition for all elements
+    auto lock = store.acquireLock();
     for (size_t i = 2; i < args.size(); ++i) {
         store.listPushFront(args[1], args[i]);
     }
@@ -170,6 +428,7 @@ static std::string cmdLpush(const std::vector<std::string>& args, KVStore& store
 static std::string cmdRpush(const std::vector<std::string>& args, KVStore& store) {
     if (args.size() < 3) 
         return "-ERR RPUSH requires key and value\r\n";
+    auto lock = store.acquireLock();
     for (size_t i = 2; i < args.size(); ++i) {
         store.listPushBack(args[1], args[i]);
     }    
@@ -236,6 +495,82 @@ static std::string cmdLset(const std::vector<std::string>& args, KVStore& store)
     }
 }
 
+static bool parseDirection(const std::string& arg, bool& front) {
+    std::string dir = arg;
+    std::transform(dir.begin(), dir.end(), dir.begin(), ::toupper);
+    if (dir != "LEFT" && dir != "RIGHT") return false;
+    front = dir == "LEFT";
+    return true;
+}
+
+static std::string cmdLmove(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 5)
+        return "-ERR LMOVE requires source, destination, LEFT|RIGHT and LEFT|RIGHT\r\n";
+    bool fromFront, toFront;
+    if (!parseDirection(args[3], fromFront) || !parseDirection(args[4], toFront))
+        return "-ERR syntax error\r\n";
+    std::string val;
+    if (store.listMove(args[1], args[2], fromFront, toFront, val))
+        return "$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+    return "$-1\r\n";
+}
+
+// Blocking timeouts are seconds with an optional fraction; 0 waits forever
+static bool parseTimeout(const std::string& arg, std::string& error) {
+    try {
+        size_t used = 0;
+        double timeout = std::stod(arg, &used);
+        if (used != arg.size()) throw std::invalid_argument(arg);
+        if (timeout < 0) {
+            error = "-ERR timeout is negative\r\n";
+            return false;
+        }
+        return true;
+    } catch (const std::exception&) {
+        error = "-ERR timeout is not a float or out of range\r\n";
+        return false;
+    }
+}
+
+/*
+ * BLPOP/BRPOP/BLMOVE only make the non-blocking attempt here.
+ * A null reply tells the shard to park the client on the keys until a
+ * push makes data available or the timeout expires.
+ */
+static std::string blockingPop(const std::vector<std::string>& args, KVStore& store, bool front) {
+    if (args.size() < 3)
+        return "-ERR " + args[0] + " requires at least one key and a timeout\r\n";
+    std::string error;
+    if (!parseTimeout(args.back(), error))
+        return error;
+    for (size_t i = 1; i + 1 < args.size(); ++i) {
+        std::string val;
+        bool popped = front ? store.listPopFront(args[i], val) : store.listPopBack(args[i], val);
+        if (popped) {
+            return "*2\r\n$" + std::to_string(args[i].size()) + "\r\n" + args[i] + "\r\n" +
+                   "$" + std::to_string(val.size()) + "\r\n" + val + "\r\n";
+        }
+    }
+    return "*-1\r\n";
+}
+
+static std::string cmdBlpop(const std::vector<std::string>& args, KVStore& store) {
+    return blockingPop(args, store, true);
+}
+
+static std::string cmdBrpop(const std::vector<std::string>& args, KVStore& store) {
+    return blockingPop(args, store, false);
+}
+
+static std::string cmdBlmove(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() != 6)
+        return "-ERR BLMOVE requires source, destination, LEFT|RIGHT, LEFT|RIGHT and timeout\r\n";
+    std::string error;
+    if (!parseTimeout(args[5], error))
+        return error;
+    return cmdLmove(args, store);
+}
+
 //----------------------
 // Hash Operations
 //----------------------
@@ -324,16 +659,416 @@ static std::string cmdHmset(const std::vector<std::string>& args, KVStore& store
     return "+OK\r\n";
 }
 
-CommandProcessor::CommandProcessor() {}
+//----------------------
+// Sorted Set Operations
+//----------------------
+static bool parseScore(const std::string& arg, double& score) {
+    if (arg.empty()) return false;
+    char* end = nullptr;
+    score = std::strtod(arg.c_str(), &end);
+    return *end == '\0' && !std::isnan(score);
+}
 
-std::string CommandProcessor::execute(const std::string& rawInput) {
-    auto args = parseProtocol(rawInput);
-    if (args.empty()) return "-ERR Empty command\r\n";
+// "(" makes a ZRANGE BYSCORE bound exclusive; -inf/+inf are accepted
+static bool parseScoreBound(const std::string& arg, double& score, bool& exclusive) {
+    exclusive = !arg.empty() && arg[0] == '(';
+    return parseScore(exclusive ? arg.substr(1) : arg, score);
+}
 
-    std::string cmd = args[0];
-    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
-    KVStore& store = KVStore::instance();
+static bool parseLong(const std::string& arg, long& value) {
+    try {
+        size_t used = 0;
+        value = std::stol(arg, &used);
+        return used == arg.size();
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Shortest decimal form that reads back as the same double
+static std::string formatScore(double score) {
+    if (std::isinf(score)) return score > 0 ? "inf" : "-inf";
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", score);
+    if (std::strtod(buf, nullptr) != score)
+        snprintf(buf, sizeof(buf), "%.17g", score);
+    return buf;
+}
+
+static std::string bulkScore(double score) {
+    std::string text = formatScore(score);
+    return "$" + std::to_string(text.size()) + "\r\n" + text + "\r\n";
+}
+
+static std::string cmdZadd(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 4)
+        return "-ERR ZADD requires key and score member pairs\r\n";
+    unsigned flags = 0;
+    bool ch = false, incr = false;
+    size_t i = 2;
+    for (; i < args.size(); i++) {
+        std::string opt = args[i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt == "NX") flags |= ZADD_NX;
+        else if (opt == "XX") flags |= ZADD_XX;
+        else if (opt == "GT") flags |= ZADD_GT;
+        else if (opt == "LT") flags |= ZADD_LT;
+        else if (opt == "CH") ch = true;
+        else if (opt == "INCR") incr = true;
+        else break;
+    }
+    if ((flags & ZADD_NX) && (flags & ZADD_XX))
+        return "-ERR XX and NX options at the same time are not compatible\r\n";
+    if (((flags & ZADD_GT) && (flags & ZADD_LT)) || ((flags & (ZADD_GT | ZADD_LT)) && (flags & ZADD_NX)))
+        return "-ERR GT, LT, and/or NX options at the same time are not compatible\r\n";
+    if (i == args.size() || (args.size() - i) % 2 != 0)
+        return "-ERR syntax error\r\n";
+    if (incr && args.size() - i != 2)
+        return "-ERR INCR option supports a single increment-element pair\r\n";
 
+    std::vector<ScoredMember> members;
+    members.reserve((args.size() - i) / 2);
+    for (; i < args.size(); i += 2) {
+        double score;
+        if (!parseScore(args[i], score))
+            return "-ERR value is not a valid float\r\n";
+        members.push_back(ScoredMember{score, args[i + 1]});
+    }
+
+    if (incr) {
+        double result = 0;
+        if (store.zsetIncrBy(args[1], members[0].member, members[0].score, flags, result))
+            return bulkScore(result);
+        if (std::isnan(result))
+            return "-ERR resulting score is not a number (NaN)\r\n";
+        return "$-1\r\n";
+    }
+    size_t changed = 0;
+    size_t added = store.zsetAdd(args[1], members, flags, changed);
+    return ":" + std::to_string(ch ? changed : added) + "\r\n";
+}
+
+static std::string cmdZincrby(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() != 4)
+        return "-ERR ZINCRBY requires key, increment and member\r\n";
+    double delta, result = 0;
+    if (!parseScore(args[2], delta))
+        return "-ERR value is not a valid float\r\n";
+    if (!store.zsetIncrBy(args[1], args[3], delta, 0, result))
+        return "-ERR resulting score is not a number (NaN)\r\n";
+    return bulkScore(result);
+}
+
+static std::string cmdZrem(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 3)
+        return "-ERR ZREM requires key and member\r\n";
+    std::vector<std::string> members(args.begin() + 2, args.end());
+    return ":" + std::to_string(store.zsetRemove(args[1], members)) + "\r\n";
+}
+
+static std::string cmdZcard(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR ZCARD requires key\r\n";
+    return ":" + std::to_string(store.zsetSize(args[1])) + "\r\n";
+}
+
+static std::string cmdZscore(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 3)
+        return "-ERR ZSCORE requires key and member\r\n";
+    double score;
+    if (store.zsetScore(args[1], args[2], score))
+        return bulkScore(score);
+    return "$-1\r\n";
+}
+
+// ZRANK/ZREVRANK key member [WITHSCORE]
+static std::string zsetRank(const std::vector<std::string>& args, KVStore& store, bool reverse) {
+    if (args.size() < 3 || args.size() > 4)
+        return "-ERR " + args[0] + " requires key and member\r\n";
+    bool withScore = false;
+    if (args.size() == 4) {
+        std::string opt = args[3];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt != "WITHSCORE")
+            return "-ERR syntax error\r\n";
+        withScore = true;
+    }
+    auto lock = store.acquireLock();
+    long rank = store.zsetRank(args[1], args[2], reverse);
+    if (rank < 0)
+        return withScore ? "*-1\r\n" : "$-1\r\n";
+    if (!withScore)
+        return ":" + std::to_string(rank) + "\r\n";
+    double score = 0;
+    store.zsetScore(args[1], args[2], score);
+    return "*2\r\n:" + std::to_string(rank) + "\r\n" + bulkScore(score);
+}
+
+static std::string cmdZrank(const std::vector<std::string>& args, KVStore& store) {
+    return zsetRank(args, store, false);
+}
+
+static std::string cmdZrevrank(const std::vector<std::string>& args, KVStore& store) {
+    return zsetRank(args, store, true);
+}
+
+/*
+ * ZRANGE key start stop [BYSCORE] [REV] [LIMIT offset count] [WITHSCORES]
+ * ZREVRANGE is ZRANGE with REV. By rank, start/stop are indexes (negative
+ * counts from the end); with BYSCORE they are score bounds, max first for REV.
+ */
+static std::string zsetRange(const std::vector<std::string>& args, KVStore& store, bool reverse) {
+    if (args.size() < 4)
+        return "-ERR " + args[0] + " requires key, start and stop\r\n";
+    bool byScore = false, withScores = false, limit = false;
+    long offset = 0, count = -1;
+    for (size_t i = 4; i < args.size(); i++) {
+        std::string opt = args[i];
+        std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+        if (opt == "BYSCORE") {
+            byScore = true;
+        } else if (opt == "REV") {
+            reverse = true;
+        } else if (opt == "WITHSCORES") {
+            withScores = true;
+        } else if (opt == "LIMIT" && i + 2 < args.size()) {
+            if (!parseLong(args[i + 1], offset) || !parseLong(args[i + 2], count))
+                return "-ERR value is not an integer or out of range\r\n";
+            limit = true;
+            i += 2;
+        } else {
+            return "-ERR syntax error\r\n";
+        }
+    }
+    if (limit && !byScore)
+        return "-ERR syntax error, LIMIT is only supported in combination with BYSCORE\r\n";
+
+    std::vector<ScoredMember> range;
+    if (byScore) {
+        ScoreRange bounds;
+        const std::string& minArg = reverse ? args[3] : args[2];
+        const std::string& maxArg = reverse ? args[2] : args[3];
+        if (!parseScoreBound(minArg, bounds.min, bounds.minExclusive) ||
+            !parseScoreBound(maxArg, bounds.max, bounds.maxExclusive))
+            return "-ERR min or max is not a float\r\n";
+        if (offset < 0)
+            return "*0\r\n";
+        range = store.zsetRangeByScore(args[1], bounds, reverse, offset, count);
+    } else {
+        long start, stop;
+        if (!parseLong(args[2], start) || !parseLong(args[3], stop))
+            return "-ERR value is not an integer or out of range\r\n";
+        range = store.zsetRangeByRank(args[1], start, stop, reverse);
+    }
+
+    std::string response = "*" + std::to_string(range.size() * (withScores ? 2 : 1)) + "\r\n";
+    for (const auto& entry : range) {
+        response += "$" + std::to_string(entry.member.size()) + "\r\n" + entry.member + "\r\n";
+        if (withScores) response += bulkScore(entry.score);
+    }
+    return response;
+}
+
+static std::string cmdZrange(const std::vector<std::string>& args, KVStore& store) {
+    return zsetRange(args, store, false);
+}
+
+static std::string cmdZrevrange(const std::vector<std::string>& args, KVStore& store) {
+    return zsetRange(args, store, true);
+}
+
+//----------------------
+// Bitmap Operations
+//----------------------
+// Values are limited to 512 MB, as in Redis
+static const uint64_t kMaxBitOffset = (uint64_t(512) << 20) * 8 - 1;
+
+static bool parseBitOffset(const std::string& arg, uint64_t& offset) {
+    long value;
+    if (!parseLong(arg, value) || value < 0 || static_cast<uint64_t>(value) > kMaxBitOffset)
+        return false;
+    offset = static_cast<uint64_t>(value);
+    return true;
+}
+
+// BYTE or BIT range units of BITCOUNT/BITPOS
+static bool parseBitUnit(const std::string& arg, bool& bitUnits) {
+    std::string unit = arg;
+    std::transform(unit.begin(), unit.end(), unit.begin(), ::toupper);
+    bitUnits = unit == "BIT";
+    return bitUnits || unit == "BYTE";
+}
+
+static std::string cmdSetbit(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() != 4)
+        return "-ERR SETBIT requires key, offset and value\r\n";
+    uint64_t offset;
+    if (!parseBitOffset(args[2], offset))
+        return "-ERR bit offset is not an integer or out of range\r\n";
+    if (args[3] != "0" && args[3] != "1")
+        return "-ERR bit is not an integer or out of range\r\n";
+    return ":" + std::to_string(store.setBit(args[1], offset, args[3] == "1")) + "\r\n";
+}
+
+static std::string cmdGetbit(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() != 3)
+        return "-ERR GETBIT requires key and offset\r\n";
+    uint64_t offset;
+    if (!parseBitOffset(args[2], offset))
+        return "-ERR bit offset is not an integer or out of range\r\n";
+    return ":" + std::to_string(store.getBit(args[1], offset)) + "\r\n";
+}
+
+// BITCOUNT key [start end [BYTE|BIT]]
+static std::string cmdBitcount(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2 || args.size() == 3 || args.size() > 5)
+        return "-ERR syntax error\r\n";
+    long start = 0, end = -1;
+    bool bitUnits = false;
+    if (args.size() >= 4 && (!parseLong(args[2], start) || !parseLong(args[3], end)))
+        return "-ERR value is not an integer or out of range\r\n";
+    if (args.size() == 5 && !parseBitUnit(args[4], bitUnits))
+        return "-ERR syntax error\r\n";
+    return ":" + std::to_string(store.bitCount(args[1], start, end, bitUnits)) + "\r\n";
+}
+
+// BITPOS key bit [start [end [BYTE|BIT]]]
+static std::string cmdBitpos(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 3 || args.size() > 6)
+        return "-ERR syntax error\r\n";
+    if (args[2] != "0" && args[2] != "1")
+        return "-ERR The bit argument must be 1 or 0.\r\n";
+    long start = 0, end = -1;
+    bool endGiven = args.size() >= 5, bitUnits = false;
+    if ((args.size() >= 4 && !parseLong(args[3], start)) || (endGiven && !parseLong(args[4], end)))
+        return "-ERR value is not an integer or out of range\r\n";
+    if (args.size() == 6 && !parseBitUnit(args[5], bitUnits))
+        return "-ERR syntax error\r\n";
+    return ":" + std::to_string(store.bitPos(args[1], args[2] == "1", start, end, endGiven, bitUnits)) + "\r\n";
+}
+
+// BITOP AND|OR|XOR|NOT destkey key...
+static std::string cmdBitop(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 4)
+        return "-ERR BITOP requires operation, destination and source keys\r\n";
+    std::string name = args[1];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    BitOp op;
+    if (name == "AND") op = BITOP_AND;
+    else if (name == "OR") op = BITOP_OR;
+    else if (name == "XOR") op = BITOP_XOR;
+    else if (name == "NOT") op = BITOP_NOT;
+    else return "-ERR syntax error\r\n";
+    if (op == BITOP_NOT && args.size() != 4)
+        return "-ERR BITOP NOT must be called with a single source key.\r\n";
+    std::vector<std::string> keys(args.begin() + 3, args.end());
+    return ":" + std::to_string(store.bitOp(op, args[2], keys)) + "\r\n";
+}
+
+// i1..i64 or u1..u63
+static bool parseBitFieldType(const std::string& arg, bool& isSigned, unsigned& bits) {
+    if (arg.size() < 2) return false;
+    char sign = static_cast<char>(::tolower(arg[0]));
+    long width;
+    if ((sign != 'i' && sign != 'u') || !parseLong(arg.substr(1), width))
+        return false;
+    isSigned = sign == 'i';
+    if (width < 1 || width > (isSigned ? 64 : 63))
+        return false;
+    bits = static_cast<unsigned>(width);
+    return true;
+}
+
+// "#N" is the N-th field of the type's width
+static bool parseBitFieldOffset(const std::string& arg, unsigned bits, uint64_t& offset) {
+    bool scaled = !arg.empty() && arg[0] == '#';
+    uint64_t value;
+    if (!parseBitOffset(scaled ? arg.substr(1) : arg, value))
+        return false;
+    offset = scaled ? value * bits : value;
+    return offset + bits - 1 <= kMaxBitOffset;
+}
+
+// BITFIELD key [GET type offset] [SET type offset value] [INCRBY type offset increment]
+//               [OVERFLOW WRAP|SAT|FAIL]...
+static std::string cmdBitfield(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR BITFIELD requires key\r\n";
+    std::vector<BitFieldOp> ops;
+    BitFieldOverflow overflow = OVERFLOW_WRAP;
+    for (size_t i = 2; i < args.size();) {
+        std::string sub = args[i];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+        if (sub == "OVERFLOW" && i + 1 < args.size()) {
+            std::string mode = args[i + 1];
+            std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+            if (mode == "WRAP") overflow = OVERFLOW_WRAP;
+            else if (mode == "SAT") overflow = OVERFLOW_SAT;
+            else if (mode == "FAIL") overflow = OVERFLOW_FAIL;
+            else return "-ERR Invalid OVERFLOW type specified\r\n";
+            i += 2;
+            continue;
+        }
+
+        BitFieldOp op{BitFieldOp::GET, false, 0, 0, 0, overflow};
+        size_t argc = 4;
+        if (sub == "GET") argc = 3;
+        else if (sub == "SET") op.kind = BitFieldOp::SET;
+        else if (sub == "INCRBY") op.kind = BitFieldOp::INCRBY;
+        else return "-ERR syntax error\r\n";
+        if (i + argc > args.size())
+            return "-ERR syntax error\r\n";
+        if (!parseBitFieldType(args[i + 1], op.isSigned, op.bits))
+            return "-ERR Invalid bitfield type. Use something like i16 u8. Note that u64 is not supported but i64 is.\r\n";
+        if (!parseBitFieldOffset(args[i + 2], op.bits, op.offset))
+            return "-ERR bit offset is not an integer or out of range\r\n";
+        long value = 0;
+        if (argc == 4 && !parseLong(args[i + 3], value))
+            return "-ERR value is not an integer or out of range\r\n";
+        op.value = value;
+        ops.push_back(op);
+        i += argc;
+    }
+
+    auto replies = store.bitField(args[1], ops);
+    std::string response = "*" + std::to_string(replies.size()) + "\r\n";
+    for (const auto& reply : replies)
+        response += reply ? ":" + std::to_string(*reply) + "\r\n" : "$-1\r\n";
+    return response;
+}
+
+// HyperLogLog Operations
+static std::string cmdPfadd(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR PFADD requires key\r\n";
+    std::vector<std::string> elements(args.begin() + 2, args.end());
+    return store.hllAdd(args[1], elements) ? ":1\r\n" : ":0\r\n";
+}
+
+static std::string cmdPfcount(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR PFCOUNT requires at least one key\r\n";
+    std::vector<std::string> keys(args.begin() + 1, args.end());
+    return ":" + std::to_string(store.hllCount(keys)) + "\r\n";
+}
+
+static std::string cmdPfmerge(const std::vector<std::string>& args, KVStore& store) {
+    if (args.size() < 2)
+        return "-ERR PFMERGE requires destination key\r\n";
+    std::vector<std::string> sources(args.begin() + 2, args.end());
+    store.hllMerge(args[1], sources);
+    return "+OK\r\n";
+}
+
+CommandProcessor::CommandProcessor() : store_(KVStore::instance()) {}
+
+CommandProcessor::CommandProcessor(KVStore& store) : store_(store) {}
+
+std::string CommandProcessor::execute(const std::string& rawInput) {
+    return execute(parseProtocol(rawInput));
+}
+
+static std::string runCommand(const std::string& cmd, const std::vector<std::string>& args, KVStore& store) {
     // General Commands
     if (cmd == "PING")
         return cmdPing(args, store);
@@ -350,12 +1085,18 @@ std::string CommandProcessor::execute(const std::string& rawInput) {
         return cmdKeys(args, store);
     else if (cmd == "TYPE")
         return cmdType(args, store);
-    else if (cmd == "DEL" || cmd == "UNLINK")
+    else if (cmd == "DEL")
         return cmdDel(args, store);
+    else if (cmd == "UNLINK")
+        return cmdUnlink(args, store);
     else if (cmd == "EXPIRE")
         return cmdExpire(args, store);
     else if (cmd == "RENAME")
         return cmdRename(args, store);
+    else if (cmd == "DUMP")
+        return cmdDump(args, store);
+    else if (cmd == "RESTORE")
+        return cmdRestore(args, store);
     // List Operations
     else if (cmd == "LGET") 
         return cmdLget(args, store);
@@ -375,6 +1116,14 @@ std::string CommandProcessor::execute(const std::string& rawInput) {
         return cmdLindex(args, store);
     else if (cmd == "LSET")
         return cmdLset(args, store);
+    else if (cmd == "LMOVE")
+        return cmdLmove(args, store);
+    else if (cmd == "BLPOP")
+        return cmdBlpop(args, store);
+    else if (cmd == "BRPOP")
+        return cmdBrpop(args, store);
+    else if (cmd == "BLMOVE")
+        return cmdBlmove(args, store);
     // Hash Operations
     else if (cmd == "HSET") 
         return cmdHset(args, store);
@@ -394,6 +1143,76 @@ std::string CommandProcessor::execute(const std::string& rawInput) {
         return cmdHlen(args, store);
     else if (cmd == "HMSET") 
         return cmdHmset(args, store);
+    // Sorted Set Operations
+    else if (cmd == "ZADD")
+        return cmdZadd(args, store);
+    else if (cmd == "ZINCRBY")
+        return cmdZincrby(args, store);
+    else if (cmd == "ZREM")
+        return cmdZrem(args, store);
+    else if (cmd == "ZCARD")
+        return cmdZcard(args, store);
+    else if (cmd == "ZSCORE")
+        return cmdZscore(args, store);
+    else if (cmd == "ZRANK")
+        return cmdZrank(args, store);
+    else if (cmd == "ZREVRANK")
+        return cmdZrevrank(args, store);
+    else if (cmd == "ZRANGE")
+        return cmdZrange(args, store);
+    else if (cmd == "ZREVRANGE")
+        return cmdZrevrange(args, store);
+    // Bitmap Operations
+    else if (cmd == "SETBIT")
+        return cmdSetbit(args, store);
+    else if (cmd == "GETBIT")
+        return cmdGetbit(args, store);
+    else if (cmd == "BITCOUNT")
+        return cmdBitcount(args, store);
+    else if (cmd == "BITPOS")
+        return cmdBitpos(args, store);
+    else if (cmd == "BITOP")
+        return cmdBitop(args, store);
+    else if (cmd == "BITFIELD")
+        return cmdBitfield(args, store);
+    // HyperLogLog Operations
+    else if (cmd == "PFADD")
+        return cmdPfadd(args, store);
+    else if (cmd == "PFCOUNT")
+        return cmdPfcount(args, store);
+    else if (cmd == "PFMERGE")
+        return cmdPfmerge(args, store);
     else 
         return "-ERR Unknown command\r\n";
 }
+
+std::string CommandProcessor::execute(const std::vector<std::string>& args) {
+    if (args.empty()) return "-ERR Empty command\r\n";
+
+    std::string cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    // Held from the write to the version bump and the queued invalidations: an
+    // EXEC locking this store from another shard sees all or none of them
+    auto lock = store_.acquireLock();
+    std::string response = runCommand(cmd, args, store_);
+
+    // Writes invalidate WATCHed keys and the client caches of tracked ones;
+    // FLUSHALL invalidates tracked keys in clearAll
+    // A write that failed changed nothing: it aborts no transaction and invalidates no cache
+    bool failed = !response.empty() && response[0] == '-';
+    bool watched = !failed && store_.hasWatchedKeys();
+    bool tracked = !failed && store_.hasTracking();
+    if (watched || tracked) {
+        const CommandInfo* info = lookupCommand(cmd);
+        if (info && (info->flags & CMD_WRITE)) {
+            if (info->flags & CMD_ALL_SHARDS) {
+                if (watched) store_.touchAllKeys();
+            } else {
+                auto keys = commandKeys(*info, args);
+                if (watched) store_.touchKeys(keys);
+                if (tracked) store_.invalidateKeys(keys);
+            }
+        }
+    }
+    return response;
+}
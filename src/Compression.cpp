@@ -0,0 +1,201 @@
+#include "../include/Compression.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+//----------------------
+// LZ4 Block Format
+//----------------------
+// Sequences: token (literal length << 4 | match length - 4), extra length
+// bytes for 15s, literals, 16-bit offset, extra match length bytes. The last
+// sequence only has literals.
+static const size_t kMinMatch = 4;
+static const size_t kLastLiterals = 5;      // the block always ends with literals
+static const size_t kMatchSafeDistance = 12; // no match starts in the last 12 bytes
+static const size_t kMaxOffset = 65535;
+static const int kHashLog = 14;
+
+static uint32_t read32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hashSequence(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - kHashLog);
+}
+
+static void writeLength(std::string& out, size_t len) {
+    while (len >= 255) {
+        out.push_back(static_cast<char>(255));
+        len -= 255;
+    }
+    out.push_back(static_cast<char>(len));
+}
+
+static void writeSequence(std::string& out, const char* literals, size_t literalLen, size_t offset, size_t matchLen) {
+    size_t matchCode = matchLen - kMinMatch;
+    char token = static_cast<char>((std::min<size_t>(literalLen, 15) << 4) | std::min<size_t>(matchCode, 15));
+    out.push_back(token);
+    if (literalLen >= 15) writeLength(out, literalLen - 15);
+    out.append(literals, literalLen);
+    out.push_back(static_cast<char>(offset & 0xff));
+    out.push_back(static_cast<char>(offset >> 8));
+    if (matchCode >= 15) writeLength(out, matchCode - 15);
+}
+
+void lz4Compress(const char* src, size_t len, std::string& out) {
+    out.reserve(out.size() + len + len / 255 + 16);
+    size_t anchor = 0;
+    if (len > kMatchSafeDistance) {
+        // Positions of recent 4-byte sequences; stale entries are rejected by the compare
+        static thread_local std::vector<uint32_t> table;
+        table.assign(size_t(1) << kHashLog, 0);
+        size_t matchLimit = len - kLastLiterals;
+        size_t mfLimit = len - kMatchSafeDistance;
+        size_t ip = 0;
+        while (ip < mfLimit) {
+            uint32_t sequence = read32(src + ip);
+            uint32_t& slot = table[hashSequence(sequence)];
+            size_t ref = slot;
+            slot = static_cast<uint32_t>(ip);
+            if (ref >= ip || ip - ref > kMaxOffset || read32(src + ref) != sequence) {
+                // Skip faster through data that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+            }
+            size_t matchLen = kMinMatch;
+            while (ip + matchLen < matchLimit && src[ref + matchLen] == src[ip + matchLen])
+                matchLen++;
+            writeSequence(out, src + anchor, ip - anchor, ip - ref, matchLen);
+            ip += matchLen;
+            anchor = ip;
+            if (ip - 2 < mfLimit)
+                table[hashSequence(read32(src + ip - 2))] = static_cast<uint32_t>(ip - 2);
+        }
+    }
+    size_t literalLen = len - anchor;
+    out.push_back(static_cast<char>(std::min<size_t>(literalLen, 15) << 4));
+    if (literalLen >= 15) writeLength(out, literalLen - 15);
+    out.append(src + anchor, literalLen);
+}
+
+static bool readLength(const unsigned char* src, size_t len, size_t& ip, size_t& value) {
+    unsigned char byte;
+    do {
+        if (ip >= len) return false;
+        byte = src[ip++];
+        value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+bool lz4Decompress(const char* source, size_t len, char* dst, size_t rawLen) {
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(source);
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        unsigned token = src[ip++];
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !readLength(src, len, ip, literalLen)) return false;
+        if (literalLen > len - ip || literalLen > rawLen - op) return false;
+        std::memcpy(dst + op, src + ip, literalLen);
+        ip += literalLen;
+        op += literalLen;
+        if (ip == len) break;
+
+        if (len - ip < 2) return false;
+        size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !readLength(src, len, ip, matchLen)) return false;
+        matchLen += kMinMatch;
+        if (offset == 0 || offset > op || matchLen > rawLen - op) return false;
+
+        // The copied region repeats with period offset; each memcpy doubles what can be copied at once
+        char* out = dst + op;
+        const char* from = out - offset;
+        size_t copied = 0;
+        while (copied < matchLen) {
+            size_t chunk = std::min(matchLen - copied, copied + offset);
+            std::memcpy(out + copied, from, chunk);
+            copied += chunk;
+        }
+        op += matchLen;
+    }
+    return op == rawLen;
+}
+
+//----------------------
+// Stored Values
+//----------------------
+static const char kFrameMagic[4] = {'\0', 'L', 'Z', '4'};
+static const size_t kFrameHeader = sizeof(kFrameMagic) + 1 + 4;
+enum FrameMethod : char { FRAME_STORED = 0, FRAME_LZ4 = 1 };
+
+static std::string frameHeader(FrameMethod method, size_t rawLen) {
+    std::string header(kFrameMagic, sizeof(kFrameMagic));
+    header.push_back(method);
+    for (int i = 0; i < 4; i++)
+        header.push_back(static_cast<char>(rawLen >> (8 * i)));
+    return header;
+}
+
+static uint32_t frameRawLength(const std::string& stored) {
+    uint32_t rawLen = 0;
+    for (int i = 0; i < 4; i++)
+        rawLen |= static_cast<uint32_t>(static_cast<unsigned char>(stored[sizeof(kFrameMagic) + 1 + i])) << (8 * i);
+    return rawLen;
+}
+
+bool isEncodedValue(const std::string& stored) {
+    return stored.size() >= kFrameHeader && stored[0] == kFrameMagic[0] &&
+           std::memcmp(stored.data(), kFrameMagic, sizeof(kFrameMagic)) == 0;
+}
+
+std::string encodeValue(std::string raw, size_t threshold) {
+    bool escape = isEncodedValue(raw);
+    if (threshold > 0 && raw.size() >= threshold && raw.size() <= UINT32_MAX) {
+        std::string framed = frameHeader(FRAME_LZ4, raw.size());
+        lz4Compress(raw.data(), raw.size(), framed);
+        // Keep the value raw unless it shrinks by at least an eighth
+        if (framed.size() <= raw.size() - raw.size() / 8) {
+            framed.shrink_to_fit();
+            return framed;
+        }
+    }
+    if (!escape) return raw;
+    return frameHeader(FRAME_STORED, raw.size()) + raw;
+}
+
+bool decodeValue(const std::string& stored, std::string& out) {
+    if (!isEncodedValue(stored)) {
+        out = stored;
+        return true;
+    }
+    size_t rawLen = frameRawLength(stored);
+    const char* data = stored.data() + kFrameHeader;
+    size_t dataLen = stored.size() - kFrameHeader;
+    if (stored[sizeof(kFrameMagic)] == FRAME_STORED) {
+        if (dataLen != rawLen) return false;
+        out.assign(data, dataLen);
+        return true;
+    }
+    std::string raw(rawLen, '\0');
+    if (stored[sizeof(kFrameMagic)] != FRAME_LZ4 || !lz4Decompress(data, dataLen, &raw[0], rawLen))
+        return false;
+    out.swap(raw);
+    return true;
+}
+
+bool storedEquals(const std::string& stored, const std::string& raw) {
+    if (!isEncodedValue(stored)) return stored == raw;
+    if (frameRawLength(stored) != raw.size()) return false;
+    std::string decoded;
+    return decodeValue(stored, decoded) && decoded == raw;
+}
@@ -0,0 +1,160 @@
+#include "../include/EpollBackend.h"
+#include "../include/Shard.h"
+
+#include <cerrno>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static const uint64_t kListenerToken = 0;
+static const uint64_t kWakeupToken = ~0ULL;
+static const size_t kReadChunk = 16 * 1024;
+static const size_t kMaxIov = 64;
+
+EpollBackend::EpollBackend(IoHandler& handler)
+    : handler_(handler), epollFd_(-1), listenFd_(-1), wakeupFd_(-1) {}
+
+EpollBackend::~EpollBackend() {
+    if (epollFd_ != -1) close(epollFd_);
+}
+
+bool EpollBackend::init(int listenFd, int wakeupFd) {
+    listenFd_ = listenFd;
+    wakeupFd_ = wakeupFd;
+    epollFd_ = epoll_create1(0);
+    if (epollFd_ < 0) return false;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = kListenerToken;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
+    ev.data.u64 = kWakeupToken;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeupFd_, &ev);
+    return true;
+}
+
+void EpollBackend::addClient(Client& client) {
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = client.id;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, client.fd, &ev);
+    fds_[client.id] = client.fd;
+}
+
+void EpollBackend::removeClient(Client& client) {
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, client.fd, nullptr);
+    close(client.fd);
+    fds_.erase(client.id);
+}
+
+void EpollBackend::poll(int timeoutMs) {
+    epoll_event events[256];
+    int ready = epoll_wait(epollFd_, events, 256, timeoutMs);
+    if (ready < 0 && errno != EINTR)
+        std::cerr << "Error waiting for events\n";
+
+    for (int i = 0; i < ready; i++) {
+        uint64_t token = events[i].data.u64;
+        if (token == kListenerToken) {
+            acceptClients();
+        } else if (token == kWakeupToken) {
+            uint64_t counter;
+            while (read(wakeupFd_, &counter, sizeof(counter)) > 0) {}
+        } else {
+            // The client may have been closed by an earlier event in this batch
+            auto it = fds_.find(token);
+            if (it == fds_.end()) continue;
+            int fd = it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                handler_.onClosed(token);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                handler_.onWritable(token);
+                if (fds_.find(token) == fds_.end()) continue;
+            }
+            if (events[i].events & EPOLLIN)
+                readClient(token, fd);
+        }
+    }
+}
+
+void EpollBackend::acceptClients() {
+    while (true) {
+        int clientSocket = accept(listenFd_, nullptr, nullptr);
+        if (clientSocket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                std::cerr << "Error accepting connection\n";
+            return;
+        }
+        int flags = fcntl(clientSocket, F_GETFL, 0);
+        fcntl(clientSocket, F_SETFL, flags | O_NONBLOCK);
+        handler_.onAccept(clientSocket);
+    }
+}
+
+void EpollBackend::readClient(uint64_t clientId, int fd) {
+    char buffer[kReadChunk];
+    ssize_t bytesRead = recv(fd, buffer, sizeof(buffer), 0);
+    if (bytesRead == 0 || (bytesRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        handler_.onClosed(clientId);
+        return;
+    }
+    if (bytesRead > 0)
+        handler_.onData(clientId, buffer, bytesRead);
+}
+
+FlushResult EpollBackend::flush(Client& client) {
+    while (client.pendingOutput() > 0) {
+        ssize_t sent;
+        if (client.outQueue.empty()) {
+            sent = send(client.fd, client.outBuf.data() + client.outPos,
+                        client.outBuf.size() - client.outPos, MSG_NOSIGNAL);
+        } else {
+            // Shared buffers are written in place, gathered into one sendmsg
+            iovec iov[kMaxIov];
+            size_t count = 0;
+            for (const auto& buf : client.outQueue) {
+                if (count == kMaxIov) break;
+                size_t skip = count == 0 ? client.outQueuePos : 0;
+                iov[count].iov_base = const_cast<char*>(buf->data() + skip);
+                iov[count].iov_len = buf->size() - skip;
+                count++;
+            }
+            if (count < kMaxIov && client.outPos < client.outBuf.size()) {
+                iov[count].iov_base = &client.outBuf[client.outPos];
+                iov[count].iov_len = client.outBuf.size() - client.outPos;
+                count++;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            sent = sendmsg(client.fd, &msg, MSG_NOSIGNAL);
+        }
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return FlushResult::Failed;
+        }
+        client.consumeOutput(sent);
+    }
+
+    bool drained = client.pendingOutput() == 0;
+    if (drained) {
+        client.outBuf.clear();
+        client.outPos = 0;
+    }
+
+    // Arm EPOLLOUT only while the socket buffer is full
+    if (drained == client.writeRegistered) {
+        epoll_event ev{};
+        ev.events = drained ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+        ev.data.u64 = client.id;
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, client.fd, &ev);
+        client.writeRegistered = !drained;
+    }
+    return drained ? FlushResult::Drained : FlushResult::Pending;
+}
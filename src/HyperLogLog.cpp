@@ -0,0 +1,308 @@
+#include "../include/HyperLogLog.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const int kHashBits = 64 - HyperLogLog::kPrecision;
+static const double kAlphaInf = 0.721347520444481703680;   // 1 / (2 ln 2)
+static const char kEncodingSparse = 0;
+static const char kEncodingDense = 1;
+
+static uint64_t murmurHash64A(const void* key, size_t len, uint64_t seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const unsigned char* data = static_cast<const unsigned char*>(key);
+    const unsigned char* end = data + (len - (len & 7));
+    for (; data != end; data += 8) {
+        uint64_t k;
+        std::memcpy(&k, data, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+    case 7: h ^= uint64_t(data[6]) << 48; // fallthrough
+    case 6: h ^= uint64_t(data[5]) << 40; // fallthrough
+    case 5: h ^= uint64_t(data[4]) << 32; // fallthrough
+    case 4: h ^= uint64_t(data[3]) << 24; // fallthrough
+    case 3: h ^= uint64_t(data[2]) << 16; // fallthrough
+    case 2: h ^= uint64_t(data[1]) << 8;  // fallthrough
+    case 1: h ^= uint64_t(data[0]);
+            h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+//----------------------
+// Dense Registers
+//----------------------
+// Register i takes bits [6i, 6i + 6) of the array, least significant first,
+// so every 3 bytes hold 4 registers.
+static uint8_t getDense(const uint8_t* regs, size_t i) {
+    size_t byte = i * 6 / 8;
+    unsigned shift = i * 6 % 8;
+    return ((regs[byte] >> shift) | (regs[byte + 1] << (8 - shift))) & 63;
+}
+
+static void setDense(uint8_t* regs, size_t i, uint8_t value) {
+    size_t byte = i * 6 / 8;
+    unsigned shift = i * 6 % 8;
+    regs[byte] = static_cast<uint8_t>((regs[byte] & ~(63 << shift)) | (value << shift));
+    regs[byte + 1] = static_cast<uint8_t>((regs[byte + 1] & ~(63 >> (8 - shift))) | (value >> (8 - shift)));
+}
+
+static uint32_t denseGroup(const uint8_t* regs, size_t group) {
+    const uint8_t* p = regs + group * 3;
+    return p[0] | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+}
+
+static void maxDenseScalar(uint8_t* registers, const uint8_t* dense, size_t firstGroup) {
+    for (size_t g = firstGroup; g < HyperLogLog::kRegisters / 4; g++) {
+        uint32_t w = denseGroup(dense, g);
+        for (int k = 0; k < 4; k++) {
+            uint8_t value = (w >> (6 * k)) & 63;
+            uint8_t& reg = registers[g * 4 + k];
+            if (value > reg) reg = value;
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// 32 registers (24 packed bytes) per step: each 32-bit lane gathers one
+// 3-byte group, the four 6-bit fields are shifted into their own bytes and
+// max-ed into the unpacked registers
+__attribute__((target("avx2")))
+static void maxDenseAvx2(uint8_t* registers, const uint8_t* dense) {
+    const __m256i gather = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i field0 = _mm256_set1_epi32(0x0000003f);
+    const __m256i field1 = _mm256_set1_epi32(0x00003f00);
+    const __m256i field2 = _mm256_set1_epi32(0x003f0000);
+    const __m256i field3 = _mm256_set1_epi32(0x3f000000);
+    // The high lane loads 16 bytes from offset 12; the last step would read past the array
+    const size_t steps = HyperLogLog::kRegisters / 32 - 1;
+    for (size_t s = 0; s < steps; s++) {
+        const uint8_t* p = dense + s * 24;
+        __m256i packed = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12)), 1);
+        __m256i w = _mm256_shuffle_epi8(packed, gather);
+        __m256i unpacked = _mm256_or_si256(
+            _mm256_or_si256(_mm256_and_si256(w, field0), _mm256_and_si256(_mm256_slli_epi32(w, 2), field1)),
+            _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi32(w, 4), field2),
+                            _mm256_and_si256(_mm256_slli_epi32(w, 6), field3)));
+        __m256i* out = reinterpret_cast<__m256i*>(registers + s * 32);
+        _mm256_storeu_si256(out, _mm256_max_epu8(_mm256_loadu_si256(out), unpacked));
+    }
+    maxDenseScalar(registers, dense, steps * 8);
+}
+#endif
+
+static void maxDense(uint8_t* registers, const uint8_t* dense) {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) {
+        maxDenseAvx2(registers, dense);
+        return;
+    }
+#endif
+    maxDenseScalar(registers, dense, 0);
+}
+
+//----------------------
+// Estimation
+//----------------------
+// Ertl's improved raw estimator ("New cardinality estimation algorithms for
+// HyperLogLog sketches"), as used by Redis; works from the register histogram
+static double sigma(double x) {
+    if (x == 1.0) return INFINITY;
+    double y = 1.0, z = x, zPrev;
+    do {
+        x *= x;
+        zPrev = z;
+        z += x * y;
+        y += y;
+    } while (zPrev != z);
+    return z;
+}
+
+static double tau(double x) {
+    if (x == 0.0 || x == 1.0) return 0.0;
+    double y = 1.0, z = 1 - x, zPrev;
+    do {
+        x = std::sqrt(x);
+        zPrev = z;
+        y *= 0.5;
+        z -= std::pow(1 - x, 2) * y;
+    } while (zPrev != z);
+    return z / 3;
+}
+
+static uint64_t estimateHistogram(const uint32_t* histogram) {
+    const double m = HyperLogLog::kRegisters;
+    double z = m * tau((m - histogram[kHashBits + 1]) / m);
+    for (int j = kHashBits; j >= 1; j--) {
+        z += histogram[j];
+        z *= 0.5;
+    }
+    z += m * sigma(histogram[0] / m);
+    return static_cast<uint64_t>(std::llround(kAlphaInf * m * m / z));
+}
+
+uint64_t HyperLogLog::estimate(const uint8_t* registers) {
+    uint32_t histogram[64] = {0};
+    for (size_t i = 0; i < kRegisters; i++)
+        histogram[registers[i]]++;
+    return estimateHistogram(histogram);
+}
+
+//----------------------
+// HyperLogLog
+//----------------------
+bool HyperLogLog::add(const std::string& element) {
+    uint64_t hash = murmurHash64A(element.data(), element.size(), 0xadc83b19ULL);
+    size_t index = hash & (kRegisters - 1);
+    // Position of the first set bit in the remaining hash bits, at most kHashBits + 1
+    hash >>= kPrecision;
+    hash |= uint64_t(1) << kHashBits;
+    uint8_t rank = static_cast<uint8_t>(__builtin_ctzll(hash) + 1);
+    return setRegister(index, rank);
+}
+
+bool HyperLogLog::setRegister(size_t index, uint8_t value) {
+    if (!isSparse()) {
+        if (getDense(dense_.data(), index) >= value) return false;
+        setDense(dense_.data(), index, value);
+        cacheValid_ = false;
+        return true;
+    }
+    uint32_t entry = static_cast<uint32_t>(index << 8) | value;
+    auto it = std::lower_bound(sparse_.begin(), sparse_.end(), static_cast<uint32_t>(index << 8));
+    if (it != sparse_.end() && (*it >> 8) == index) {
+        if ((*it & 0xff) >= value) return false;
+        *it = entry;
+    } else if (sparse_.size() >= kMaxSparseEntries) {
+        toDense();
+        return setRegister(index, value);
+    } else {
+        sparse_.insert(it, entry);
+    }
+    cacheValid_ = false;
+    return true;
+}
+
+void HyperLogLog::toDense() {
+    dense_.assign(kDenseBytes + 1, 0);
+    for (uint32_t entry : sparse_)
+        setDense(dense_.data(), entry >> 8, entry & 0xff);
+    std::vector<uint32_t>().swap(sparse_);
+}
+
+uint64_t HyperLogLog::count() const {
+    if (cacheValid_) return cachedCount_;
+    uint32_t histogram[64] = {0};
+    if (isSparse()) {
+        histogram[0] = static_cast<uint32_t>(kRegisters - sparse_.size());
+        for (uint32_t entry : sparse_)
+            histogram[entry & 0xff]++;
+    } else {
+        for (size_t g = 0; g < kRegisters / 4; g++) {
+            uint32_t w = denseGroup(dense_.data(), g);
+            for (int k = 0; k < 4; k++)
+                histogram[(w >> (6 * k)) & 63]++;
+        }
+    }
+    cachedCount_ = estimateHistogram(histogram);
+    cacheValid_ = true;
+    return cachedCount_;
+}
+
+void HyperLogLog::maxInto(uint8_t* registers) const {
+    if (!isSparse()) {
+        maxDense(registers, dense_.data());
+        return;
+    }
+    for (uint32_t entry : sparse_) {
+        uint8_t& reg = registers[entry >> 8];
+        reg = std::max<uint8_t>(reg, entry & 0xff);
+    }
+}
+
+void HyperLogLog::assign(const uint8_t* registers) {
+    size_t used = kRegisters - std::count(registers, registers + kRegisters, 0);
+    sparse_.clear();
+    dense_.clear();
+    if (used <= kMaxSparseEntries) {
+        sparse_.reserve(used);
+        for (size_t i = 0; i < kRegisters; i++) {
+            if (registers[i]) sparse_.push_back(static_cast<uint32_t>(i << 8) | registers[i]);
+        }
+        std::vector<uint8_t>().swap(dense_);
+    } else {
+        dense_.assign(kDenseBytes + 1, 0);
+        for (size_t i = 0; i < kRegisters; i++)
+            setDense(dense_.data(), i, registers[i]);
+        std::vector<uint32_t>().swap(sparse_);
+    }
+    cacheValid_ = false;
+}
+
+// Sparse: u16 register + value byte per entry; dense: the packed registers
+std::string HyperLogLog::serialize() const {
+    std::string out;
+    if (isSparse()) {
+        out.reserve(1 + sparse_.size() * 3);
+        out.push_back(kEncodingSparse);
+        for (uint32_t entry : sparse_) {
+            out.push_back(static_cast<char>((entry >> 8) & 0xff));
+            out.push_back(static_cast<char>(entry >> 16));
+            out.push_back(static_cast<char>(entry & 0xff));
+        }
+    } else {
+        out.push_back(kEncodingDense);
+        out.append(reinterpret_cast<const char*>(dense_.data()), kDenseBytes);
+    }
+    return out;
+}
+
+bool HyperLogLog::deserialize(const std::string& data) {
+    if (data.empty()) return false;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data.data()) + 1;
+    size_t len = data.size() - 1;
+    std::vector<uint32_t> sparse;
+    std::vector<uint8_t> dense;
+    if (data[0] == kEncodingSparse) {
+        if (len % 3 != 0 || len / 3 > kMaxSparseEntries) return false;
+        sparse.reserve(len / 3);
+        for (size_t i = 0; i < len; i += 3) {
+            uint32_t index = p[i] | (uint32_t(p[i + 1]) << 8);
+            uint8_t value = p[i + 2];
+            if (index >= kRegisters || value == 0 || value > kHashBits + 1) return false;
+            if (!sparse.empty() && (sparse.back() >> 8) >= index) return false;
+            sparse.push_back((index << 8) | value);
+        }
+    } else if (data[0] == kEncodingDense && len == kDenseBytes) {
+        dense.assign(p, p + len);
+        dense.push_back(0);
+        for (size_t i = 0; i < kRegisters; i++) {
+            if (getDense(dense.data(), i) > kHashBits + 1) return false;
+        }
+    } else {
+        return false;
+    }
+    sparse_.swap(sparse);
+    dense_.swap(dense);
+    cacheValid_ = false;
+    return true;
+}
@@ -0,0 +1,19 @@
+#include "../include/IoBackend.h"
+#include "../include/EpollBackend.h"
+#include "../include/UringBackend.h"
+
+#include <iostream>
+
+std::unique_ptr<IoBackend> createIoBackend(const IoOptions& options, IoHandler& handler,
+                                           int listenFd, int wakeupFd) {
+    if (options.backend == "io_uring") {
+        std::unique_ptr<IoBackend> uring(new UringBackend(handler, options.registeredBuffers));
+        if (uring->init(listenFd, wakeupFd))
+            return uring;
+        std::cerr << "io_uring not supported by this kernel, falling back to epoll\n";
+    }
+    std::unique_ptr<IoBackend> epoll(new EpollBackend(handler));
+    if (!epoll->init(listenFd, wakeupFd))
+        return nullptr;
+    return epoll;
+}
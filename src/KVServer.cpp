@@ -1,14 +1,14 @@
 #include "../include/KVServer.h"
-#include "../include/CommandProcessor.h"
 #include "../include/KVStore.h"
+#include "../include/LazyFree.h"
+#include "../include/Shard.h"
 
+#include <algorithm>
 #include <iostream>
-#include <sys/socket.h>
-#include <unistd.h>
-#include <netinet/in.h>
-#include <vector>
+#include <fstream>
+#include <functional>
 #include <thread>
-#include <cstring>
+#include <pthread.h>
 #include <signal.h>
 
 // Global pointer for signal handling
@@ -24,85 +24,170 @@ void handleSignal(int sig) {
 
 void KVServer::installSignalHandlers() {
     signal(SIGINT, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
 }
 
-KVServer::KVServer(int port) : port_(port), listenSocket_(-1), isRunning_(true) {
+KVServer::KVServer(const ServerConfig& config)
+    : config_(config), isRunning_(true), lastClientId_(0), replication_(config.replBacklogSize),
+      capture_(std::max(1, config.threads)) {
+    int threads = std::max(1, config_.threads);
+    // Shard 0 keeps using the process-wide store so single-threaded mode is unchanged
+    shards_.emplace_back(new Shard(*this, 0, KVStore::instance()));
+    for (int i = 1; i < threads; i++) {
+        ownedStores_.emplace_back(new KVStore());
+        shards_.emplace_back(new Shard(*this, i, *ownedStores_.back()));
+    }
+    for (auto& s : shards_)
+        s->connectPeers(threads);
+
+    // A growing write stream wakes the shards that serve replicas
+    replication_.setWakeup([this]() {
+        for (auto& s : shards_) {
+            if (s->hostsReplicas()) s->wakeup();
+        }
+    });
+    if (!config_.replicaOfHost.empty())
+        replication_.setPrimary(config_.replicaOfHost, config_.replicaOfPort);
+    LazyFree::instance().setThreshold(config_.lazyFreeThreshold);
+    for (auto& s : shards_) {
+        s->store().setCompressionThreshold(config_.compressionThreshold);
+        // The limit is split evenly, as keys are
+        size_t trackingKeys = config_.trackingTableMaxKeys;
+        s->store().setTrackingMaxKeys(trackingKeys == 0 ? 0 : std::max<size_t>(1, trackingKeys / threads));
+        Shard* shard = s.get();
+        s->store().setInvalidationWakeup([shard]() { shard->wakeup(); });
+    }
+
+    if (!config_.tieredPath.empty()) {
+        // One value log per shard, written only under that shard's store lock
+        for (int i = 0; i < threads; i++) {
+            std::string path = config_.tieredPath + "." + std::to_string(i);
+            shards_[i]->store().enableTiering(path, config_.tieredMinValue, config_.tieredMemory, config_.tieredCache);
+        }
+    }
+
+    if (config_.clusterEnabled) {
+        cluster_.enable("127.0.0.1", config_.port, config_.clusterConfigFile);
+        // A saved layout wins over --cluster-nodes, which only seeds a new cluster
+        if (!cluster_.loadConfig() && !config_.clusterNodes.empty() && !cluster_.assignEvenly(config_.clusterNodes))
+            std::cerr << "Invalid --cluster-nodes list\n";
+        for (auto& s : shards_)
+            s->store().enableSlotIndex();
+    }
+
+    if (!config_.capturePath.empty() && !capture_.start(config_.capturePath, config_.captureMaxBytes))
+        std::cerr << "Cannot create capture file " << config_.capturePath << "\n";
+
     serverInstance = this;
     installSignalHandlers();
 }
 
-void KVServer::stop() {
-    isRunning_ = false;
-    if (listenSocket_ != -1) {
-        // Persist database before shutdown
-        if (KVStore::instance().saveToDisk("snapshot.kvdb"))
-            std::cout << "Snapshot saved to snapshot.kvdb\n";
-        else 
-            std::cerr << "Error saving snapshot\n";
-        close(listenSocket_);
-    }
-    std::cout << "Server shutdown complete!\n";
+KVServer::~KVServer() {
+    if (serverInstance == this) serverInstance = nullptr;
 }
 
-void KVServer::start() {
-    listenSocket_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenSocket_ < 0) {
-        std::cerr << "Error creating socket\n";
-        return;
-    }
+// Partition by hash slot so {tags} keep keys on one shard and a slot never spans shards
+int KVServer::shardForKey(const std::string& key) const {
+    if (shards_.size() == 1) return 0;
+    return keyHashSlot(key) % static_cast<int>(shards_.size());
+}
 
-    int optVal = 1;
-    setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+void KVServer::registerClient(uint64_t id, int shard) {
+    std::lock_guard<std::mutex> guard(clientsMutex_);
+    clientShards_[id] = shard;
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port_);
-    addr.sin_addr.s_addr = INADDR_ANY;
+void KVServer::unregisterClient(uint64_t id) {
+    std::lock_guard<std::mutex> guard(clientsMutex_);
+    clientShards_.erase(id);
+}
 
-    if (bind(listenSocket_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        std::cerr << "Error binding socket\n";
-        return;
+int KVServer::clientShard(uint64_t id) {
+    std::lock_guard<std::mutex> guard(clientsMutex_);
+    auto it = clientShards_.find(id);
+    return it != clientShards_.end() ? it->second : -1;
+}
+
+bool KVServer::saveSnapshot(const std::string& filepath) {
+    if (shards_.size() == 1)
+        return KVStore::instance().saveToDisk(filepath);
+
+    std::ofstream outFile(filepath, std::ios::binary);
+    if (!outFile) return false;
+    return saveSnapshot(outFile);
+}
+
+bool KVServer::loadSnapshot(const std::string& filepath) {
+    if (shards_.size() == 1)
+        return KVStore::instance().loadFromDisk(filepath);
+
+    std::ifstream inFile(filepath, std::ios::binary);
+    if (!inFile) return false;
+    return loadSnapshot(inFile);
+}
+
+bool KVServer::saveSnapshot(std::ostream& out) {
+    for (auto& s : shards_) {
+        if (!s->store().saveToStream(out)) return false;
     }
+    return true;
+}
 
-    if (listen(listenSocket_, 10) < 0) {
-        std::cerr << "Error listening on socket\n";
-        return;
-    } 
+// Every shard reads the whole stream and keeps the keys it owns
+bool KVServer::loadSnapshot(std::istream& in) {
+    for (int i = 0; i < shardCount(); i++) {
+        in.clear();
+        in.seekg(0);
+        std::function<bool(const std::string&)> ownsKey;
+        if (shards_.size() > 1)
+            ownsKey = [this, i](const std::string& key) { return shardForKey(key) == i; };
+        if (!shards_[i]->store().loadFromStream(in, ownsKey)) return false;
+    }
+    return true;
+}
 
-    std::cout << "KV Server listening on port " << port_ << "\n";
+void KVServer::stop() {
+    isRunning_ = false;
+    capture_.stop();
+    // Persist database before shutdown
+    if (saveSnapshot("snapshot.kvdb"))
+        std::cout << "Snapshot saved to snapshot.kvdb\n";
+    else
+        std::cerr << "Error saving snapshot\n";
+    std::cout << "Server shutdown complete!\n";
+}
 
-    std::vector<std::thread> clientThreads;
-    CommandProcessor processor;
+void KVServer::start() {
+    for (auto& s : shards_) {
+        if (!s->init(config_.port)) return;
+    }
 
-    while (isRunning_) {
-        int clientSocket = accept(listenSocket_, nullptr, nullptr);
-        if (clientSocket < 0) {
-            if (isRunning_) 
-                std::cerr << "Error accepting connection\n";
-            break;
+    std::cout << "KV Server listening on port " << config_.port;
+    if (shards_.size() > 1)
+        std::cout << " (" << shards_.size() << " shards)";
+    std::cout << "\n";
+
+    // Shard 0 runs on the calling thread, every other shard gets a pinned thread
+    std::vector<std::thread> shardThreads;
+    unsigned cores = std::thread::hardware_concurrency();
+    for (size_t i = 1; i < shards_.size(); i++) {
+        shardThreads.emplace_back([this, i]() { shards_[i]->run(config_.io); });
+        if (cores > 1) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            pthread_setaffinity_np(shardThreads.back().native_handle(), sizeof(cpus), &cpus);
         }
-
-        clientThreads.emplace_back([clientSocket, &processor](){
-            char buffer[1024];
-            while (true) {
-                memset(buffer, 0, sizeof(buffer));
-                int bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-                if (bytesRead <= 0) break;
-                std::string request(buffer, bytesRead);
-                std::string response = processor.execute(request);
-                send(clientSocket, response.c_str(), response.size(), 0);
-            }
-            close(clientSocket);
-        });
     }
-    
-    for (auto& t : clientThreads) {
+    shards_[0]->run(config_.io);
+
+    for (auto& t : shardThreads) {
         if (t.joinable()) t.join();
     }
 
     // Final persistence before exit
-    if (KVStore::instance().saveToDisk("snapshot.kvdb"))
+    if (saveSnapshot("snapshot.kvdb"))
         std::cout << "Snapshot saved to snapshot.kvdb\n";
-    else 
+    else
         std::cerr << "Error saving snapshot\n";
 }
@@ -1,9 +1,16 @@
 #include "../include/KVStore.h"
+#include "../include/Cluster.h"
+#include "../include/Compression.h"
+#include "../include/Bitops.h"
+#include "../include/LazyFree.h"
 
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 
 // Singleton accessor
 KVStore& KVStore::instance() {
@@ -11,35 +18,256 @@ KVStore& KVStore::instance() {
     return inst;
 }
 
+std::unique_lock<std::recursive_mutex> KVStore::acquireLock() {
+    return std::unique_lock<std::recursive_mutex>(storeMutex_);
+}
+
+uint64_t KVStore::watchKey(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    auto& watched = watchedKeys_[key];
+    if (watched.watchers++ == 0)
+        watchedCount_++;
+    return watched.version;
+}
+
+void KVStore::unwatchKey(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    auto it = watchedKeys_.find(key);
+    if (it == watchedKeys_.end()) return;
+    if (--it->second.watchers == 0) {
+        watchedKeys_.erase(it);
+        watchedCount_--;
+    }
+}
+
+uint64_t KVStore::keyVersion(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    auto it = watchedKeys_.find(key);
+    return it != watchedKeys_.end() ? it->second.version : 0;
+}
+
+// Bump the version of every watched key among keys so pending EXECs abort
+void KVStore::touchKeys(const std::vector<std::string>& keys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    for (const auto& key : keys) {
+        auto it = watchedKeys_.find(key);
+        if (it != watchedKeys_.end()) it->second.version++;
+    }
+}
+
+void KVStore::touchAllKeys() {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    for (auto& entry : watchedKeys_)
+        entry.second.version++;
+}
+
+// Client-side caching
+void KVStore::setTrackingMaxKeys(size_t maxKeys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    tracking_.setMaxKeys(maxKeys);
+}
+
+// Called with the lock held since the read, so no write comes in between
+void KVStore::trackKeys(const std::vector<std::string>& keys, const Tracker& tracker) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    for (const auto& key : keys)
+        tracking_.track(key, tracker, invalidations_);
+    trackingChanged();
+}
+
+void KVStore::invalidateKeys(const std::vector<std::string>& keys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    for (const auto& key : keys)
+        tracking_.invalidate(key, invalidations_);
+    trackingChanged();
+}
+
+void KVStore::trackPrefixes(uint64_t owner, const Tracker& target, const std::vector<std::string>& prefixes) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    for (const auto& prefix : prefixes)
+        tracking_.addPrefix(owner, target, prefix);
+    trackingChanged();
+}
+
+void KVStore::untrackPrefixes(uint64_t owner) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    tracking_.removePrefixes(owner);
+    trackingChanged();
+}
+
+std::vector<Invalidation> KVStore::takeInvalidations() {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    std::vector<Invalidation> taken;
+    taken.swap(invalidations_);
+    invalidationsPending_ = false;
+    return taken;
+}
+
+void KVStore::setInvalidationWakeup(std::function<void()> wakeup) {
+    invalidationWakeup_ = std::move(wakeup);
+}
+
+// Caller holds storeMutex_
+void KVStore::trackingChanged() {
+    trackingActive_ = !tracking_.empty();
+    bool pending = !invalidations_.empty();
+    if (pending != invalidationsPending_.exchange(pending) && pending && invalidationWakeup_)
+        invalidationWakeup_();
+}
+
+// Free effort: one unit per element, strings one unit per 64 KB
+static size_t freeEffort(const std::string& val) { return 1 + val.size() / 65536; }
+static size_t freeEffort(const std::vector<std::string>& val) { return val.size(); }
+static size_t freeEffort(const std::unordered_map<std::string, std::string>& val) { return val.size(); }
+static size_t freeEffort(const SortedSet& val) { return val.size(); }
+static size_t freeEffort(const HyperLogLog&) { return 1; }
+
+template <typename T>
+static void lazyRelease(T&& value) {
+    LazyFree::instance().release(std::move(value), freeEffort(value));
+}
+
+// Move the value under key out of map, freeing it lazily
+template <typename Map>
+static bool unlinkEntry(Map& map, const std::string& key) {
+    auto it = map.find(key);
+    if (it == map.end()) return false;
+    lazyRelease(std::move(it->second));
+    map.erase(it);
+    return true;
+}
+
+// Move oldKey's value to newKey; an overwritten value is freed lazily
+template <typename Map>
+static bool moveEntry(Map& map, const std::string& oldKey, const std::string& newKey) {
+    auto node = map.extract(oldKey);
+    if (node.empty()) return false;
+    auto dst = map.find(newKey);
+    if (dst != map.end()) {
+        lazyRelease(std::move(dst->second));
+        dst->second = std::move(node.mapped());
+    } else {
+        node.key() = newKey;
+        map.insert(std::move(node));
+    }
+    return true;
+}
+
 // General Commands
-bool KVStore::clearAll() {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+bool KVStore::clearAll(bool async) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    if (async) {
+        LazyFree& lazyFree = LazyFree::instance();
+        lazyFree.defer(std::move(stringData_));
+        lazyFree.defer(std::move(listData_));
+        lazyFree.defer(std::move(hashData_));
+        lazyFree.defer(std::move(zsetData_));
+        lazyFree.defer(std::move(hllData_));
+    }
     stringData_.clear();
     listData_.clear();
     hashData_.clear();
+    zsetData_.clear();
+    hllData_.clear();
     expiryTimes_.clear();
+    nextExpiry_ = std::chrono::steady_clock::time_point::max();
+    for (auto& keys : slotKeys_)
+        keys.clear();
+    if (trackingActive_) {
+        tracking_.invalidateAll(invalidations_);
+        trackingChanged();
+    }
+    if (valueLog_) {
+        valueLog_->clear();
+        largeValues_.clear();
+        largeOrder_.clear();
+        spilled_.clear();
+        residentLarge_ = 0;
+        spillAfter_ = 0;
+    }
     return true;
 }
 
 // String Operations
 void KVStore::setString(const std::string& key, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
-    stringData_[key] = val;
+    std::string stored = encodeValue(val, compressThreshold_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    storeString(key, std::move(stored));
+}
+
+// Replace key's string value with an already encoded one
+void KVStore::storeString(const std::string& key, std::string stored) {
+    auto it = stringData_.find(key);
+    if (it == stringData_.end()) {
+        it = stringData_.emplace(key, std::move(stored)).first;
+        indexKey(key);
+        trackString(key, it->second);
+        return;
+    }
+    untrackString(key);
+    lazyRelease(std::move(it->second));
+    it->second = std::move(stored);
+    trackString(key, it->second);
 }
 
 bool KVStore::getString(const std::string& key, std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
+    std::string scratch;
+    const std::string* raw = peekString(key, scratch);
+    if (!raw) return false;
+    if (raw == &scratch)
+        val.swap(scratch);
+    else
+        val = *raw;
+    return true;
+}
+
+// Raw value of a string key without copying it when it is stored plain;
+// scratch holds it when it had to be read back or decompressed
+const std::string* KVStore::peekString(const std::string& key, std::string& scratch) {
     auto it = stringData_.find(key);
-    if (it != stringData_.end()) {
-        val = it->second;
-        return true;
+    if (it == stringData_.end()) return nullptr;
+    const std::string& stored = readString(key, it->second, scratch);
+    if (valueLog_ && stored.size() >= tierMinValue_) {
+        auto large = largeValues_.find(key);
+        if (large != largeValues_.end()) largeOrder_.splice(largeOrder_.end(), largeOrder_, large->second);
     }
-    return false;
+    if (!isEncodedValue(stored)) return &stored;
+    std::string raw;
+    if (!decodeValue(stored, raw)) return nullptr;
+    scratch.swap(raw);
+    return &scratch;
+}
+
+// Writable raw value of a string key, created empty if missing. A spilled or
+// compressed value is expanded in place; the value is untracked until the
+// caller passes it to commitString once modified
+std::string& KVStore::mutableString(const std::string& key) {
+    auto it = stringData_.find(key);
+    if (it == stringData_.end()) {
+        it = stringData_.emplace(key, std::string()).first;
+        indexKey(key);
+        return it->second;
+    }
+    std::string scratch, raw;
+    const std::string& stored = readString(key, it->second, scratch);
+    bool expand = &stored != &it->second || isEncodedValue(stored);
+    if (expand) decodeValue(stored, raw);
+    untrackString(key);
+    if (expand) it->second = std::move(raw);
+    return it->second;
+}
+
+void KVStore::commitString(const std::string& key, std::string& value) {
+    // Edited bytes can come to look like a frame header
+    if (isEncodedValue(value))
+        value = encodeValue(std::move(value), 0);
+    trackString(key, value);
 }
 
 std::vector<std::string> KVStore::getAllKeys() {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
     std::vector<std::string> allKeys;
     for (const auto& entry : stringData_) {
@@ -51,11 +279,17 @@ std::vector<std::string> KVStore::getAllKeys() {
     for (const auto& entry : hashData_) {
         allKeys.push_back(entry.first);
     }
+    for (const auto& entry : zsetData_) {
+        allKeys.push_back(entry.first);
+    }
+    for (const auto& entry : hllData_) {
+        allKeys.push_back(entry.first);
+    }
     return allKeys;
 }
 
 std::string KVStore::getKeyType(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
     if (stringData_.find(key) != stringData_.end()) 
         return "string";
@@ -63,94 +297,154 @@ std::string KVStore::getKeyType(const std::string& key) {
         return "list";
     if (hashData_.find(key) != hashData_.end()) 
         return "hash";
+    if (zsetData_.find(key) != zsetData_.end())
+        return "zset";
+    if (hllData_.find(key) != hllData_.end())
+        return "hyperloglog";
     return "none";    
 }
 
 bool KVStore::removeKey(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
+    untrackString(key);
     bool removed = false;
     removed |= stringData_.erase(key) > 0;
     removed |= listData_.erase(key) > 0;
     removed |= hashData_.erase(key) > 0;
+    removed |= zsetData_.erase(key) > 0;
+    removed |= hllData_.erase(key) > 0;
     expiryTimes_.erase(key);
+    if (removed) unindexKey(key);
+    return removed;
+}
+
+bool KVStore::unlinkKey(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    untrackString(key);
+    bool removed = false;
+    removed |= unlinkEntry(stringData_, key);
+    removed |= unlinkEntry(listData_, key);
+    removed |= unlinkEntry(hashData_, key);
+    removed |= unlinkEntry(zsetData_, key);
+    removed |= unlinkEntry(hllData_, key);
+    expiryTimes_.erase(key);
+    if (removed) unindexKey(key);
     return removed;
 }
 
 bool KVStore::setExpiry(const std::string& key, int ttlSeconds) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
-    bool keyExists = (stringData_.find(key) != stringData_.end()) ||
-                     (listData_.find(key) != listData_.end()) ||
-                     (hashData_.find(key) != hashData_.end());
-    if (!keyExists)
+    if (!keyExists(key))
         return false;
     
-    expiryTimes_[key] = std::chrono::steady_clock::now() + std::chrono::seconds(ttlSeconds);
+    setExpiryTime(key, std::chrono::steady_clock::now() + std::chrono::seconds(ttlSeconds));
     return true;
 }
 
+void KVStore::setExpiryTime(const std::string& key, std::chrono::steady_clock::time_point when) {
+    expiryTimes_[key] = when;
+    nextExpiry_ = std::min(nextExpiry_, when);
+}
+
 void KVStore::cleanupExpired() {
     auto currentTime = std::chrono::steady_clock::now();
+    // Every store call lands here; scan only once the earliest deadline passed
+    if (currentTime <= nextExpiry_) return;
+    nextExpiry_ = std::chrono::steady_clock::time_point::max();
     for (auto it = expiryTimes_.begin(); it != expiryTimes_.end(); ) {
         if (currentTime > it->second) {
-            stringData_.erase(it->first);
-            listData_.erase(it->first);
-            hashData_.erase(it->first);
+            untrackString(it->first);
+            unlinkEntry(stringData_, it->first);
+            unlinkEntry(listData_, it->first);
+            unlinkEntry(hashData_, it->first);
+            unlinkEntry(zsetData_, it->first);
+            unlinkEntry(hllData_, it->first);
+            unindexKey(it->first);
+            if (trackingActive_) tracking_.invalidate(it->first, invalidations_);
             it = expiryTimes_.erase(it);
         } else {
+            nextExpiry_ = std::min(nextExpiry_, it->second);
             ++it;
         }
     }
+    if (trackingActive_) trackingChanged();
 }
 
-bool KVStore::renameKey(const std::string& oldKey, const std::string& newKey) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+void KVStore::expireKeys() {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     cleanupExpired();
-    bool found = false;
-
-    auto strIt = stringData_.find(oldKey);
-    if (strIt != stringData_.end()) {
-        stringData_[newKey] = strIt->second;
-        stringData_.erase(strIt);
-        found = true;
-    }
-
-    auto listIt = listData_.find(oldKey);
-    if (listIt != listData_.end()) {
-        listData_[newKey] = listIt->second;
-        listData_.erase(listIt);
-        found = true;
-    }
+}
 
-    auto hashIt = hashData_.find(oldKey);
-    if (hashIt != hashData_.end()) {
-        hashData_[newKey] = hashIt->second;
-        hashData_.erase(hashIt);
-        found = true;
+bool KVStore::renameKey(const std::string& oldKey, const std::string& newKey) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    // Tiering state follows the value; an overwritten string is dropped first
+    if (valueLog_ && oldKey != newKey && stringData_.count(oldKey)) {
+        untrackString(newKey);
+        auto large = largeValues_.extract(oldKey);
+        if (!large.empty()) {
+            large.key() = newKey;
+            *large.mapped() = newKey;
+            largeValues_.insert(std::move(large));
+        }
+        auto spilled = spilled_.extract(oldKey);
+        if (!spilled.empty()) {
+            spilled.key() = newKey;
+            spilled_.insert(std::move(spilled));
+        }
     }
+    bool found = false;
+    found |= moveEntry(stringData_, oldKey, newKey);
+    found |= moveEntry(listData_, oldKey, newKey);
+    found |= moveEntry(hashData_, oldKey, newKey);
+    found |= moveEntry(zsetData_, oldKey, newKey);
+    found |= moveEntry(hllData_, oldKey, newKey);
 
     auto expIt = expiryTimes_.find(oldKey);
     if (expIt != expiryTimes_.end()) {
         expiryTimes_[newKey] = expIt->second;
         expiryTimes_.erase(expIt);
     }
-
+    if (found) {
+        unindexKey(oldKey);
+        indexKey(newKey);
+    }
     return found;
 }
 
+int64_t KVStore::getTtlMs(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = expiryTimes_.find(key);
+    if (it == expiryTimes_.end())
+        return 0;
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(it->second - std::chrono::steady_clock::now());
+    return std::max<int64_t>(1, remaining.count());
+}
+
+bool KVStore::keyExists(const std::string& key) const {
+    return stringData_.count(key) || listData_.count(key) || hashData_.count(key) || zsetData_.count(key) ||
+           hllData_.count(key);
+}
+
 // List Operations
 std::vector<std::string> KVStore::getList(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it != listData_.end()) {
-        return it->second; 
+        std::vector<std::string> items(it->second.size());
+        for (size_t i = 0; i < items.size(); i++)
+            decodeValue(it->second[i], items[i]);
+        return items;
     }
     return {}; 
 }
 
 ssize_t KVStore::listSize(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it != listData_.end()) 
         return it->second.size();
@@ -158,20 +452,25 @@ ssize_t KVStore::listSize(const std::string& key) {
 }
 
 void KVStore::listPushFront(const std::string& key, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
-    listData_[key].insert(listData_[key].begin(), val);
+    std::string stored = encodeValue(val, compressThreshold_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    auto& items = listData_[key];
+    items.insert(items.begin(), std::move(stored));
+    indexKey(key);
 }
 
 void KVStore::listPushBack(const std::string& key, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
-    listData_[key].push_back(val);
+    std::string stored = encodeValue(val, compressThreshold_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    listData_[key].push_back(std::move(stored));
+    indexKey(key);
 }
 
 bool KVStore::listPopFront(const std::string& key, std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it != listData_.end() && !it->second.empty()) {
-        val = it->second.front();
+        decodeValue(it->second.front(), val);
         it->second.erase(it->second.begin());
         return true;
     }
@@ -179,18 +478,45 @@ bool KVStore::listPopFront(const std::string& key, std::string& val) {
 }
 
 bool KVStore::listPopBack(const std::string& key, std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it != listData_.end() && !it->second.empty()) {
-        val = it->second.back();
+        decodeValue(it->second.back(), val);
         it->second.pop_back();
         return true;
     }
     return false;
 }
 
+// Pop from one end of src and push onto one end of dst in a single step
+bool KVStore::listMove(const std::string& src, const std::string& dst, bool fromFront, bool toFront, std::string& val) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    auto it = listData_.find(src);
+    if (it == listData_.end() || it->second.empty())
+        return false;
+
+    // The item moves in its stored form
+    auto& from = it->second;
+    std::string item;
+    if (fromFront) {
+        item = std::move(from.front());
+        from.erase(from.begin());
+    } else {
+        item = std::move(from.back());
+        from.pop_back();
+    }
+    decodeValue(item, val);
+    auto& to = listData_[dst];
+    if (toFront)
+        to.insert(to.begin(), std::move(item));
+    else
+        to.push_back(std::move(item));
+    indexKey(dst);
+    return true;
+}
+
 int KVStore::listRemove(const std::string& key, int count, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     int removedCount = 0;
     auto it = listData_.find(key);
     if (it == listData_.end()) 
@@ -200,13 +526,14 @@ int KVStore::listRemove(const std::string& key, int count, const std::string& va
 
     if (count == 0) {
         // Remove all occurrences
-        auto newEnd = std::remove(items.begin(), items.end(), val);
+        auto newEnd = std::remove_if(items.begin(), items.end(),
+                                     [&val](const std::string& item) { return storedEquals(item, val); });
         removedCount = std::distance(newEnd, items.end());
         items.erase(newEnd, items.end());
     } else if (count > 0) {
         // Remove from head to tail
         for (auto iter = items.begin(); iter != items.end() && removedCount < count; ) {
-            if (*iter == val) {
+            if (storedEquals(*iter, val)) {
                 iter = items.erase(iter);
                 ++removedCount;
             } else {
@@ -216,7 +543,7 @@ int KVStore::listRemove(const std::string& key, int count, const std::string& va
     } else {
         // Remove from tail to head (count is negative)
         for (auto rit = items.rbegin(); rit != items.rend() && removedCount < (-count); ) {
-            if (*rit == val) {
+            if (storedEquals(*rit, val)) {
                 auto fwdIt = rit.base();
                 --fwdIt;
                 fwdIt = items.erase(fwdIt);
@@ -231,7 +558,7 @@ int KVStore::listRemove(const std::string& key, int count, const std::string& va
 }
 
 bool KVStore::listGetAt(const std::string& key, int idx, std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it == listData_.end()) 
         return false;
@@ -242,12 +569,12 @@ bool KVStore::listGetAt(const std::string& key, int idx, std::string& val) {
     if (idx < 0 || idx >= static_cast<int>(items.size()))
         return false;
     
-    val = items[idx];
-    return true;
+    return decodeValue(items[idx], val);
 }
 
 bool KVStore::listSetAt(const std::string& key, int idx, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::string stored = encodeValue(val, compressThreshold_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = listData_.find(key);
     if (it == listData_.end()) 
         return false;
@@ -258,19 +585,20 @@ bool KVStore::listSetAt(const std::string& key, int idx, const std::string& val)
     if (idx < 0 || idx >= static_cast<int>(items.size()))
         return false;
     
-    items[idx] = val;
+    items[idx] = std::move(stored);
     return true;
 }
 
 // Hash Operations
 bool KVStore::hashSet(const std::string& key, const std::string& field, const std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     hashData_[key][field] = val;
+    indexKey(key);
     return true;
 }
 
 bool KVStore::hashGet(const std::string& key, const std::string& field, std::string& val) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = hashData_.find(key);
     if (it != hashData_.end()) {
         auto fieldIt = it->second.find(field);
@@ -283,7 +611,7 @@ bool KVStore::hashGet(const std::string& key, const std::string& field, std::str
 }
 
 bool KVStore::hashFieldExists(const std::string& key, const std::string& field) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = hashData_.find(key);
     if (it != hashData_.end())
         return it->second.find(field) != it->second.end();
@@ -291,7 +619,7 @@ bool KVStore::hashFieldExists(const std::string& key, const std::string& field)
 }
 
 bool KVStore::hashDeleteField(const std::string& key, const std::string& field) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = hashData_.find(key);
     if (it != hashData_.end())
         return it->second.erase(field) > 0;
@@ -299,14 +627,14 @@ bool KVStore::hashDeleteField(const std::string& key, const std::string& field)
 }
 
 std::unordered_map<std::string, std::string> KVStore::hashGetAll(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     if (hashData_.find(key) != hashData_.end())
         return hashData_[key];
     return {};
 }
 
 std::vector<std::string> KVStore::hashGetFields(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     std::vector<std::string> fields;
     auto it = hashData_.find(key);
     if (it != hashData_.end()) {
@@ -317,7 +645,7 @@ std::vector<std::string> KVStore::hashGetFields(const std::string& key) {
 }
 
 std::vector<std::string> KVStore::hashGetValues(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     std::vector<std::string> values;
     auto it = hashData_.find(key);
     if (it != hashData_.end()) {
@@ -328,77 +656,496 @@ std::vector<std::string> KVStore::hashGetValues(const std::string& key) {
 }
 
 ssize_t KVStore::hashSize(const std::string& key) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     auto it = hashData_.find(key);
     return (it != hashData_.end()) ? it->second.size() : 0;
 }
 
 bool KVStore::hashSetMultiple(const std::string& key, const std::vector<std::pair<std::string, std::string>>& pairs) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
     for (const auto& p : pairs) {
         hashData_[key][p.first] = p.second;
     }
+    indexKey(key);
     return true;
 }
 
+// Sorted Set Operations
+size_t KVStore::zsetAdd(const std::string& key, const std::vector<ScoredMember>& members, unsigned flags, size_t& changed) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    changed = 0;
+    size_t added = 0;
+    auto it = zsetData_.find(key);
+    for (const auto& entry : members) {
+        double current;
+        bool exists = it != zsetData_.end() && it->second.score(entry.member, current);
+        if (exists ? (flags & ZADD_NX) : (flags & ZADD_XX))
+            continue;
+        if (exists && (((flags & ZADD_GT) && entry.score <= current) || ((flags & ZADD_LT) && entry.score >= current)))
+            continue;
+        if (it == zsetData_.end()) {
+            it = zsetData_.emplace(key, SortedSet()).first;
+            indexKey(key);
+        }
+        if (it->second.set(entry.member, entry.score)) {
+            changed++;
+            if (!exists) added++;
+        }
+    }
+    return added;
+}
+
+bool KVStore::zsetIncrBy(const std::string& key, const std::string& member, double delta, unsigned flags, double& result) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    double current = 0;
+    bool exists = it != zsetData_.end() && it->second.score(member, current);
+    if (exists ? (flags & ZADD_NX) : (flags & ZADD_XX))
+        return false;
+    result = current + delta;
+    if (std::isnan(result))
+        return false;
+    if (exists && (((flags & ZADD_GT) && result <= current) || ((flags & ZADD_LT) && result >= current)))
+        return false;
+    if (it == zsetData_.end()) {
+        it = zsetData_.emplace(key, SortedSet()).first;
+        indexKey(key);
+    }
+    it->second.set(member, result);
+    return true;
+}
+
+size_t KVStore::zsetRemove(const std::string& key, const std::vector<std::string>& members) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    if (it == zsetData_.end())
+        return 0;
+    size_t removed = 0;
+    for (const auto& member : members) {
+        if (it->second.remove(member)) removed++;
+    }
+    if (it->second.size() == 0) {
+        zsetData_.erase(it);
+        expiryTimes_.erase(key);
+        unindexKey(key);
+    }
+    return removed;
+}
+
+size_t KVStore::zsetSize(const std::string& key) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    return it != zsetData_.end() ? it->second.size() : 0;
+}
+
+bool KVStore::zsetScore(const std::string& key, const std::string& member, double& score) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    return it != zsetData_.end() && it->second.score(member, score);
+}
+
+long KVStore::zsetRank(const std::string& key, const std::string& member, bool reverse) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    return it != zsetData_.end() ? it->second.rank(member, reverse) : -1;
+}
+
+std::vector<ScoredMember> KVStore::zsetRangeByRank(const std::string& key, long start, long stop, bool reverse) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    if (it == zsetData_.end())
+        return {};
+    long size = static_cast<long>(it->second.size());
+    if (start < 0) start = std::max(0L, size + start);
+    if (stop < 0) stop = size + stop;
+    if (start > stop || start >= size)
+        return {};
+    return it->second.rangeByRank(start, std::min(stop, size - 1), reverse);
+}
+
+std::vector<ScoredMember> KVStore::zsetRangeByScore(const std::string& key, const ScoreRange& range, bool reverse,
+                                                    size_t offset, long count) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = zsetData_.find(key);
+    if (it == zsetData_.end())
+        return {};
+    return it->second.rangeByScore(range, reverse, offset, count);
+}
+
+// Bitmap Operations
+// Resolve negative indexes from the end and clamp to the value; false if the range is empty
+static bool clampRange(int64_t& start, int64_t& end, int64_t length) {
+    if (start < 0) start = length + start;
+    if (end < 0) end = length + end;
+    if (start < 0) start = 0;
+    if (end < 0) end = 0;
+    if (end >= length) end = length - 1;
+    return start <= end;
+}
+
+static const uint8_t* bytesOf(const std::string& value) {
+    return reinterpret_cast<const uint8_t*>(value.data());
+}
+
+int KVStore::setBit(const std::string& key, uint64_t offset, int bit) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::string& value = mutableString(key);
+    size_t byte = offset >> 3;
+    if (value.size() <= byte)
+        value.resize(byte + 1, '\0');
+    uint8_t mask = static_cast<uint8_t>(1 << (7 - (offset & 7)));
+    uint8_t current = static_cast<uint8_t>(value[byte]);
+    value[byte] = static_cast<char>(bit ? (current | mask) : (current & ~mask));
+    commitString(key, value);
+    return (current & mask) != 0;
+}
+
+int KVStore::getBit(const std::string& key, uint64_t offset) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::string scratch;
+    const std::string* value = peekString(key, scratch);
+    size_t byte = offset >> 3;
+    if (!value || byte >= value->size())
+        return 0;
+    return (static_cast<uint8_t>((*value)[byte]) >> (7 - (offset & 7))) & 1;
+}
+
+uint64_t KVStore::bitCount(const std::string& key, int64_t start, int64_t end, bool bitUnits) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::string scratch;
+    const std::string* value = peekString(key, scratch);
+    if (!value) return 0;
+    int64_t length = static_cast<int64_t>(value->size()) * (bitUnits ? 8 : 1);
+    if (!clampRange(start, end, length))
+        return 0;
+    if (bitUnits)
+        return popcountBits(bytesOf(*value), start, end);
+    return popcount(bytesOf(*value) + start, end - start + 1);
+}
+
+int64_t KVStore::bitPos(const std::string& key, int bit, int64_t start, int64_t end, bool endGiven, bool bitUnits) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::string scratch;
+    const std::string* value = peekString(key, scratch);
+    if (!value)
+        return bit ? -1 : 0;
+    int64_t length = static_cast<int64_t>(value->size()) * (bitUnits ? 8 : 1);
+    if (!clampRange(start, end, length))
+        return -1;
+    int64_t startBit = bitUnits ? start : start * 8;
+    int64_t endBit = bitUnits ? end : end * 8 + 7;
+    int64_t pos = findBit(bytesOf(*value), startBit, endBit, bit);
+    // Past the value every bit is clear, unless the caller bounded the range
+    if (pos < 0 && bit == 0 && !endGiven)
+        return endBit + 1;
+    return pos;
+}
+
+size_t KVStore::bitOp(BitOp op, const std::string& dest, const std::vector<std::string>& keys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::vector<std::string> scratch(keys.size());
+    std::vector<const std::string*> sources(keys.size());
+    size_t maxLen = 0;
+    for (size_t i = 0; i < keys.size(); i++) {
+        sources[i] = peekString(keys[i], scratch[i]);
+        if (sources[i]) maxLen = std::max(maxLen, sources[i]->size());
+    }
+    if (maxLen == 0) {
+        removeKey(dest);
+        return 0;
+    }
+
+    // Missing keys and bytes past a shorter value count as zeros
+    std::string result(maxLen, '\0');
+    uint8_t* out = reinterpret_cast<uint8_t*>(&result[0]);
+    if (op == BITOP_NOT) {
+        bitwiseInto(BITOP_NOT, out, bytesOf(*sources[0]), maxLen);
+    } else {
+        if (sources[0]) std::memcpy(out, sources[0]->data(), sources[0]->size());
+        for (size_t i = 1; i < sources.size(); i++) {
+            size_t len = sources[i] ? sources[i]->size() : 0;
+            if (len) bitwiseInto(op, out, bytesOf(*sources[i]), len);
+            if (op == BITOP_AND && len < maxLen)
+                std::memset(out + len, 0, maxLen - len);
+        }
+    }
+    storeString(dest, encodeValue(std::move(result), compressThreshold_));
+    return maxLen;
+}
+
+std::vector<std::optional<int64_t>> KVStore::bitField(const std::string& key, const std::vector<BitFieldOp>& ops) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::vector<std::optional<int64_t>> replies;
+    replies.reserve(ops.size());
+    uint64_t needed = 0;
+    for (const auto& op : ops) {
+        if (op.kind != BitFieldOp::GET)
+            needed = std::max<uint64_t>(needed, (op.offset + op.bits + 7) / 8);
+    }
+
+    // Only GETs: read the value where it is, without creating the key
+    if (needed == 0) {
+        std::string scratch;
+        const std::string* value = peekString(key, scratch);
+        for (const auto& op : ops)
+            replies.push_back(value ? readBitField(op, bytesOf(*value), value->size()) : 0);
+        return replies;
+    }
+
+    std::string& value = mutableString(key);
+    if (value.size() < needed)
+        value.resize(needed, '\0');
+    uint8_t* data = reinterpret_cast<uint8_t*>(&value[0]);
+    for (const auto& op : ops) {
+        int64_t reply;
+        if (applyBitField(op, data, value.size(), reply))
+            replies.push_back(reply);
+        else
+            replies.push_back(std::nullopt);
+    }
+    commitString(key, value);
+    return replies;
+}
+
+// HyperLogLog Operations
+bool KVStore::hllAdd(const std::string& key, const std::vector<std::string>& elements) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    auto it = hllData_.find(key);
+    bool changed = it == hllData_.end();
+    if (changed) {
+        it = hllData_.emplace(key, HyperLogLog()).first;
+        indexKey(key);
+    }
+    for (const auto& element : elements)
+        changed |= it->second.add(element);
+    return changed;
+}
+
+uint64_t KVStore::hllCount(const std::vector<std::string>& keys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    if (keys.size() == 1) {
+        auto it = hllData_.find(keys[0]);
+        return it != hllData_.end() ? it->second.count() : 0;
+    }
+    // Union estimate over the register-wise maximum, not cached
+    std::vector<uint8_t> registers(HyperLogLog::kRegisters, 0);
+    for (const auto& key : keys) {
+        auto it = hllData_.find(key);
+        if (it != hllData_.end()) it->second.maxInto(registers.data());
+    }
+    return HyperLogLog::estimate(registers.data());
+}
+
+void KVStore::hllMerge(const std::string& dest, const std::vector<std::string>& sources) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::vector<uint8_t> registers(HyperLogLog::kRegisters, 0);
+    auto it = hllData_.find(dest);
+    if (it != hllData_.end()) it->second.maxInto(registers.data());
+    for (const auto& key : sources) {
+        auto src = hllData_.find(key);
+        if (src != hllData_.end()) src->second.maxInto(registers.data());
+    }
+    if (it == hllData_.end()) {
+        it = hllData_.emplace(dest, HyperLogLog()).first;
+        indexKey(dest);
+    }
+    it->second.assign(registers.data());
+}
+
 /*
-Simple text-based persistence format:
-S = String (key-value)
-L = List
-H = Hash
+Binary persistence format (integers little-endian, strings as uint32 length + bytes):
+  "KVDB" <version byte>, then records until 'X'
+  S <key> <value>                       # String
+  L <key> <u32 count> <item>...         # List
+  H <key> <u32 count> <field> <value>...# Hash
+  Z <key> <u32 count> (<member> <u64 IEEE-754 score>)... # Sorted set, ascending
+  P <key> <sketch>                      # HyperLogLog, HyperLogLog::serialize()
+  E <key> <u64 ttl milliseconds>        # Expiry of the preceding key
+  X                                     # End of section
+String values and list items are written in their stored form (Compression.h),
+so compressed values go to disk and to replicas as is. Version 1 files predate
+that and are escaped on load.
+A file written by several shards holds one section per shard.
+The legacy text format (S/L/H lines) is still accepted on load.
 */
+static const char kSnapshotMagic[4] = {'K', 'V', 'D', 'B'};
+static const char kSnapshotVersion = 2;
+
+static void writeU32(std::ostream& out, uint32_t v) {
+    char bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = static_cast<char>(v >> (8 * i));
+    out.write(bytes, 4);
+}
+
+static void writeU64(std::ostream& out, uint64_t v) {
+    char bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = static_cast<char>(v >> (8 * i));
+    out.write(bytes, 8);
+}
+
+static void writeBlob(std::ostream& out, const std::string& s) {
+    writeU32(out, static_cast<uint32_t>(s.size()));
+    out.write(s.data(), s.size());
+}
+
+static bool readU32(std::istream& in, uint32_t& v) {
+    unsigned char bytes[4];
+    if (!in.read(reinterpret_cast<char*>(bytes), 4)) return false;
+    v = 0;
+    for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+    return true;
+}
+
+static bool readU64(std::istream& in, uint64_t& v) {
+    unsigned char bytes[8];
+    if (!in.read(reinterpret_cast<char*>(bytes), 8)) return false;
+    v = 0;
+    for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    return true;
+}
+
+static bool readBlob(std::istream& in, std::string& s) {
+    uint32_t len;
+    if (!readU32(in, len)) return false;
+    s.resize(len);
+    return len == 0 || static_cast<bool>(in.read(&s[0], len));
+}
+
+// One record per value type; shared by snapshots and DUMP
+static void writeRecord(std::ostream& out, const std::string& key, const std::string& val) {
+    out.put('S');
+    writeBlob(out, key);
+    writeBlob(out, val);
+}
+
+static void writeRecord(std::ostream& out, const std::string& key, const std::vector<std::string>& items) {
+    out.put('L');
+    writeBlob(out, key);
+    writeU32(out, static_cast<uint32_t>(items.size()));
+    for (const auto& item : items)
+        writeBlob(out, item);
+}
+
+static void writeRecord(std::ostream& out, const std::string& key,
+                        const std::unordered_map<std::string, std::string>& fields) {
+    out.put('H');
+    writeBlob(out, key);
+    writeU32(out, static_cast<uint32_t>(fields.size()));
+    for (const auto& fieldVal : fields) {
+        writeBlob(out, fieldVal.first);
+        writeBlob(out, fieldVal.second);
+    }
+}
+
+static void writeRecord(std::ostream& out, const std::string& key, const HyperLogLog& hll) {
+    out.put('P');
+    writeBlob(out, key);
+    writeBlob(out, hll.serialize());
+}
+
+static void writeRecord(std::ostream& out, const std::string& key, const SortedSet& zset) {
+    out.put('Z');
+    writeBlob(out, key);
+    writeU32(out, static_cast<uint32_t>(zset.size()));
+    for (const auto& scored : zset.entries()) {
+        uint64_t bits;
+        std::memcpy(&bits, &scored.score, sizeof(bits));
+        writeBlob(out, scored.member);
+        writeU64(out, bits);
+    }
+}
+
 bool KVStore::saveToDisk(const std::string& filepath) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
     std::ofstream outFile(filepath, std::ios::binary);
     if (!outFile) return false;
+    return saveToStream(outFile);
+}
 
-    for (const auto& entry : stringData_) {
-        outFile << "S " << entry.first << " " << entry.second << "\n";
-    }
-    for (const auto& entry : listData_) {
-        outFile << "L " << entry.first;
-        for (const auto& item : entry.second)
-            outFile << " " << item;
-        outFile << "\n";
-    }
-    for (const auto& entry : hashData_) {
-        outFile << "H " << entry.first;
-        for (const auto& fieldVal : entry.second) 
-            outFile << " " << fieldVal.first << ":" << fieldVal.second;
-        outFile << "\n";
+bool KVStore::saveToStream(std::ostream& outFile) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    outFile.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+    outFile.put(kSnapshotVersion);
+
+    std::string scratch;
+    for (const auto& entry : stringData_)
+        writeRecord(outFile, entry.first, readString(entry.first, entry.second, scratch));
+    for (const auto& entry : listData_)
+        writeRecord(outFile, entry.first, entry.second);
+    for (const auto& entry : hashData_)
+        writeRecord(outFile, entry.first, entry.second);
+    for (const auto& entry : zsetData_)
+        writeRecord(outFile, entry.first, entry.second);
+    for (const auto& entry : hllData_)
+        writeRecord(outFile, entry.first, entry.second);
+    auto currentTime = std::chrono::steady_clock::now();
+    for (const auto& entry : expiryTimes_) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(entry.second - currentTime);
+        outFile.put('E');
+        writeBlob(outFile, entry.first);
+        writeU64(outFile, static_cast<uint64_t>(std::max<int64_t>(1, remaining.count())));
     }
-    return true;
+    outFile.put('X');
+    return static_cast<bool>(outFile);
 }
 
 bool KVStore::loadFromDisk(const std::string& filepath) {
-    std::lock_guard<std::mutex> guard(storeMutex_);
     std::ifstream inFile(filepath, std::ios::binary);
     if (!inFile) return false;
+    return loadFromStream(inFile, nullptr);
+}
 
-    stringData_.clear();
-    listData_.clear();
-    hashData_.clear();
+bool KVStore::loadFromStream(std::istream& inFile, const std::function<bool(const std::string&)>& keyFilter) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    // A replica's full resync replaces a possibly large keyspace
+    size_t keys = stringData_.size() + listData_.size() + hashData_.size() + zsetData_.size() + hllData_.size();
+    if (keys > LazyFree::instance().threshold())
+        clearAll(true);
+    else
+        clearAll();
+
+    if (inFile.peek() == kSnapshotMagic[0]) {
+        bool loaded = loadBinary(inFile, keyFilter);
+        rebuildSlotIndex();
+        return loaded;
+    }
 
     std::string line;
     while (std::getline(inFile, line)) {
         std::istringstream iss(line);
         char recordType;
-        iss >> recordType;
+        std::string key;
+        iss >> recordType >> key;
+        if (keyFilter && !keyFilter(key))
+            continue;
         if (recordType == 'S') {
-            std::string key, val;
-            iss >> key >> val;
+            std::string val;
+            iss >> val;
             stringData_[key] = val;
         } else if (recordType == 'L') {
-            std::string key;
-            iss >> key;
             std::string item;
             std::vector<std::string> items;
             while (iss >> item)
                 items.push_back(item);
             listData_[key] = items;
         } else if (recordType == 'H') {
-            std::string key;
-            iss >> key;
             std::unordered_map<std::string, std::string> fields;
             std::string pair;
             while (iss >> pair) {
@@ -412,5 +1159,312 @@ bool KVStore::loadFromDisk(const std::string& filepath) {
             hashData_[key] = fields;
         }
     }
+    rebuildSlotIndex();
+    return true;
+}
+
+bool KVStore::loadBinary(std::istream& inFile, const std::function<bool(const std::string&)>& keyFilter) {
+    auto currentTime = std::chrono::steady_clock::now();
+    // One section per shard that wrote the file
+    while (inFile.peek() != std::char_traits<char>::eof()) {
+        char magic[sizeof(kSnapshotMagic)];
+        if (!inFile.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), kSnapshotMagic))
+            return false;
+        int version = inFile.get();
+        if (version != 1 && version != kSnapshotVersion)
+            return false;
+        // A version 1 value that looks like a frame was a plain value
+        bool legacy = version == 1;
+
+        while (true) {
+            int recordType = inFile.get();
+            if (recordType == 'X' || recordType == std::char_traits<char>::eof())
+                break;
+            std::string key;
+            if (!readBlob(inFile, key)) return false;
+            bool keep = !keyFilter || keyFilter(key);
+
+            if (recordType == 'S') {
+                std::string val;
+                if (!readBlob(inFile, val)) return false;
+                if (legacy && isEncodedValue(val)) val = encodeValue(val, 0);
+                if (keep) {
+                    // Large values spill as they load, so a tiered store never holds them all
+                    untrackString(key);
+                    auto& stored = stringData_[key];
+                    stored = std::move(val);
+                    trackString(key, stored);
+                }
+            } else if (recordType == 'L') {
+                uint32_t count;
+                if (!readU32(inFile, count)) return false;
+                std::vector<std::string> items(count);
+                for (auto& item : items) {
+                    if (!readBlob(inFile, item)) return false;
+                    if (legacy && isEncodedValue(item)) item = encodeValue(item, 0);
+                }
+                if (keep) listData_[key] = std::move(items);
+            } else if (recordType == 'H') {
+                uint32_t count;
+                if (!readU32(inFile, count)) return false;
+                std::unordered_map<std::string, std::string> fields;
+                fields.reserve(count);
+                for (uint32_t i = 0; i < count; i++) {
+                    std::string field, val;
+                    if (!readBlob(inFile, field) || !readBlob(inFile, val)) return false;
+                    fields[std::move(field)] = std::move(val);
+                }
+                if (keep) hashData_[key] = std::move(fields);
+            } else if (recordType == 'Z') {
+                uint32_t count;
+                if (!readU32(inFile, count)) return false;
+                SortedSet zset;
+                for (uint32_t i = 0; i < count; i++) {
+                    std::string member;
+                    uint64_t bits;
+                    if (!readBlob(inFile, member) || !readU64(inFile, bits)) return false;
+                    double score;
+                    std::memcpy(&score, &bits, sizeof(score));
+                    zset.set(member, score);
+                }
+                if (keep && zset.size()) zsetData_[key] = std::move(zset);
+            } else if (recordType == 'P') {
+                std::string sketch;
+                HyperLogLog hll;
+                if (!readBlob(inFile, sketch) || !hll.deserialize(sketch)) return false;
+                if (keep) hllData_[key] = std::move(hll);
+            } else if (recordType == 'E') {
+                uint64_t ttlMs;
+                if (!readU64(inFile, ttlMs)) return false;
+                if (keep) setExpiryTime(key, currentTime + std::chrono::milliseconds(ttlMs));
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// DUMP payloads are a single-key snapshot section, so RESTORE reuses loadBinary
+// Compressed values in a payload must decode before it is accepted
+static bool frameValid(const std::string& stored) {
+    std::string raw;
+    return !isEncodedValue(stored) || decodeValue(stored, raw);
+}
+
+bool KVStore::dumpKey(const std::string& key, std::string& payload) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::ostringstream out;
+    out.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+    out.put(kSnapshotVersion);
+    std::string scratch;
+    if (auto it = stringData_.find(key); it != stringData_.end())
+        writeRecord(out, key, readString(key, it->second, scratch));
+    else if (auto it = listData_.find(key); it != listData_.end())
+        writeRecord(out, key, it->second);
+    else if (auto it = hashData_.find(key); it != hashData_.end())
+        writeRecord(out, key, it->second);
+    else if (auto it = zsetData_.find(key); it != zsetData_.end())
+        writeRecord(out, key, it->second);
+    else if (auto it = hllData_.find(key); it != hllData_.end())
+        writeRecord(out, key, it->second);
+    else
+        return false;
+    out.put('X');
+    payload = out.str();
+    return true;
+}
+
+bool KVStore::restoreKey(const std::string& key, const std::string& payload, int64_t ttlMs, bool replace,
+                         std::string& error) {
+    KVStore decoded;
+    bool valid = decoded.decodePayload(payload);
+    std::vector<std::string> keys;
+    if (valid) keys = decoded.getAllKeys();
+    if (keys.size() != 1) {
+        error = "ERR DUMP payload version or checksum are wrong";
+        return false;
+    }
+    // The payload's own key name and expiry are ignored
+    return adoptKey(decoded, keys[0], key, ttlMs, replace, error);
+}
+
+// BULKRESTORE payloads are several sections (or DUMP payloads) back to back
+bool KVStore::decodePayload(const std::string& payload) {
+    std::istringstream in(payload);
+    if (!loadBinary(in, nullptr)) return false;
+    for (const auto& entry : stringData_) {
+        if (!frameValid(entry.second)) return false;
+    }
+    for (const auto& entry : listData_) {
+        if (!std::all_of(entry.second.begin(), entry.second.end(), frameValid)) return false;
+    }
+    return true;
+}
+
+bool KVStore::adoptKey(KVStore& decoded, const std::string& sourceKey, const std::string& key, int64_t ttlMs,
+                       bool replace, std::string& error) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    if (keyExists(key)) {
+        if (!replace) {
+            error = "BUSYKEY Target key name already exists.";
+            return false;
+        }
+        unlinkKey(key);
+    }
+    if (auto it = decoded.stringData_.find(sourceKey); it != decoded.stringData_.end()) {
+        auto& stored = stringData_[key];
+        stored = std::move(it->second);
+        trackString(key, stored);
+    } else if (auto it = decoded.listData_.find(sourceKey); it != decoded.listData_.end()) {
+        listData_[key] = std::move(it->second);
+    } else if (auto it = decoded.hashData_.find(sourceKey); it != decoded.hashData_.end()) {
+        hashData_[key] = std::move(it->second);
+    } else if (auto it = decoded.zsetData_.find(sourceKey); it != decoded.zsetData_.end()) {
+        zsetData_[key] = std::move(it->second);
+    } else if (auto it = decoded.hllData_.find(sourceKey); it != decoded.hllData_.end()) {
+        hllData_[key] = std::move(it->second);
+    } else {
+        error = "ERR no such key";
+        return false;
+    }
+    if (ttlMs > 0)
+        setExpiryTime(key, std::chrono::steady_clock::now() + std::chrono::milliseconds(ttlMs));
+    indexKey(key);
     return true;
 }
+
+bool KVStore::reserveKeys(const std::string& type, size_t keys) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    if (type == "string")
+        stringData_.reserve(stringData_.size() + keys);
+    else if (type == "list")
+        listData_.reserve(listData_.size() + keys);
+    else if (type == "hash")
+        hashData_.reserve(hashData_.size() + keys);
+    else if (type == "zset")
+        zsetData_.reserve(zsetData_.size() + keys);
+    else if (type == "hyperloglog")
+        hllData_.reserve(hllData_.size() + keys);
+    else
+        return false;
+    return true;
+}
+
+// Cluster slot index
+void KVStore::enableSlotIndex() {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    slotKeys_.assign(Cluster::kSlots, {});
+    rebuildSlotIndex();
+}
+
+void KVStore::indexKey(const std::string& key) {
+    if (!slotKeys_.empty())
+        slotKeys_[keyHashSlot(key)].insert(key);
+}
+
+void KVStore::unindexKey(const std::string& key) {
+    if (!slotKeys_.empty())
+        slotKeys_[keyHashSlot(key)].erase(key);
+}
+
+void KVStore::rebuildSlotIndex() {
+    if (slotKeys_.empty()) return;
+    for (auto& keys : slotKeys_)
+        keys.clear();
+    for (const auto& entry : stringData_) indexKey(entry.first);
+    for (const auto& entry : listData_) indexKey(entry.first);
+    for (const auto& entry : hashData_) indexKey(entry.first);
+    for (const auto& entry : zsetData_) indexKey(entry.first);
+    for (const auto& entry : hllData_) indexKey(entry.first);
+}
+
+size_t KVStore::countKeysInSlot(int slot) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    return slotKeys_.empty() ? 0 : slotKeys_[slot].size();
+}
+
+std::vector<std::string> KVStore::getKeysInSlot(int slot, size_t count) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    cleanupExpired();
+    std::vector<std::string> keys;
+    if (slotKeys_.empty()) return keys;
+    for (const auto& key : slotKeys_[slot]) {
+        if (keys.size() >= count) break;
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+// Tiered storage
+void KVStore::enableTiering(const std::string& path, size_t minValue, size_t residentBytes, size_t cacheBytes) {
+    std::lock_guard<std::recursive_mutex> guard(storeMutex_);
+    std::unique_ptr<ValueLog> log(new ValueLog(path, cacheBytes));
+    if (!log->isOpen()) return;
+    valueLog_ = std::move(log);
+    tierMinValue_ = std::max<size_t>(1, minValue);
+    tierResidentLimit_ = residentBytes;
+    for (const auto& entry : stringData_)
+        trackString(entry.first, entry.second);
+}
+
+void KVStore::trackString(const std::string& key, const std::string& val) {
+    if (!valueLog_ || val.size() < tierMinValue_) return;
+    largeValues_[key] = largeOrder_.insert(largeOrder_.end(), key);
+    residentLarge_ += val.size();
+    if (residentLarge_ <= tierResidentLimit_)
+        spillAfter_ = 0;
+    else if (residentLarge_ >= spillAfter_)
+        spillColdValues();
+}
+
+// Called before key's string value is overwritten or removed
+void KVStore::untrackString(const std::string& key) {
+    if (!valueLog_) return;
+    auto spilled = spilled_.find(key);
+    if (spilled != spilled_.end()) {
+        valueLog_->release(spilled->second);
+        spilled_.erase(spilled);
+        return;
+    }
+    auto large = largeValues_.find(key);
+    if (large != largeValues_.end()) {
+        auto it = stringData_.find(key);
+        if (it != stringData_.end()) residentLarge_ -= it->second.size();
+        largeOrder_.erase(large->second);
+        largeValues_.erase(large);
+    }
+}
+
+// Move the least recently read large values to the log, down to 90% of the limit so spills come in batches
+void KVStore::spillColdValues() {
+    size_t target = tierResidentLimit_ / 10 * 9;
+    while (residentLarge_ > target && !largeOrder_.empty()) {
+        const std::string& key = largeOrder_.front();
+        auto it = stringData_.find(key);
+        uint64_t handle = valueLog_->append(it->second);
+        if (!handle) {
+            // The disk is full: keep values in memory and only try again once
+            // another tenth of the limit (at least one large value) came in
+            spillAfter_ = residentLarge_ + std::max(tierResidentLimit_ / 10, tierMinValue_);
+            return;
+        }
+        residentLarge_ -= it->second.size();
+        std::string().swap(it->second);
+        spilled_[key] = handle;
+        largeValues_.erase(key);
+        largeOrder_.pop_front();
+    }
+    spillAfter_ = 0;
+}
+
+// The value of a string entry, read back from the value log if it was spilled
+const std::string& KVStore::readString(const std::string& key, const std::string& stored, std::string& scratch) {
+    if (!stored.empty() || !valueLog_) return stored;
+    auto spilled = spilled_.find(key);
+    if (spilled == spilled_.end() || !valueLog_->read(spilled->second, scratch)) return stored;
+    return scratch;
+}
@@ -0,0 +1,46 @@
+#include "../include/LazyFree.h"
+
+// Same default as Redis: aggregates of up to 64 elements are freed inline
+static const size_t kDefaultThreshold = 64;
+
+LazyFree& LazyFree::instance() {
+    static LazyFree inst;
+    return inst;
+}
+
+LazyFree::LazyFree() : threshold_(kDefaultThreshold), pending_(0), stopping_(false) {}
+
+LazyFree::~LazyFree() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    if (worker_.joinable()) worker_.join();
+}
+
+void LazyFree::enqueue(std::unique_ptr<Garbage> garbage) {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        // The thread is started by the first large free
+        if (!worker_.joinable())
+            worker_ = std::thread([this]() { run(); });
+        queue_.push_back(std::move(garbage));
+        pending_++;
+    }
+    cv_.notify_one();
+}
+
+void LazyFree::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+        if (queue_.empty()) return;
+        std::unique_ptr<Garbage> garbage = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        garbage.reset();
+        pending_--;
+        lock.lock();
+    }
+}
@@ -0,0 +1,151 @@
+#include "../include/Replication.h"
+
+#include <algorithm>
+#include <random>
+
+ReplicationBacklog::ReplicationBacklog(size_t capacity) : buf_(capacity), end_(0), size_(0) {}
+
+void ReplicationBacklog::append(const std::string& data) {
+    size_t capacity = buf_.size();
+    const char* src = data.data();
+    size_t len = data.size();
+    // Only the newest capacity bytes can survive
+    if (len > capacity) {
+        src += len - capacity;
+        end_ += len - capacity;
+        len = capacity;
+    }
+    size_t writePos = end_ % capacity;
+    size_t firstPart = std::min(len, capacity - writePos);
+    std::copy(src, src + firstPart, buf_.begin() + writePos);
+    std::copy(src + firstPart, src + len, buf_.begin());
+    end_ += len;
+    size_ = std::min(capacity, size_ + data.size());
+}
+
+void ReplicationBacklog::reset(uint64_t offset) {
+    end_ = offset;
+    size_ = 0;
+}
+
+bool ReplicationBacklog::copyFrom(uint64_t offset, size_t maxLen, std::string& out) const {
+    if (offset < startOffset() || offset > end_) return false;
+    size_t capacity = buf_.size();
+    size_t len = std::min<uint64_t>(maxLen, end_ - offset);
+    size_t readPos = offset % capacity;
+    size_t firstPart = std::min(len, capacity - readPos);
+    out.append(buf_.data() + readPos, firstPart);
+    out.append(buf_.data(), len - firstPart);
+    return true;
+}
+
+static std::string randomReplId() {
+    static const char hexDigits[] = "0123456789abcdef";
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::string id(40, '0');
+    for (auto& c : id)
+        c = hexDigits[gen() % 16];
+    return id;
+}
+
+std::string encodeCommand(const std::vector<std::string>& args) {
+    std::string out = "*" + std::to_string(args.size()) + "\r\n";
+    for (const auto& arg : args) {
+        out += "$" + std::to_string(arg.size()) + "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+    return out;
+}
+
+Replication::Replication(size_t backlogSize)
+    : feedEnabled_(false), replId_(randomReplId()), backlog_(backlogSize), streamEpoch_(0),
+      primaryPort_(0), isReplica_(false), primaryGeneration_(0) {}
+
+void Replication::feed(const std::vector<std::string>& args) {
+    {
+        std::lock_guard<std::mutex> guard(backlogMutex_);
+        backlog_.append(encodeCommand(args));
+    }
+    if (wakeup_) wakeup_();
+}
+
+std::string Replication::replId() {
+    std::lock_guard<std::mutex> guard(backlogMutex_);
+    return replId_;
+}
+
+uint64_t Replication::offset() {
+    std::lock_guard<std::mutex> guard(backlogMutex_);
+    return backlog_.endOffset();
+}
+
+bool Replication::readBacklog(uint64_t offset, size_t maxLen, std::string& out) {
+    std::lock_guard<std::mutex> guard(backlogMutex_);
+    return backlog_.copyFrom(offset, maxLen, out);
+}
+
+bool Replication::canContinue(const std::string& replId, uint64_t offset) {
+    std::lock_guard<std::mutex> guard(backlogMutex_);
+    return replId == replId_ && offset >= backlog_.startOffset() && offset <= backlog_.endOffset();
+}
+
+void Replication::resetStream(const std::string& replId, uint64_t offset) {
+    std::lock_guard<std::mutex> guard(backlogMutex_);
+    replId_ = replId;
+    backlog_.reset(offset);
+    streamEpoch_++;
+}
+
+void Replication::setWakeup(std::function<void()> wakeup) {
+    wakeup_ = std::move(wakeup);
+}
+
+void Replication::setPrimary(const std::string& host, int port) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    primaryHost_ = host;
+    primaryPort_ = port;
+    isReplica_ = !host.empty();
+    primaryGeneration_++;
+}
+
+void Replication::primaryAddress(std::string& host, int& port) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    host = primaryHost_;
+    port = primaryPort_;
+}
+
+void Replication::setLinkState(const std::string& state) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    linkState_ = state;
+}
+
+std::string Replication::linkState() {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    return linkState_;
+}
+
+void Replication::addReplica(uint64_t clientId, const std::string& ip, int port) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    replicas_[clientId] = ReplicaInfo{ip, port, 0};
+}
+
+void Replication::ackReplica(uint64_t clientId, uint64_t offset) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    auto it = replicas_.find(clientId);
+    if (it != replicas_.end()) it->second.ackOffset = offset;
+}
+
+void Replication::removeReplica(uint64_t clientId) {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    replicas_.erase(clientId);
+}
+
+std::vector<Replication::ReplicaInfo> Replication::replicas() {
+    std::lock_guard<std::mutex> guard(configMutex_);
+    std::vector<ReplicaInfo> result;
+    for (const auto& entry : replicas_)
+        result.push_back(entry.second);
+    return result;
+}
@@ -0,0 +1,2355 @@
+#include "../include/Shard.h"
+#include "../include/KVServer.h"
+#include "../include/KVStore.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t kInboxCapacity = 4096;
+// Stream bytes handed to a replica per loop iteration, and the unsent output that pauses it
+static const size_t kReplicaChunk = 256 * 1024;
+static const auto kReconnectDelay = std::chrono::seconds(1);
+static const auto kConnectTimeout = std::chrono::seconds(5);
+static const auto kAckInterval = std::chrono::seconds(1);
+static const auto kCronInterval = std::chrono::seconds(1);
+static const char* const kClientClassNames[CLIENT_CLASS_COUNT] = {"normal", "pubsub", "replica"};
+// Commands a BULKLOAD client has applied per store lock at most
+static const size_t kBulkBatch = 4096;
+// Channel CLIENT TRACKING invalidations are published on to the REDIRECT connection
+static const char* const kInvalidateChannel = "__redis__:invalidate";
+
+static std::string bulkString(const std::string& value) {
+    return "$" + std::to_string(value.size()) + "\r\n" + value + "\r\n";
+}
+
+Shard::Shard(KVServer& server, int index, KVStore& store)
+    : server_(server), index_(index), store_(store), processor_(store),
+      listenSocket_(-1), wakeupFd_(-1), sleeping_(false), subscriberCount_(0),
+      feedReplication_(false), replicaCount_(0), replicasPending_(false),
+      linkState_(LinkState::None), linkFd_(-1), linkClientId_(0), linkGeneration_(0), linkOffset_(0),
+      replInMulti_(false) {}
+
+Shard::~Shard() {
+    if (backend_) {
+        for (auto& entry : clients_)
+            backend_->removeClient(*entry.second);
+    }
+    clients_.clear();
+    backend_.reset();
+    if (linkFd_ != -1) close(linkFd_);
+    if (listenSocket_ != -1) close(listenSocket_);
+    if (wakeupFd_ != -1) close(wakeupFd_);
+}
+
+void Shard::connectPeers(int shardCount) {
+    inbox_.clear();
+    for (int i = 0; i < shardCount; i++)
+        inbox_.emplace_back(new SpscQueue<ShardMessage>(kInboxCapacity));
+    overflow_.assign(shardCount, {});
+    notifyPeer_.assign(shardCount, false);
+}
+
+bool Shard::init(int port) {
+    listenSocket_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket_ < 0) {
+        std::cerr << "Error creating socket\n";
+        return false;
+    }
+
+    int optVal = 1;
+    setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &optVal, sizeof(optVal));
+    // Every shard binds its own listener; the kernel balances connections across them
+    setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEPORT, &optVal, sizeof(optVal));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listenSocket_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        std::cerr << "Error binding socket\n";
+        return false;
+    }
+    if (listen(listenSocket_, 511) < 0) {
+        std::cerr << "Error listening on socket\n";
+        return false;
+    }
+    int flags = fcntl(listenSocket_, F_GETFL, 0);
+    fcntl(listenSocket_, F_SETFL, flags | O_NONBLOCK);
+
+    wakeupFd_ = eventfd(0, EFD_NONBLOCK);
+    if (wakeupFd_ < 0) {
+        std::cerr << "Error creating event loop\n";
+        return false;
+    }
+    return true;
+}
+
+void Shard::run(const IoOptions& ioOptions) {
+    // Created on the loop's own thread: io_uring rings are single-issuer
+    backend_ = createIoBackend(ioOptions, *this, listenSocket_, wakeupFd_);
+    if (!backend_) {
+        std::cerr << "Error creating event loop\n";
+        return;
+    }
+    if (index_ == 0)
+        std::cout << "Using " << backend_->name() << " I/O backend\n";
+
+    while (server_.isRunning()) {
+        // Announce that we may block so peers know to signal the eventfd
+        sleeping_.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int timeoutMs = (inboxEmpty() && !hasOverflow() && !replicasPending_) ? 100 : 0;
+        // Wake up in time for the earliest blocking command timeout
+        if (!blockedDeadlines_.empty()) {
+            auto untilDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(
+                blockedDeadlines_.begin()->first - std::chrono::steady_clock::now()).count() + 1;
+            timeoutMs = std::min<long>(timeoutMs, std::max<long>(0, untilDeadline));
+        }
+        backend_->poll(timeoutMs);
+        sleeping_.store(false);
+
+        drainInbox();
+        expireBlocked();
+        serveBlocked();
+        if (index_ == 0)
+            maintainPrimaryLink();
+        serveReplicas();
+        clientsCron();
+        sendInvalidations();
+        flushPeers();
+        flushWrites();
+    }
+}
+
+void Shard::onAccept(int fd) {
+    int optVal = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(optVal));
+
+    std::unique_ptr<Client> client(new Client());
+    client->fd = fd;
+    client->id = server_.nextClientId();
+    client->createdAt = client->lastActive = std::chrono::steady_clock::now();
+    sockaddr_in peer{};
+    socklen_t peerLen = sizeof(peer);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&peer), &peerLen) == 0) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+        client->addr = std::string(ip) + ":" + std::to_string(ntohs(peer.sin_port));
+    }
+    backend_->addClient(*client);
+    server_.registerClient(client->id, index_);
+    clients_[client->id] = std::move(client);
+}
+
+void Shard::onData(uint64_t clientId, const char* data, size_t len) {
+    auto it = clients_.find(clientId);
+    if (it == clients_.end()) return;
+    Client& client = *it->second;
+    client.lastActive = std::chrono::steady_clock::now();
+    client.inBuf.append(data, len);
+    // The primary link carries the full resync snapshot, which may be larger
+    if (client.inBuf.size() > server_.config().maxQueryBuffer && !client.isPrimaryLink) {
+        std::cerr << "Client " << client.id << " exceeded the query buffer limit, disconnecting\n";
+        closeClient(clientId);
+        return;
+    }
+    processInput(client);
+}
+
+void Shard::onClosed(uint64_t clientId) {
+    closeClient(clientId);
+}
+
+void Shard::onWritable(uint64_t clientId) {
+    auto it = clients_.find(clientId);
+    if (it != clients_.end())
+        writeClient(*it->second);
+}
+
+void Shard::processInput(Client& client) {
+    if (client.isPrimaryLink) {
+        processPrimaryStream(client);
+        return;
+    }
+    size_t pos = 0;
+    std::vector<std::string> args;
+    std::vector<std::vector<std::string>> bulk;
+    while (!client.awaitingReply && !client.closeAfterWrite && !client.closeNow && pos < client.inBuf.size()) {
+        long consumed = parseCommand(client.inBuf, pos, args);
+        if (consumed == 0) break;
+        if (consumed < 0) {
+            reply(client, "-ERR Protocol error\r\n");
+            client.closeAfterWrite = true;
+            pos = client.inBuf.size();
+            break;
+        }
+        pos += consumed;
+        if (args.empty()) continue;
+        TrafficCapture& capture = server_.capture();
+        if (capture.active())
+            capture.record(index_, client.id, args);
+        // A bulk load applies everything up to BULKLOAD END in batches
+        if (client.bulkLoading && strcasecmp(args[0].c_str(), "BULKLOAD") != 0) {
+            bulk.push_back(std::move(args));
+            if (bulk.size() >= kBulkBatch) {
+                applyBulk(client, bulk);
+                bulk.clear();
+            }
+            continue;
+        }
+        if (!bulk.empty()) {
+            applyBulk(client, bulk);
+            bulk.clear();
+        }
+        dispatch(client, args);
+    }
+    if (!bulk.empty())
+        applyBulk(client, bulk);
+    client.inBuf.erase(0, pos);
+}
+
+/*
+ * Route a command to the shard owning its keys.
+ * Keyless commands run locally, ALL_SHARDS commands are scattered to every
+ * shard and their replies merged, multi-key commands must stay within one shard.
+ */
+void Shard::dispatch(Client& client, std::vector<std::string>& args) {
+    std::string cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    client.lastCommand = cmd;
+    // ASKING only applies to the command that follows it
+    bool asking = client.asking;
+    client.asking = false;
+    if (transactionCommand(client, cmd, args)) return;
+    if (pubsubCommand(client, cmd, args)) return;
+    if (replicationCommand(client, cmd, args)) return;
+    if (clientCommand(client, cmd, args)) return;
+    if (captureCommand(client, cmd, args)) return;
+    if (bulkCommand(client, cmd, args)) return;
+    if (clusterCommand(client, cmd, args)) return;
+
+    const CommandInfo* info = lookupCommand(cmd);
+    if (info && (info->flags & CMD_WRITE) && server_.replication().isReplica()) {
+        reply(client, "-READONLY You can't write against a read only replica.\r\n");
+        return;
+    }
+    if (info && server_.cluster().enabled()) {
+        std::string redirect = clusterRedirect(commandKeys(*info, args), asking);
+        if (!redirect.empty()) {
+            reply(client, redirect);
+            return;
+        }
+    }
+
+    if (!info) {
+        reply(client, execute(args, true));
+        return;
+    }
+    int shardCount = server_.shardCount();
+    if (shardCount == 1) {
+        runLocal(client, args, *info);
+        return;
+    }
+
+    if (info->flags & CMD_ALL_SHARDS) {
+        client.fanoutReplies.clear();
+        client.fanoutReplies.push_back(execute(args, true));
+        client.fanoutPending = shardCount - 1;
+        client.awaitingReply = true;
+        for (int target = 0; target < shardCount; target++) {
+            if (target == index_) continue;
+            ShardMessage msg;
+            msg.kind = ShardMessage::Kind::Request;
+            msg.fromShard = index_;
+            msg.clientId = client.id;
+            msg.args = args;
+            sendToShard(target, std::move(msg));
+        }
+        return;
+    }
+
+    int owner = index_;
+    auto keys = commandKeys(*info, args);
+    for (size_t i = 0; i < keys.size(); i++) {
+        int keyOwner = server_.shardForKey(keys[i]);
+        if (i == 0) {
+            owner = keyOwner;
+        } else if (keyOwner != owner) {
+            reply(client, "-CROSSSLOT Keys in request don't hash to the same shard\r\n");
+            return;
+        }
+    }
+
+    if (owner == index_) {
+        runLocal(client, args, *info);
+        return;
+    }
+
+    ShardMessage msg;
+    msg.kind = ShardMessage::Kind::Request;
+    msg.fromShard = index_;
+    msg.clientId = client.id;
+    msg.blocking = (info->flags & CMD_BLOCKING) != 0;
+    if (client.tracking && !client.trackingBcast) msg.tracker = client.trackingTarget;
+    msg.args = std::move(args);
+    client.awaitingReply = true;
+    if (msg.blocking) client.blockedShard = owner;
+    sendToShard(owner, std::move(msg));
+}
+
+void Shard::runLocal(Client& client, std::vector<std::string>& args, const CommandInfo& info) {
+    bool track = client.tracking && !client.trackingBcast;
+    std::string response = execute(args, true, track ? &client.trackingTarget : nullptr);
+    if ((info.flags & CMD_BLOCKING) && blockIfEmpty(args, index_, client.id, response)) {
+        client.awaitingReply = true;
+        return;
+    }
+    reply(client, response);
+}
+
+void Shard::reply(Client& client, const std::string& response) {
+    // The primary does not expect replies to the commands it streams
+    if (client.isPrimaryLink) return;
+    queueOutput(client, response);
+}
+
+void Shard::queueOutput(Client& client, const std::string& data) {
+    if (client.pendingOutput() == 0)
+        pendingWrites_.push_back(client.id);
+    client.outBuf += data;
+    checkOutputLimit(client);
+}
+
+// Run a command on this shard's store, feeding writes to the backlog while replicas may be attached.
+// The keys a read of a tracking connection returns are remembered for tracker
+std::string Shard::execute(const std::vector<std::string>& args, bool origin, const Tracker* tracker) {
+    if (!feedReplication_ && blockedKeys_.empty() && !tracker) return processor_.execute(args);
+
+    std::string cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    const CommandInfo* info = lookupCommand(cmd);
+    if (info && tracker && !(info->flags & CMD_WRITE)) {
+        // Tracked under the lock of the read so that no write comes in between
+        auto lock = store_.acquireLock();
+        std::string response = processor_.execute(args);
+        if (!response.empty() && response[0] != '-')
+            store_.trackKeys(commandKeys(*info, args), *tracker);
+        return response;
+    }
+    if (!info || !(info->flags & CMD_WRITE))
+        return processor_.execute(args);
+
+    // Clients blocked on a written key are served once the current command is done
+    if (!blockedKeys_.empty()) {
+        for (const auto& key : commandKeys(*info, args)) {
+            if (blockedKeys_.count(key)) readyKeys_.push_back(key);
+        }
+    }
+    // A scattered command is fed once, by the shard that received it
+    if (!feedReplication_ || (!origin && (info->flags & CMD_ALL_SHARDS)))
+        return processor_.execute(args);
+
+    Replication& repl = server_.replication();
+    std::lock_guard<std::mutex> guard(repl.writeMutex());
+    std::string response = processor_.execute(args);
+    bool parked = (info->flags & CMD_BLOCKING) && (response == "*-1\r\n" || response == "$-1\r\n");
+    if (!response.empty() && response[0] != '-' && !parked)
+        repl.feed(args);
+    return response;
+}
+
+// Merge scattered replies: arrays and bulk strings are concatenated, integers summed, errors win
+static std::string mergeReplies(const std::vector<std::string>& replies) {
+    std::string merged;
+    long total = 0;
+    std::string body;
+    for (const auto& part : replies) {
+        if (part.empty()) continue;
+        if (part[0] == '-') {
+            merged = part;
+            break;
+        }
+        if (part[0] == '*' || part[0] == ':') {
+            size_t crlfPos = part.find("\r\n");
+            total += std::atol(part.c_str() + 1);
+            if (part[0] == '*')
+                body.append(part, crlfPos + 2, std::string::npos);
+        } else if (part[0] == '$') {
+            size_t crlfPos = part.find("\r\n");
+            if (part.size() >= crlfPos + 4)
+                body.append(part, crlfPos + 2, part.size() - crlfPos - 4);
+        } else if (merged.empty()) {
+            merged = part;
+        }
+    }
+    if (merged.empty() || merged[0] != '-') {
+        const std::string& first = replies.front();
+        if (!first.empty() && first[0] == '*')
+            merged = "*" + std::to_string(total) + "\r\n" + body;
+        else if (!first.empty() && first[0] == ':')
+            merged = ":" + std::to_string(total) + "\r\n";
+        else if (!first.empty() && first[0] == '$')
+            merged = bulkString(body);
+    }
+    return merged;
+}
+
+void Shard::completeFanout(Client& client) {
+    std::string merged = mergeReplies(client.fanoutReplies);
+    client.fanoutReplies.clear();
+    reply(client, merged);
+}
+
+void Shard::sendToShard(int target, ShardMessage&& msg) {
+    auto& pending = overflow_[target];
+    if (!pending.empty() || !server_.shard(target).inbox_[index_]->push(std::move(msg)))
+        pending.push_back(std::move(msg));
+    notifyPeer_[target] = true;
+}
+
+bool Shard::inboxEmpty() const {
+    for (const auto& queue : inbox_) {
+        if (!queue->empty()) return false;
+    }
+    return true;
+}
+
+bool Shard::hasOverflow() const {
+    for (const auto& pending : overflow_) {
+        if (!pending.empty()) return true;
+    }
+    return false;
+}
+
+bool Shard::drainInbox() {
+    bool drained = false;
+    ShardMessage msg;
+    for (size_t src = 0; src < inbox_.size(); src++) {
+        while (inbox_[src]->pop(msg)) {
+            drained = true;
+            if (msg.kind == ShardMessage::Kind::Request || msg.kind == ShardMessage::Kind::EnableFeed) {
+                ShardMessage response;
+                response.kind = ShardMessage::Kind::Reply;
+                response.fromShard = index_;
+                response.clientId = msg.clientId;
+                if (msg.kind == ShardMessage::Kind::Request) {
+                    response.reply = execute(msg.args, false, msg.tracker.clientId ? &msg.tracker : nullptr);
+                    if (msg.blocking && blockIfEmpty(msg.args, msg.fromShard, msg.clientId, response.reply))
+                        continue;
+                } else {
+                    feedReplication_ = true;
+                }
+                sendToShard(msg.fromShard, std::move(response));
+                continue;
+            }
+            if (msg.kind == ShardMessage::Kind::Publish) {
+                ShardMessage response;
+                response.kind = ShardMessage::Kind::Reply;
+                response.fromShard = index_;
+                response.clientId = msg.clientId;
+                response.reply = ":" + std::to_string(deliverMessage(msg.args[0], msg.payload)) + "\r\n";
+                sendToShard(msg.fromShard, std::move(response));
+                continue;
+            }
+            if (msg.kind == ShardMessage::Kind::ClientList) {
+                ShardMessage response;
+                response.kind = ShardMessage::Kind::Reply;
+                response.fromShard = index_;
+                response.clientId = msg.clientId;
+                response.reply = bulkString(listClients());
+                sendToShard(msg.fromShard, std::move(response));
+                continue;
+            }
+            if (msg.kind == ShardMessage::Kind::Invalidate) {
+                deliverInvalidation(msg.clientId, msg.args);
+                continue;
+            }
+            if (msg.kind == ShardMessage::Kind::KeysTouched) {
+                markReady(index_, std::move(msg.args));
+                continue;
+            }
+            if (msg.kind == ShardMessage::Kind::Unblock) {
+                BlockedRequest dropped;
+                unblock(msg.clientId, dropped);
+                continue;
+            }
+
+            // Reply for one of our clients; it may have disconnected meanwhile
+            auto it = clients_.find(msg.clientId);
+            if (it == clients_.end()) continue;
+            Client& client = *it->second;
+            if (client.fanoutPending > 0) {
+                client.fanoutReplies.push_back(std::move(msg.reply));
+                if (--client.fanoutPending > 0) continue;
+                if (!client.psyncArgs.empty()) {
+                    server_.replication().enableFeed();
+                    finishPsync(client);
+                } else {
+                    completeFanout(client);
+                }
+            } else {
+                reply(client, msg.reply);
+            }
+            client.awaitingReply = false;
+            client.blockedShard = -1;
+            processInput(client);
+        }
+    }
+    return drained;
+}
+
+// Retry overflowed messages and signal peers that have new work
+void Shard::flushPeers() {
+    for (size_t target = 0; target < overflow_.size(); target++) {
+        auto& pending = overflow_[target];
+        auto& queue = *server_.shard(target).inbox_[index_];
+        while (!pending.empty() && queue.push(std::move(pending.front())))
+            pending.pop_front();
+        if (notifyPeer_[target]) {
+            notifyPeer_[target] = false;
+            server_.shard(target).wakeup();
+        }
+    }
+}
+
+void Shard::wakeup() {
+    // Only pay for the syscall when the shard may be blocked waiting for events
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load()) {
+        uint64_t one = 1;
+        ssize_t written = write(wakeupFd_, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+void Shard::flushWrites() {
+    std::vector<uint64_t> ids;
+    ids.swap(pendingWrites_);
+    for (uint64_t id : ids) {
+        auto it = clients_.find(id);
+        if (it != clients_.end())
+            writeClient(*it->second);
+    }
+}
+
+void Shard::writeClient(Client& client) {
+    if (client.closeNow) {
+        closeClient(client.id);
+        return;
+    }
+    FlushResult result = backend_->flush(client);
+    if (result == FlushResult::Failed || (result == FlushResult::Drained && client.closeAfterWrite))
+        closeClient(client.id);
+}
+
+void Shard::closeClient(uint64_t id) {
+    auto it = clients_.find(id);
+    if (it == clients_.end()) return;
+    Client& client = *it->second;
+    unwatchAll(client);
+    stopTracking(client);
+    std::vector<std::string> channels(client.channels.begin(), client.channels.end());
+    for (const auto& channel : channels)
+        unsubscribe(client, channel, false, false);
+    std::vector<std::string> patterns(client.patterns.begin(), client.patterns.end());
+    for (const auto& pattern : patterns)
+        unsubscribe(client, pattern, true, false);
+    BlockedRequest dropped;
+    unblock(id, dropped);
+    // A pop already served but not yet delivered is lost with the connection
+    if (client.blockedShard >= 0) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Unblock;
+        msg.fromShard = index_;
+        msg.clientId = id;
+        sendToShard(client.blockedShard, std::move(msg));
+    }
+    if (client.isReplica) {
+        server_.replication().removeReplica(id);
+        replicaIds_.erase(std::remove(replicaIds_.begin(), replicaIds_.end(), id), replicaIds_.end());
+        replicaCount_--;
+    }
+    if (client.isPrimaryLink) {
+        std::cout << "Lost connection to primary\n";
+        linkState_ = LinkState::None;
+        linkClientId_ = 0;
+        nextConnect_ = std::chrono::steady_clock::now() + kReconnectDelay;
+        server_.replication().setLinkState("connect");
+    }
+    backend_->removeClient(client);
+    server_.unregisterClient(id);
+    clients_.erase(it);
+}
+
+//----------------------
+// Transactions
+//----------------------
+bool Shard::transactionCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    // Subscribers are limited to subscription commands, see pubsubCommand
+    if (!client.channels.empty() || !client.patterns.empty()) return false;
+
+    if (cmd == "MULTI") {
+        if (client.inMulti) {
+            reply(client, "-ERR MULTI calls can not be nested\r\n");
+            return true;
+        }
+        client.inMulti = true;
+        reply(client, "+OK\r\n");
+    } else if (cmd == "EXEC") {
+        if (!client.inMulti) {
+            reply(client, "-ERR EXEC without MULTI\r\n");
+            return true;
+        }
+        std::vector<std::vector<std::string>> commands;
+        commands.swap(client.multiQueue);
+        bool aborted = client.multiError;
+        client.inMulti = false;
+        client.multiError = false;
+        if (aborted)
+            reply(client, "-EXECABORT Transaction discarded because of previous errors.\r\n");
+        else
+            reply(client, execBatch(commands, &client.watchedKeys, true,
+                                    client.tracking && !client.trackingBcast ? &client.trackingTarget : nullptr));
+        unwatchAll(client);
+    } else if (cmd == "DISCARD") {
+        if (!client.inMulti) {
+            reply(client, "-ERR DISCARD without MULTI\r\n");
+            return true;
+        }
+        client.multiQueue.clear();
+        client.inMulti = false;
+        client.multiError = false;
+        unwatchAll(client);
+        reply(client, "+OK\r\n");
+    } else if (cmd == "WATCH") {
+        if (client.inMulti) {
+            reply(client, "-ERR WATCH inside MULTI is not allowed\r\n");
+            return true;
+        }
+        if (args.size() < 2) {
+            reply(client, "-ERR WATCH requires at least one key\r\n");
+            return true;
+        }
+        // Remember each key's version in the store that owns it; EXEC compares
+        for (size_t i = 1; i < args.size(); i++) {
+            KVStore& owner = server_.shard(server_.shardForKey(args[i])).store();
+            client.watchedKeys.emplace_back(args[i], owner.watchKey(args[i]));
+        }
+        reply(client, "+OK\r\n");
+    } else if (cmd == "UNWATCH") {
+        unwatchAll(client);
+        reply(client, "+OK\r\n");
+    } else if (client.inMulti) {
+        queueTransaction(client, cmd, args);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Validate a command on enqueue; any rejection makes the whole EXEC fail
+void Shard::queueTransaction(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    const CommandInfo* info = lookupCommand(cmd);
+    std::string error;
+    if (!info) {
+        error = "-ERR unknown command or not allowed in MULTI '" + args[0] + "'\r\n";
+    } else if (!checkArity(*info, args.size())) {
+        std::string name = args[0];
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        error = "-ERR wrong number of arguments for '" + name + "' command\r\n";
+    } else if ((info->flags & CMD_WRITE) && server_.replication().isReplica()) {
+        error = "-READONLY You can't write against a read only replica.\r\n";
+    } else if (server_.cluster().enabled()) {
+        error = clusterRedirect(commandKeys(*info, args), false);
+    }
+    if (error.empty()) {
+        auto keys = commandKeys(*info, args);
+        for (size_t i = 1; i < keys.size(); i++) {
+            if (server_.shardForKey(keys[i]) != server_.shardForKey(keys[0])) {
+                error = "-CROSSSLOT Keys in request don't hash to the same shard\r\n";
+                break;
+            }
+        }
+    }
+    if (!error.empty()) {
+        client.multiError = true;
+        reply(client, error);
+        return;
+    }
+    client.multiQueue.push_back(std::move(args));
+    reply(client, "+QUEUED\r\n");
+}
+
+void Shard::unwatchAll(Client& client) {
+    for (const auto& watched : client.watchedKeys)
+        server_.shard(server_.shardForKey(watched.first)).store().unwatchKey(watched.first);
+    client.watchedKeys.clear();
+}
+
+/*
+ * Run commands back-to-back while holding the lock of every store they touch,
+ * taken once each and in shard order so concurrent transactions cannot deadlock.
+ * Returns the EXEC reply, or a null array if a watched key changed.
+ */
+std::string Shard::execBatch(const std::vector<std::vector<std::string>>& commands,
+                             const std::vector<std::pair<std::string, uint64_t>>* watched, bool feed,
+                             const Tracker* tracker) {
+    int shardCount = server_.shardCount();
+    std::vector<const CommandInfo*> infos;
+    std::vector<int> owners;    // -1: runs on every shard
+    std::vector<bool> involved(shardCount, false);
+    bool writes = false;
+    for (const auto& args : commands) {
+        std::string cmd = args[0];
+        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+        const CommandInfo* info = lookupCommand(cmd);
+        int owner = index_;
+        if (info && (info->flags & CMD_ALL_SHARDS)) {
+            owner = -1;
+            involved.assign(shardCount, true);
+        } else if (info) {
+            auto keys = commandKeys(*info, args);
+            if (!keys.empty()) owner = server_.shardForKey(keys[0]);
+        }
+        if (owner >= 0) involved[owner] = true;
+        if (info && (info->flags & CMD_WRITE)) writes = true;
+        infos.push_back(info);
+        owners.push_back(owner);
+    }
+    if (watched) {
+        for (const auto& entry : *watched)
+            involved[server_.shardForKey(entry.first)] = true;
+    }
+
+    Replication& repl = server_.replication();
+    std::unique_lock<std::mutex> feedLock;
+    if (feed && writes && feedReplication_)
+        feedLock = std::unique_lock<std::mutex>(repl.writeMutex());
+    std::vector<std::unique_lock<std::recursive_mutex>> storeLocks;
+    for (int i = 0; i < shardCount; i++) {
+        if (involved[i]) storeLocks.push_back(server_.shard(i).store().acquireLock());
+    }
+
+    if (watched) {
+        for (const auto& entry : *watched) {
+            if (server_.shard(server_.shardForKey(entry.first)).store().keyVersion(entry.first) != entry.second)
+                return "*-1\r\n";
+        }
+    }
+
+    std::string response = "*" + std::to_string(commands.size()) + "\r\n";
+    std::vector<std::vector<std::string>> touched(shardCount);
+    bool fedMulti = false;
+    for (size_t i = 0; i < commands.size(); i++) {
+        std::string result;
+        if (owners[i] < 0) {
+            std::vector<std::string> parts;
+            for (int s = 0; s < shardCount; s++)
+                parts.push_back(CommandProcessor(server_.shard(s).store()).execute(commands[i]));
+            result = mergeReplies(parts);
+        } else {
+            result = CommandProcessor(server_.shard(owners[i]).store()).execute(commands[i]);
+        }
+        response += result;
+
+        if (!infos[i] || (!result.empty() && result[0] == '-'))
+            continue;
+        if (!(infos[i]->flags & CMD_WRITE)) {
+            if (tracker && owners[i] >= 0)
+                server_.shard(owners[i]).store().trackKeys(commandKeys(*infos[i], commands[i]), *tracker);
+            continue;
+        }
+        // Blocking commands never wait inside a transaction; an empty pop wrote nothing
+        if ((infos[i]->flags & CMD_BLOCKING) && (result == "*-1\r\n" || result == "$-1\r\n"))
+            continue;
+        // Replicas receive the writes wrapped in MULTI/EXEC
+        if (feedLock.owns_lock()) {
+            if (!fedMulti) repl.feed({"MULTI"});
+            fedMulti = true;
+            repl.feed(commands[i]);
+        }
+        if (owners[i] >= 0) {
+            for (auto& key : commandKeys(*infos[i], commands[i]))
+                touched[owners[i]].push_back(std::move(key));
+        }
+    }
+    if (fedMulti) repl.feed({"EXEC"});
+    storeLocks.clear();
+    if (feedLock.owns_lock()) feedLock.unlock();
+
+    for (int s = 0; s < shardCount; s++) {
+        if (!touched[s].empty()) markReady(s, std::move(touched[s]));
+    }
+    return response;
+}
+
+// Serve clients blocked on keys a transaction wrote to, on the shard owning them
+void Shard::markReady(int shard, std::vector<std::string>&& keys) {
+    if (shard != index_) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::KeysTouched;
+        msg.fromShard = index_;
+        msg.args = std::move(keys);
+        sendToShard(shard, std::move(msg));
+        return;
+    }
+    for (auto& key : keys) {
+        if (blockedKeys_.count(key)) readyKeys_.push_back(std::move(key));
+    }
+}
+
+//----------------------
+// Pub/Sub
+//----------------------
+bool Shard::pubsubCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    if (cmd == "SUBSCRIBE" || cmd == "PSUBSCRIBE") {
+        if (args.size() < 2) {
+            reply(client, "-ERR " + cmd + " requires at least one channel\r\n");
+            return true;
+        }
+        for (size_t i = 1; i < args.size(); i++)
+            subscribe(client, args[i], cmd == "PSUBSCRIBE");
+    } else if (cmd == "UNSUBSCRIBE" || cmd == "PUNSUBSCRIBE") {
+        bool pattern = cmd == "PUNSUBSCRIBE";
+        const auto& current = pattern ? client.patterns : client.channels;
+        // Without arguments every subscription of that kind is dropped
+        std::vector<std::string> names(args.begin() + 1, args.end());
+        if (names.empty())
+            names.assign(current.begin(), current.end());
+        if (names.empty()) {
+            size_t count = client.channels.size() + client.patterns.size();
+            reply(client, "*3\r\n" + bulkString(pattern ? "punsubscribe" : "unsubscribe") + "$-1\r\n:" +
+                          std::to_string(count) + "\r\n");
+        }
+        for (const auto& name : names)
+            unsubscribe(client, name, pattern, true);
+    } else if (cmd == "PUBLISH") {
+        if (args.size() != 3) {
+            reply(client, "-ERR PUBLISH requires channel and message\r\n");
+            return true;
+        }
+        // Encoded once: every subscriber on every shard queues this same buffer
+        auto body = std::make_shared<const std::string>(bulkString(args[1]) + bulkString(args[2]));
+        int receivers = deliverMessage(args[1], body);
+
+        std::vector<int> targets;
+        for (int target = 0; target < server_.shardCount(); target++) {
+            if (target != index_ && server_.shard(target).hasSubscribers())
+                targets.push_back(target);
+        }
+        if (targets.empty()) {
+            reply(client, ":" + std::to_string(receivers) + "\r\n");
+            return true;
+        }
+        // Other shards deliver to their own subscribers; the receiver counts are summed
+        client.fanoutReplies.clear();
+        client.fanoutReplies.push_back(":" + std::to_string(receivers) + "\r\n");
+        client.fanoutPending = static_cast<int>(targets.size());
+        client.awaitingReply = true;
+        for (int target : targets) {
+            ShardMessage msg;
+            msg.kind = ShardMessage::Kind::Publish;
+            msg.fromShard = index_;
+            msg.clientId = client.id;
+            msg.args.push_back(args[1]);
+            msg.payload = body;
+            sendToShard(target, std::move(msg));
+        }
+    } else if (!client.channels.empty() || !client.patterns.empty()) {
+        // RESP2 subscribers may only manage subscriptions
+        if (cmd == "PING") {
+            reply(client, "*2\r\n" + bulkString("pong") + bulkString(args.size() > 1 ? args[1] : ""));
+        } else {
+            std::string name = args[0];
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            reply(client, "-ERR Can't execute '" + name +
+                          "': only (P)SUBSCRIBE / (P)UNSUBSCRIBE / PING are allowed in this context\r\n");
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void Shard::subscribe(Client& client, const std::string& name, bool pattern) {
+    auto& current = pattern ? client.patterns : client.channels;
+    if (current.insert(name).second) {
+        if (client.channels.size() + client.patterns.size() == 1)
+            subscriberCount_++;
+        if (pattern) {
+            auto& subscription = patternSubs_[name];
+            if (!subscription.header)
+                subscription.header = std::make_shared<const std::string>("*4\r\n$8\r\npmessage\r\n" + bulkString(name));
+            subscription.clients.push_back(&client);
+        } else {
+            channelSubs_[name].push_back(&client);
+        }
+    }
+    size_t count = client.channels.size() + client.patterns.size();
+    reply(client, "*3\r\n" + bulkString(pattern ? "psubscribe" : "subscribe") + bulkString(name) + ":" +
+                  std::to_string(count) + "\r\n");
+}
+
+void Shard::unsubscribe(Client& client, const std::string& name, bool pattern, bool notify) {
+    auto& current = pattern ? client.patterns : client.channels;
+    if (current.erase(name)) {
+        auto removeFrom = [&client](std::vector<Client*>& clients) {
+            clients.erase(std::remove(clients.begin(), clients.end(), &client), clients.end());
+            return clients.empty();
+        };
+        if (pattern) {
+            auto it = patternSubs_.find(name);
+            if (it != patternSubs_.end() && removeFrom(it->second.clients))
+                patternSubs_.erase(it);
+        } else {
+            auto it = channelSubs_.find(name);
+            if (it != channelSubs_.end() && removeFrom(it->second))
+                channelSubs_.erase(it);
+        }
+        if (client.channels.empty() && client.patterns.empty())
+            subscriberCount_--;
+    }
+    if (notify) {
+        size_t count = client.channels.size() + client.patterns.size();
+        reply(client, "*3\r\n" + bulkString(pattern ? "punsubscribe" : "unsubscribe") + bulkString(name) + ":" +
+                      std::to_string(count) + "\r\n");
+    }
+}
+
+// Queue a published message for this shard's subscribers; returns how many received it
+int Shard::deliverMessage(const std::string& channel, const std::shared_ptr<const std::string>& body) {
+    static const auto messageHeader = std::make_shared<const std::string>("*3\r\n$7\r\nmessage\r\n");
+    int receivers = 0;
+    auto it = channelSubs_.find(channel);
+    if (it != channelSubs_.end()) {
+        for (Client* subscriber : it->second)
+            queueMessage(*subscriber, messageHeader, body);
+        receivers += static_cast<int>(it->second.size());
+    }
+    for (auto& entry : patternSubs_) {
+        if (!globMatch(entry.first, channel)) continue;
+        for (Client* subscriber : entry.second.clients)
+            queueMessage(*subscriber, entry.second.header, body);
+        receivers += static_cast<int>(entry.second.clients.size());
+    }
+    return receivers;
+}
+
+void Shard::queueMessage(Client& client, const std::shared_ptr<const std::string>& header,
+                         const std::shared_ptr<const std::string>& body) {
+    if (client.closeNow) return;
+    if (client.pendingOutput() == 0)
+        pendingWrites_.push_back(client.id);
+    // Replies queued so far must go out before the message
+    if (client.outPos < client.outBuf.size()) {
+        std::shared_ptr<const std::string> replies;
+        if (client.outPos == 0)
+            replies = std::make_shared<const std::string>(std::move(client.outBuf));
+        else
+            replies = std::make_shared<const std::string>(client.outBuf, client.outPos);
+        client.outQueueBytes += replies->size();
+        client.outQueue.push_back(std::move(replies));
+    }
+    client.outBuf.clear();
+    client.outPos = 0;
+    client.outQueue.push_back(header);
+    client.outQueue.push_back(body);
+    client.outQueueBytes += header->size() + body->size();
+
+    // A subscriber that cannot keep up is dropped instead of buffering without bound
+    checkOutputLimit(client);
+}
+
+//----------------------
+// Blocking Commands
+//----------------------
+// Park a blocking command that found no data; false if it already has its reply
+bool Shard::blockIfEmpty(const std::vector<std::string>& args, int fromShard, uint64_t clientId,
+                         const std::string& response) {
+    if (response != "*-1\r\n" && response != "$-1\r\n") return false;
+
+    std::string cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    BlockedRequest request;
+    request.fromShard = fromShard;
+    request.args = args;
+    request.timeoutReply = response;
+    // BLMOVE waits on its source only, BLPOP/BRPOP on every key before the timeout
+    if (cmd == "BLMOVE")
+        request.keys.push_back(args[1]);
+    else
+        request.keys.assign(args.begin() + 1, args.end() - 1);
+
+    double timeout = std::strtod(args.back().c_str(), nullptr);
+    if (timeout > 0) {
+        request.hasDeadline = true;
+        request.deadline = std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(timeout));
+        blockedDeadlines_.insert({request.deadline, clientId});
+    }
+    for (const auto& key : request.keys) {
+        auto& waiters = blockedKeys_[key];
+        if (std::find(waiters.begin(), waiters.end(), clientId) == waiters.end())
+            waiters.push_back(clientId);
+    }
+    blocked_[clientId] = std::move(request);
+    return true;
+}
+
+bool Shard::unblock(uint64_t clientId, BlockedRequest& request) {
+    auto it = blocked_.find(clientId);
+    if (it == blocked_.end()) return false;
+    request = std::move(it->second);
+    blocked_.erase(it);
+
+    for (const auto& key : request.keys) {
+        auto keyIt = blockedKeys_.find(key);
+        if (keyIt == blockedKeys_.end()) continue;
+        auto& waiters = keyIt->second;
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), clientId), waiters.end());
+        if (waiters.empty()) blockedKeys_.erase(keyIt);
+    }
+    if (request.hasDeadline)
+        blockedDeadlines_.erase({request.deadline, clientId});
+    return true;
+}
+
+// Hand each element pushed to a waited-on key to exactly one waiter, oldest first
+void Shard::serveBlocked() {
+    while (!readyKeys_.empty()) {
+        std::vector<std::string> keys;
+        keys.swap(readyKeys_);
+        for (const auto& key : keys) {
+            while (store_.listSize(key) > 0) {
+                auto it = blockedKeys_.find(key);
+                if (it == blockedKeys_.end()) break;
+                uint64_t clientId = it->second.front();
+                BlockedRequest request;
+                unblock(clientId, request);
+                deliverBlocked(request.fromShard, clientId, execute(request.args, true));
+            }
+        }
+    }
+}
+
+void Shard::expireBlocked() {
+    auto now = std::chrono::steady_clock::now();
+    while (!blockedDeadlines_.empty() && blockedDeadlines_.begin()->first <= now) {
+        uint64_t clientId = blockedDeadlines_.begin()->second;
+        BlockedRequest request;
+        unblock(clientId, request);
+        deliverBlocked(request.fromShard, clientId, request.timeoutReply);
+    }
+}
+
+void Shard::deliverBlocked(int fromShard, uint64_t clientId, const std::string& response) {
+    if (fromShard != index_) {
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Reply;
+        msg.fromShard = index_;
+        msg.clientId = clientId;
+        msg.reply = response;
+        sendToShard(fromShard, std::move(msg));
+        return;
+    }
+    auto it = clients_.find(clientId);
+    if (it == clients_.end()) return;
+    Client& client = *it->second;
+    client.awaitingReply = false;
+    reply(client, response);
+    processInput(client);
+}
+
+//----------------------
+// Replication
+//----------------------
+// Server-level replication commands; false if cmd is an ordinary data command
+bool Shard::replicationCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    Replication& repl = server_.replication();
+    if (cmd == "PSYNC") {
+        startPsync(client, args);
+    } else if (cmd == "REPLCONF") {
+        std::string option = args.size() > 1 ? args[1] : "";
+        std::transform(option.begin(), option.end(), option.begin(), ::tolower);
+        // Acknowledgements are fire-and-forget
+        if (option == "ack") {
+            if (client.isReplica && args.size() > 2)
+                repl.ackReplica(client.id, std::strtoull(args[2].c_str(), nullptr, 10));
+            return true;
+        }
+        if (option == "listening-port" && args.size() > 2)
+            client.replListenPort = std::atoi(args[2].c_str());
+        reply(client, "+OK\r\n");
+    } else if (cmd == "REPLICAOF" || cmd == "SLAVEOF") {
+        if (args.size() != 3) {
+            reply(client, "-ERR REPLICAOF requires host and port, or NO ONE\r\n");
+            return true;
+        }
+        std::string host = args[1], port = args[2];
+        std::transform(host.begin(), host.end(), host.begin(), ::toupper);
+        std::transform(port.begin(), port.end(), port.begin(), ::toupper);
+        if (host == "NO" && port == "ONE") {
+            repl.setPrimary("", 0);
+        } else {
+            int portNum = std::atoi(args[2].c_str());
+            if (portNum <= 0 || portNum > 65535) {
+                reply(client, "-ERR Invalid primary port\r\n");
+                return true;
+            }
+            repl.setPrimary(args[1], portNum);
+        }
+        // Shard 0 owns the link to the primary
+        server_.shard(0).wakeup();
+        reply(client, "+OK\r\n");
+    } else if (cmd == "ROLE") {
+        if (repl.isReplica()) {
+            std::string host;
+            int port = 0;
+            repl.primaryAddress(host, port);
+            reply(client, "*5\r\n" + bulkString("slave") + bulkString(host) + ":" + std::to_string(port) + "\r\n" +
+                          bulkString(repl.linkState()) + ":" + std::to_string(repl.offset()) + "\r\n");
+        } else {
+            auto replicas = repl.replicas();
+            std::string response = "*3\r\n" + bulkString("master") + ":" + std::to_string(repl.offset()) + "\r\n";
+            response += "*" + std::to_string(replicas.size()) + "\r\n";
+            for (const auto& replica : replicas) {
+                response += "*3\r\n" + bulkString(replica.ip) + bulkString(std::to_string(replica.port)) +
+                            bulkString(std::to_string(replica.ackOffset));
+            }
+            reply(client, response);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * PSYNC <replid> <offset>
+ * Every shard must feed its writes before the sync point is chosen, so the
+ * first replica enables feeding on all shards and waits for their acks.
+ */
+void Shard::startPsync(Client& client, std::vector<std::string>& args) {
+    if (args.size() != 3) {
+        reply(client, "-ERR PSYNC requires replication id and offset\r\n");
+        return;
+    }
+    Replication& repl = server_.replication();
+    if (repl.isReplica() && repl.linkState() != "connected") {
+        reply(client, "-NOMASTERLINK Can't SYNC while not connected with my primary\r\n");
+        return;
+    }
+
+    client.psyncArgs.assign(args.begin() + 1, args.end());
+    // Writes made before feeding was enabled are missing from the backlog
+    client.psyncContinue = repl.feedEnabled();
+    feedReplication_ = true;
+
+    int shardCount = server_.shardCount();
+    if (repl.feedEnabled() || shardCount == 1) {
+        repl.enableFeed();
+        finishPsync(client);
+        return;
+    }
+
+    client.fanoutReplies.clear();
+    client.fanoutPending = shardCount - 1;
+    client.awaitingReply = true;
+    for (int target = 0; target < shardCount; target++) {
+        if (target == index_) continue;
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::EnableFeed;
+        msg.fromShard = index_;
+        msg.clientId = client.id;
+        sendToShard(target, std::move(msg));
+    }
+}
+
+/*
+ * Answer PSYNC with either
+ *   +CONTINUE\r\n                                   then the stream from the requested offset, or
+ *   +FULLRESYNC <replid> <offset>\r\n$<len>\r\n<snapshot>   then the stream from <offset>.
+ * Holding the write lock makes the snapshot and the stream offset agree.
+ */
+void Shard::finishPsync(Client& client) {
+    Replication& repl = server_.replication();
+    std::string replId = client.psyncArgs[0];
+    const std::string& offsetArg = client.psyncArgs[1];
+    bool validOffset = !offsetArg.empty() && std::isdigit(static_cast<unsigned char>(offsetArg[0]));
+    uint64_t offset = std::strtoull(offsetArg.c_str(), nullptr, 10);
+    client.psyncArgs.clear();
+
+    bool partial;
+    {
+        std::lock_guard<std::mutex> guard(repl.writeMutex());
+        partial = client.psyncContinue && validOffset && repl.canContinue(replId, offset);
+        if (partial) {
+            client.replOffset = offset;
+            queueOutput(client, "+CONTINUE\r\n");
+        } else {
+            std::ostringstream snapshot;
+            server_.saveSnapshot(snapshot);
+            std::string data = snapshot.str();
+            client.replOffset = repl.offset();
+            queueOutput(client, "+FULLRESYNC " + repl.replId() + " " + std::to_string(client.replOffset) + "\r\n");
+            queueOutput(client, "$" + std::to_string(data.size()) + "\r\n");
+            queueOutput(client, data);
+        }
+        client.replEpoch = repl.streamEpoch();
+    }
+
+    sockaddr_in peer{};
+    socklen_t peerLen = sizeof(peer);
+    char ip[INET_ADDRSTRLEN] = "?";
+    if (getpeername(client.fd, (struct sockaddr*)&peer, &peerLen) == 0)
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+    repl.addReplica(client.id, ip, client.replListenPort);
+
+    client.isReplica = true;
+    replicaIds_.push_back(client.id);
+    replicaCount_++;
+    std::cout << "Replica " << ip << ":" << client.replListenPort << " attached ("
+              << (partial ? "partial" : "full") << " resync)\n";
+}
+
+// Hand every attached replica the next slice of the stream it has not seen yet
+void Shard::serveReplicas() {
+    replicasPending_ = false;
+    if (replicaIds_.empty()) return;
+
+    Replication& repl = server_.replication();
+    uint64_t endOffset = repl.offset();
+    uint64_t epoch = repl.streamEpoch();
+    std::vector<uint64_t> lagging;
+    for (uint64_t id : replicaIds_) {
+        auto it = clients_.find(id);
+        if (it == clients_.end()) continue;
+        Client& client = *it->second;
+        if (client.replEpoch != epoch) {
+            lagging.push_back(id);
+            continue;
+        }
+        if (client.replOffset >= endOffset) continue;
+        // Wait for the socket to drain before handing out more
+        if (client.pendingOutput() >= kReplicaChunk) continue;
+
+        std::string chunk;
+        if (!repl.readBacklog(client.replOffset, kReplicaChunk, chunk)) {
+            lagging.push_back(id);
+            continue;
+        }
+        client.replOffset += chunk.size();
+        queueOutput(client, chunk);
+        if (client.replOffset < endOffset)
+            replicasPending_ = true;
+    }
+
+    // The backlog no longer holds what these replicas need; they reconnect and resync
+    for (uint64_t id : lagging) {
+        std::cerr << "Replica fell behind the replication backlog, disconnecting\n";
+        closeClient(id);
+    }
+}
+
+void Shard::maintainPrimaryLink() {
+    Replication& repl = server_.replication();
+    auto now = std::chrono::steady_clock::now();
+
+    uint64_t generation = repl.primaryGeneration();
+    if (generation != linkGeneration_) {
+        linkGeneration_ = generation;
+        dropPrimaryLink();
+        nextConnect_ = now;
+        if (repl.isReplica()) {
+            std::string host;
+            int port = 0;
+            repl.primaryAddress(host, port);
+            std::cout << "Replicating from " << host << ":" << port << "\n";
+            repl.setLinkState("connect");
+        } else {
+            std::cout << "Replication stopped, now acting as primary\n";
+            repl.setLinkState("");
+        }
+    }
+    if (!repl.isReplica()) return;
+
+    if (linkState_ == LinkState::None) {
+        if (now >= nextConnect_) connectPrimary();
+    } else if (linkState_ == LinkState::Connecting) {
+        pollfd pfd{linkFd_, POLLOUT, 0};
+        if (::poll(&pfd, 1, 0) > 0) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(linkFd_, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                linkEstablished();
+                return;
+            }
+            std::cerr << "Error connecting to primary: " << strerror(err) << "\n";
+        } else if (now < nextConnect_) {
+            return;
+        } else {
+            std::cerr << "Timed out connecting to primary\n";
+        }
+        close(linkFd_);
+        linkFd_ = -1;
+        linkState_ = LinkState::None;
+        nextConnect_ = now + kReconnectDelay;
+        repl.setLinkState("connect");
+    } else if (linkState_ == LinkState::Streaming && now >= nextAck_) {
+        auto it = clients_.find(linkClientId_);
+        if (it != clients_.end())
+            queueOutput(*it->second, encodeCommand({"REPLCONF", "ACK", std::to_string(repl.offset())}));
+        nextAck_ = now + kAckInterval;
+    }
+}
+
+void Shard::connectPrimary() {
+    Replication& repl = server_.replication();
+    std::string host;
+    int port = 0;
+    repl.primaryAddress(host, port);
+    auto now = std::chrono::steady_clock::now();
+    nextConnect_ = now + kReconnectDelay;
+
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || !result) {
+        std::cerr << "Cannot resolve primary " << host << "\n";
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int rc = fd < 0 ? -1 : connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (rc < 0 && errno != EINPROGRESS) {
+        if (fd >= 0) close(fd);
+        std::cerr << "Error connecting to primary: " << strerror(errno) << "\n";
+        return;
+    }
+
+    linkFd_ = fd;
+    linkState_ = LinkState::Connecting;
+    nextConnect_ = now + kConnectTimeout;
+    repl.setLinkState("connecting");
+}
+
+// Connected: register the link like any client and start the handshake
+void Shard::linkEstablished() {
+    Replication& repl = server_.replication();
+    int optVal = 1;
+    setsockopt(linkFd_, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(optVal));
+
+    std::unique_ptr<Client> client(new Client());
+    client->fd = linkFd_;
+    client->id = server_.nextClientId();
+    client->isPrimaryLink = true;
+    linkFd_ = -1;
+    linkClientId_ = client->id;
+    linkState_ = LinkState::Handshake;
+    repl.setLinkState("sync");
+
+    Client& link = *client;
+    backend_->addClient(link);
+    clients_[link.id] = std::move(client);
+    queueOutput(link, encodeCommand({"REPLCONF", "listening-port", std::to_string(server_.port())}));
+    queueOutput(link, encodeCommand({"PSYNC", repl.replId(), std::to_string(repl.offset())}));
+}
+
+void Shard::dropPrimaryLink() {
+    if (linkFd_ != -1) {
+        close(linkFd_);
+        linkFd_ = -1;
+    }
+    if (linkClientId_ != 0)
+        closeClient(linkClientId_);
+    linkState_ = LinkState::None;
+}
+
+// Consume the primary's handshake replies, snapshot and command stream
+void Shard::processPrimaryStream(Client& client) {
+    Replication& repl = server_.replication();
+    size_t pos = 0;
+    bool failed = false;
+    std::vector<std::string> args;
+    while (!failed && pos < client.inBuf.size()) {
+        if (linkState_ == LinkState::Handshake) {
+            size_t eol = client.inBuf.find("\r\n", pos);
+            if (eol == std::string::npos) break;
+            std::string line = client.inBuf.substr(pos, eol - pos);
+            pos = eol + 2;
+            if (line == "+OK") continue;
+            if (line.compare(0, 12, "+FULLRESYNC ") == 0) {
+                std::istringstream iss(line.substr(12));
+                iss >> linkReplId_ >> linkOffset_;
+                linkState_ = LinkState::Snapshot;
+            } else if (line == "+CONTINUE") {
+                std::cout << "Partial resync with primary at offset " << repl.offset() << "\n";
+                linkState_ = LinkState::Streaming;
+                repl.setLinkState("connected");
+            } else {
+                std::cerr << "Primary refused to sync: " << line << "\n";
+                failed = true;
+            }
+        } else if (linkState_ == LinkState::Snapshot) {
+            size_t eol = client.inBuf.find("\r\n", pos);
+            if (eol == std::string::npos) break;
+            if (client.inBuf[pos] != '$') {
+                failed = true;
+                break;
+            }
+            size_t len = std::strtoull(client.inBuf.c_str() + pos + 1, nullptr, 10);
+            if (client.inBuf.size() - (eol + 2) < len) break;
+
+            std::istringstream snapshot(client.inBuf.substr(eol + 2, len));
+            pos = eol + 2 + len;
+            {
+                std::lock_guard<std::mutex> guard(repl.writeMutex());
+                if (!server_.loadSnapshot(snapshot)) {
+                    std::cerr << "Error loading snapshot from primary\n";
+                    failed = true;
+                    break;
+                }
+                repl.resetStream(linkReplId_, linkOffset_);
+            }
+            std::cout << "Full resync with primary complete (" << len << " bytes)\n";
+            linkState_ = LinkState::Streaming;
+            repl.setLinkState("connected");
+        } else {
+            long consumed = parseCommand(client.inBuf, pos, args);
+            if (consumed == 0) break;
+            if (consumed < 0) {
+                std::cerr << "Protocol error in replication stream\n";
+                failed = true;
+                break;
+            }
+            pos += consumed;
+            if (!args.empty())
+                applyReplicated(args);
+        }
+    }
+
+    if (failed) {
+        closeClient(client.id);
+        return;
+    }
+    client.inBuf.erase(0, pos);
+}
+
+/*
+ * Apply a write from the primary straight to the owning store and re-feed it,
+ * so this replica's offset tracks the primary's and it can serve replicas itself.
+ */
+void Shard::applyReplicated(const std::vector<std::string>& args) {
+    Replication& repl = server_.replication();
+    std::string cmd = args[0];
+    std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+    const CommandInfo* info = lookupCommand(cmd);
+
+    std::lock_guard<std::mutex> guard(repl.writeMutex());
+    repl.feed(args);
+    // Transactions arrive as MULTI, the writes, EXEC and are applied atomically
+    if (cmd == "MULTI") {
+        replInMulti_ = true;
+        replMulti_.clear();
+        return;
+    }
+    if (replInMulti_) {
+        if (cmd != "EXEC") {
+            replMulti_.push_back(args);
+            return;
+        }
+        execBatch(replMulti_, nullptr, false);
+        replInMulti_ = false;
+        replMulti_.clear();
+        return;
+    }
+    if (cmd == "BULKRESTORE") {
+        BulkStats ignored;
+        bulkRestore(args, false, ignored);
+        return;
+    }
+    if (info && (info->flags & CMD_ALL_SHARDS)) {
+        for (int i = 0; i < server_.shardCount(); i++)
+            CommandProcessor(server_.shard(i).store()).execute(args);
+    } else {
+        int owner = 0;
+        if (info) {
+            auto keys = commandKeys(*info, args);
+            if (!keys.empty()) owner = server_.shardForKey(keys[0]);
+        }
+        CommandProcessor(server_.shard(owner).store()).execute(args);
+    }
+}
+
+//----------------------
+// Client Management
+//----------------------
+static ClientClass clientClass(const Client& client) {
+    if (client.isReplica) return CLIENT_REPLICA;
+    if (!client.channels.empty() || !client.patterns.empty()) return CLIENT_PUBSUB;
+    return CLIENT_NORMAL;
+}
+
+bool Shard::clientCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    if (cmd != "CLIENT") return false;
+    std::string sub = args.size() > 1 ? args[1] : "";
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+
+    if (sub == "LIST" && args.size() == 2) {
+        int shardCount = server_.shardCount();
+        if (shardCount == 1) {
+            reply(client, bulkString(listClients()));
+            return true;
+        }
+        // Every shard lists its own connections; the bulk replies are concatenated
+        client.fanoutReplies.clear();
+        client.fanoutReplies.push_back(bulkString(listClients()));
+        client.fanoutPending = shardCount - 1;
+        client.awaitingReply = true;
+        for (int target = 0; target < shardCount; target++) {
+            if (target == index_) continue;
+            ShardMessage msg;
+            msg.kind = ShardMessage::Kind::ClientList;
+            msg.fromShard = index_;
+            msg.clientId = client.id;
+            sendToShard(target, std::move(msg));
+        }
+    } else if (sub == "ID" && args.size() == 2) {
+        reply(client, ":" + std::to_string(client.id) + "\r\n");
+    } else if (sub == "GETNAME" && args.size() == 2) {
+        reply(client, client.name.empty() ? "$-1\r\n" : bulkString(client.name));
+    } else if (sub == "SETNAME" && args.size() == 3) {
+        for (char c : args[2]) {
+            if (c <= ' ' || c > '~') {
+                reply(client, "-ERR Client names cannot contain spaces, newlines or special characters.\r\n");
+                return true;
+            }
+        }
+        client.name = args[2];
+        reply(client, "+OK\r\n");
+    } else if (sub == "TRACKING" && args.size() >= 3) {
+        std::string mode = args[2];
+        std::transform(mode.begin(), mode.end(), mode.begin(), ::toupper);
+        if (mode == "OFF" && args.size() == 3) {
+            stopTracking(client);
+            reply(client, "+OK\r\n");
+            return true;
+        }
+        if (mode != "ON") {
+            reply(client, "-ERR syntax error\r\n");
+            return true;
+        }
+        // ON [REDIRECT <id>] [BCAST] [PREFIX <prefix>]...
+        bool bcast = false;
+        int64_t redirect = -1;
+        std::vector<std::string> prefixes;
+        for (size_t i = 3; i < args.size(); i++) {
+            std::string option = args[i];
+            std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+            if (option == "BCAST") {
+                bcast = true;
+            } else if (option == "REDIRECT" && i + 1 < args.size()) {
+                const std::string& id = args[++i];
+                if (id.empty() || id.size() > 18 || !std::all_of(id.begin(), id.end(), ::isdigit)) {
+                    reply(client, "-ERR Invalid client ID\r\n");
+                    return true;
+                }
+                redirect = std::stoll(id);
+            } else if (option == "PREFIX" && i + 1 < args.size()) {
+                prefixes.push_back(args[++i]);
+            } else {
+                reply(client, "-ERR syntax error\r\n");
+                return true;
+            }
+        }
+        if (!prefixes.empty() && !bcast) {
+            reply(client, "-ERR PREFIX option requires BCAST mode to be enabled\r\n");
+            return true;
+        }
+        // Replies are RESP2, where invalidations can only arrive on a subscribed connection
+        if (redirect < 0) {
+            reply(client, "-ERR CLIENT TRACKING requires REDIRECT to a connection subscribed to " +
+                          std::string(kInvalidateChannel) + "\r\n");
+            return true;
+        }
+        int targetShard = server_.clientShard(redirect);
+        if (targetShard < 0) {
+            reply(client, "-ERR The client ID you want redirect to does not exist\r\n");
+            return true;
+        }
+        stopTracking(client);
+        client.tracking = true;
+        client.trackingBcast = bcast;
+        client.trackingTarget = Tracker{static_cast<uint64_t>(redirect), targetShard};
+        if (bcast) {
+            if (prefixes.empty()) prefixes.push_back("");
+            for (int s = 0; s < server_.shardCount(); s++)
+                server_.shard(s).store().trackPrefixes(client.id, client.trackingTarget, prefixes);
+        }
+        reply(client, "+OK\r\n");
+    } else if (sub == "GETREDIR" && args.size() == 2) {
+        // -1: tracking is off
+        int64_t redirect = client.tracking ? static_cast<int64_t>(client.trackingTarget.clientId) : -1;
+        reply(client, ":" + std::to_string(redirect) + "\r\n");
+    } else {
+        reply(client, "-ERR Unknown CLIENT subcommand or wrong number of arguments, expected LIST, ID, GETNAME, SETNAME, TRACKING or GETREDIR\r\n");
+    }
+    return true;
+}
+
+// One line per connection of this shard, in the CLIENT LIST format
+std::string Shard::listClients() {
+    auto now = std::chrono::steady_clock::now();
+    std::ostringstream oss;
+    for (const auto& entry : clients_) {
+        const Client& client = *entry.second;
+        std::string flags;
+        if (client.isReplica) flags += 'S';
+        if (client.isPrimaryLink) flags += 'M';
+        if (clientClass(client) == CLIENT_PUBSUB) flags += 'P';
+        if (client.inMulti) flags += 'x';
+        if (blocked_.count(client.id) || client.blockedShard >= 0) flags += 'b';
+        if (flags.empty()) flags = "N";
+        std::string lastCommand = client.lastCommand.empty() ? "NULL" : client.lastCommand;
+        std::transform(lastCommand.begin(), lastCommand.end(), lastCommand.begin(), ::tolower);
+
+        oss << "id=" << client.id
+            << " addr=" << client.addr
+            << " fd=" << client.fd
+            << " name=" << client.name
+            << " age=" << std::chrono::duration_cast<std::chrono::seconds>(now - client.createdAt).count()
+            << " idle=" << std::chrono::duration_cast<std::chrono::seconds>(now - client.lastActive).count()
+            << " flags=" << flags
+            << " shard=" << index_
+            << " sub=" << client.channels.size()
+            << " psub=" << client.patterns.size()
+            << " multi=" << (client.inMulti ? static_cast<long>(client.multiQueue.size()) : -1L)
+            << " qbuf=" << client.inBuf.size()
+            << " obl=" << client.outBuf.size() - client.outPos
+            << " oll=" << client.outQueue.size()
+            << " omem=" << client.pendingOutput()
+            << " class=" << kClientClassNames[clientClass(client)]
+            << " cmd=" << lastCommand << "\n";
+    }
+    return oss.str();
+}
+
+// Drop a client whose output exceeds its class's hard limit, or its soft limit for too long
+void Shard::checkOutputLimit(Client& client) {
+    if (client.closeNow || client.isPrimaryLink) return;
+    ClientClass cls = clientClass(client);
+    const OutputBufferLimit& limit = server_.config().outputLimits[cls];
+    size_t pending = client.pendingOutput();
+    bool overSoft = limit.soft > 0 && pending > limit.soft;
+    bool overHard = limit.hard > 0 && pending > limit.hard;
+    if (!overSoft) client.softLimitSince = {};
+    if (!overSoft && !overHard) return;
+
+    if (!overHard) {
+        auto now = std::chrono::steady_clock::now();
+        if (client.softLimitSince == std::chrono::steady_clock::time_point())
+            client.softLimitSince = now;
+        if (now - client.softLimitSince < std::chrono::seconds(limit.softSeconds)) return;
+    }
+    std::cerr << "Client " << client.id << " (" << kClientClassNames[cls]
+              << ") exceeded its output buffer limit, disconnecting\n";
+    client.closeNow = true;
+    pendingWrites_.push_back(client.id);
+}
+
+// Once a second: enforce soft output limits and the idle timeout
+void Shard::clientsCron() {
+    auto now = std::chrono::steady_clock::now();
+    if (now < nextCron_) return;
+    nextCron_ = now + kCronInterval;
+
+    auto idleTimeout = std::chrono::seconds(server_.config().idleTimeout);
+    std::vector<uint64_t> idle;
+    for (auto& entry : clients_) {
+        Client& client = *entry.second;
+        checkOutputLimit(client);
+        // Replicas, the primary link, subscribers and blocked clients legitimately stay silent
+        if (idleTimeout.count() > 0 && clientClass(client) == CLIENT_NORMAL && !client.isPrimaryLink &&
+            !client.awaitingReply && now - client.lastActive >= idleTimeout)
+            idle.push_back(entry.first);
+    }
+    for (uint64_t id : idle)
+        closeClient(id);
+    // Cached copies of keys that expire untouched are invalidated within a second
+    if (store_.hasTracking())
+        store_.expireKeys();
+    server_.capture().flush(index_);
+}
+
+//----------------------
+// Client-side Caching
+//----------------------
+// Forget the connection's broadcast prefixes; keys it read stay tracked until they change
+void Shard::stopTracking(Client& client) {
+    if (!client.tracking) return;
+    if (client.trackingBcast) {
+        for (int s = 0; s < server_.shardCount(); s++)
+            server_.shard(s).store().untrackPrefixes(client.id);
+    }
+    client.tracking = false;
+    client.trackingBcast = false;
+    client.trackingTarget = Tracker();
+}
+
+// Send what this shard's store invalidated, one message per receiving connection
+void Shard::sendInvalidations() {
+    if (!store_.hasInvalidations()) return;
+    struct Pending {
+        Tracker target;
+        std::vector<std::string> keys;
+        bool flush = false;
+    };
+    std::vector<Pending> pending;
+    std::unordered_map<uint64_t, size_t> byClient;
+    for (auto& invalidation : store_.takeInvalidations()) {
+        auto it = byClient.find(invalidation.target.clientId);
+        if (it == byClient.end()) {
+            it = byClient.emplace(invalidation.target.clientId, pending.size()).first;
+            pending.push_back(Pending());
+            pending.back().target = invalidation.target;
+        }
+        Pending& entry = pending[it->second];
+        if (invalidation.flush)
+            entry.flush = true;
+        else
+            entry.keys.push_back(std::move(invalidation.key));
+    }
+    for (auto& entry : pending) {
+        // A flush covers any keys invalidated along with it
+        if (entry.flush) entry.keys.clear();
+        if (entry.target.shard == index_) {
+            deliverInvalidation(entry.target.clientId, entry.keys);
+            continue;
+        }
+        ShardMessage msg;
+        msg.kind = ShardMessage::Kind::Invalidate;
+        msg.fromShard = index_;
+        msg.clientId = entry.target.clientId;
+        msg.args = std::move(entry.keys);
+        sendToShard(entry.target.shard, std::move(msg));
+    }
+}
+
+// Queue an invalidation as a message of the __redis__:invalidate channel; no keys means a flush.
+// Connections that are gone or not subscribed to the channel are skipped
+void Shard::deliverInvalidation(uint64_t clientId, const std::vector<std::string>& keys) {
+    auto it = clients_.find(clientId);
+    if (it == clients_.end() || !it->second->channels.count(kInvalidateChannel)) return;
+    std::string message = "*3\r\n$7\r\nmessage\r\n" + bulkString(kInvalidateChannel);
+    if (keys.empty()) {
+        message += "*-1\r\n";
+    } else {
+        message += "*" + std::to_string(keys.size()) + "\r\n";
+        for (const auto& key : keys)
+            message += bulkString(key);
+    }
+    queueOutput(*it->second, message);
+}
+
+//----------------------
+// Traffic Capture
+//----------------------
+// CAPTURE START <path> [MAXBYTES <n>] | STOP | STATUS; the capture is server-wide
+bool Shard::captureCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    if (cmd != "CAPTURE") return false;
+    std::string sub = args.size() > 1 ? args[1] : "";
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+    TrafficCapture& capture = server_.capture();
+
+    if (sub == "START" && (args.size() == 3 || args.size() == 5)) {
+        uint64_t maxBytes = 0;
+        if (args.size() == 5) {
+            std::string option = args[3];
+            std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+            const std::string& value = args[4];
+            if (option != "MAXBYTES" || value.empty() || value.size() > 19 ||
+                !std::all_of(value.begin(), value.end(), ::isdigit)) {
+                reply(client, "-ERR syntax error\r\n");
+                return true;
+            }
+            maxBytes = std::stoull(value);
+        }
+        if (capture.active())
+            reply(client, "-ERR A capture is already running\r\n");
+        else if (!capture.start(args[2], maxBytes))
+            reply(client, "-ERR Cannot create capture file\r\n");
+        else
+            reply(client, "+OK\r\n");
+    } else if (sub == "STOP" && args.size() == 2) {
+        capture.stop();
+        reply(client, "+OK\r\n");
+    } else if (sub == "STATUS" && args.size() == 2) {
+        reply(client, bulkString(capture.status()));
+    } else {
+        reply(client, "-ERR Unknown CAPTURE subcommand or wrong number of arguments, expected START, STOP or STATUS\r\n");
+    }
+    return true;
+}
+
+//----------------------
+// Bulk Loading
+//----------------------
+/*
+ * BULKLOAD BEGIN switches a connection to bulk mode until BULKLOAD END:
+ * commands get no reply and are applied in batches of up to kBulkBatch,
+ * each shard's share under a single lock of its store. Errors are counted
+ * and END reports the totals, so a whole file can be streamed with
+ * redis-cli --pipe between a BEGIN and an END line.
+ */
+// Error text of an error reply, without the leading '-' and the CRLF
+static std::string errorText(const std::string& reply) {
+    if (reply.size() < 3) return reply;
+    return reply.substr(1, reply.size() - 3);
+}
+
+bool Shard::bulkCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    if (cmd == "BULKRESTORE") {
+        if (server_.replication().isReplica()) {
+            reply(client, "-READONLY You can't write against a read only replica.\r\n");
+            return true;
+        }
+        BulkStats stats;
+        {
+            std::unique_lock<std::mutex> feedLock;
+            if (feedReplication_)
+                feedLock = std::unique_lock<std::mutex>(server_.replication().writeMutex());
+            bulkRestore(args, true, stats);
+        }
+        if (stats.errors > 0)
+            reply(client, "-" + stats.firstError + "\r\n");
+        else
+            reply(client, ":" + std::to_string(stats.restoredKeys) + "\r\n");
+        return true;
+    }
+    if (cmd != "BULKLOAD") return false;
+    std::string sub = args.size() > 1 ? args[1] : "";
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+
+    if (sub == "BEGIN" && args.size() % 3 == 2) {
+        if (server_.replication().isReplica()) {
+            reply(client, "-READONLY You can't write against a read only replica.\r\n");
+            return true;
+        }
+        if (client.bulkLoading) {
+            reply(client, "-ERR BULKLOAD already started\r\n");
+            return true;
+        }
+        // RESERVE <type> <keys>: presize the stores for the keys about to arrive
+        std::vector<std::pair<std::string, size_t>> reserve;
+        for (size_t i = 2; i < args.size(); i += 3) {
+            std::string option = args[i];
+            std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+            std::string type = args[i + 1];
+            std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+            const std::string& count = args[i + 2];
+            if (option != "RESERVE" || count.empty() || count.size() > 12 ||
+                !std::all_of(count.begin(), count.end(), ::isdigit)) {
+                reply(client, "-ERR syntax error\r\n");
+                return true;
+            }
+            reserve.emplace_back(type, std::stoull(count));
+        }
+        int shardCount = server_.shardCount();
+        for (const auto& entry : reserve) {
+            // Keys spread evenly over the shards
+            for (int s = 0; s < shardCount; s++) {
+                if (!server_.shard(s).store().reserveKeys(entry.first, entry.second / shardCount + 1)) {
+                    reply(client, "-ERR Unknown type '" + entry.first + "' for RESERVE\r\n");
+                    return true;
+                }
+            }
+        }
+        client.bulk = BulkStats();
+        client.bulkLoading = true;
+        reply(client, "+OK\r\n");
+    } else if (sub == "END" && args.size() == 2) {
+        if (!client.bulkLoading) {
+            reply(client, "-ERR BULKLOAD END without BEGIN\r\n");
+            return true;
+        }
+        client.bulkLoading = false;
+        std::string summary = "commands=" + std::to_string(client.bulk.commands) +
+                              " restored_keys=" + std::to_string(client.bulk.restoredKeys) +
+                              " errors=" + std::to_string(client.bulk.errors);
+        if (client.bulk.errors > 0) summary += " first_error=" + client.bulk.firstError;
+        reply(client, bulkString(summary));
+    } else {
+        reply(client, "-ERR Unknown BULKLOAD subcommand or wrong number of arguments, expected BEGIN or END\r\n");
+    }
+    return true;
+}
+
+// Route a batch of bulk commands to their shards; BULKRESTORE splits it so commands keep their order
+void Shard::applyBulk(Client& client, std::vector<std::vector<std::string>>& commands) {
+    int shardCount = server_.shardCount();
+    bool cluster = server_.cluster().enabled();
+    bool readOnly = server_.replication().isReplica();
+    BulkStats& stats = client.bulk;
+
+    // Replication lock before store locks, as everywhere else
+    std::unique_lock<std::mutex> feedLock;
+    if (feedReplication_)
+        feedLock = std::unique_lock<std::mutex>(server_.replication().writeMutex());
+
+    std::vector<const CommandInfo*> infos(commands.size(), nullptr);
+    std::vector<std::vector<size_t>> byShard(shardCount);
+    for (size_t i = 0; i < commands.size(); i++) {
+        const auto& args = commands[i];
+        stats.commands++;
+        std::string cmd = args[0];
+        std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+        if (cmd == "BULKRESTORE" && !readOnly) {
+            runBulkBatch(commands, byShard, infos, feedLock.owns_lock(), stats);
+            bulkRestore(args, true, stats);
+            continue;
+        }
+        const CommandInfo* info = lookupCommand(cmd);
+        if (!info || (info->flags & (CMD_ALL_SHARDS | CMD_BLOCKING))) {
+            stats.fail("ERR '" + args[0] + "' is not allowed during BULKLOAD");
+            continue;
+        }
+        if (!checkArity(*info, args.size())) {
+            std::string name = args[0];
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            stats.fail("ERR wrong number of arguments for '" + name + "' command");
+            continue;
+        }
+        if ((info->flags & CMD_WRITE) && readOnly) {
+            stats.fail("READONLY You can't write against a read only replica.");
+            continue;
+        }
+        auto keys = commandKeys(*info, args);
+        std::string error = cluster ? clusterRedirect(keys, false) : "";
+        int owner = keys.empty() ? index_ : server_.shardForKey(keys[0]);
+        for (size_t k = 1; k < keys.size() && error.empty(); k++) {
+            if (server_.shardForKey(keys[k]) != owner)
+                error = "-CROSSSLOT Keys in request don't hash to the same shard\r\n";
+        }
+        if (!error.empty()) {
+            stats.fail(errorText(error));
+            continue;
+        }
+        infos[i] = info;
+        byShard[owner].push_back(i);
+    }
+    runBulkBatch(commands, byShard, infos, feedLock.owns_lock(), stats);
+}
+
+// Run the routed commands, one store lock per shard, and clear byShard
+void Shard::runBulkBatch(const std::vector<std::vector<std::string>>& commands, std::vector<std::vector<size_t>>& byShard,
+                         const std::vector<const CommandInfo*>& infos, bool feed, BulkStats& stats) {
+    Replication& repl = server_.replication();
+    for (int s = 0; s < static_cast<int>(byShard.size()); s++) {
+        if (byShard[s].empty()) continue;
+        KVStore& store = server_.shard(s).store();
+        std::vector<std::string> touched;
+        {
+            auto lock = store.acquireLock();
+            CommandProcessor processor(store);
+            for (size_t i : byShard[s]) {
+                std::string result = processor.execute(commands[i]);
+                if (!result.empty() && result[0] == '-') {
+                    stats.fail(errorText(result));
+                    continue;
+                }
+                if (!(infos[i]->flags & CMD_WRITE)) continue;
+                if (feed) repl.feed(commands[i]);
+                for (auto& key : commandKeys(*infos[i], commands[i]))
+                    touched.push_back(std::move(key));
+            }
+        }
+        if (!touched.empty()) markReady(s, std::move(touched));
+        byShard[s].clear();
+    }
+}
+
+/*
+ * BULKRESTORE payload [REPLACE]: create every key of a payload made of
+ * snapshot sections (the DUMP format; several DUMP payloads can be
+ * concatenated) with its own name and TTL. Keys that exist fail with
+ * BUSYKEY unless REPLACE is given; the others are restored regardless.
+ * The caller holds the replication lock while replicas may be attached.
+ */
+void Shard::bulkRestore(const std::vector<std::string>& args, bool origin, BulkStats& stats) {
+    bool replace = args.size() == 3 && strcasecmp(args[2].c_str(), "REPLACE") == 0;
+    if (args.size() != 2 && !replace) {
+        stats.fail("ERR syntax error");
+        return;
+    }
+    KVStore decoded;
+    if (!decoded.decodePayload(args[1])) {
+        stats.fail("ERR BULKRESTORE payload version or checksum are wrong");
+        return;
+    }
+    int shardCount = server_.shardCount();
+    std::vector<std::vector<std::string>> byShard(shardCount);
+    for (auto& key : decoded.getAllKeys()) {
+        if (origin && server_.cluster().enabled()) {
+            std::string redirect = clusterRedirect({key}, false);
+            if (!redirect.empty()) {
+                stats.fail(errorText(redirect));
+                continue;
+            }
+        }
+        byShard[server_.shardForKey(key)].push_back(std::move(key));
+    }
+
+    bool restored = false;
+    for (int s = 0; s < shardCount; s++) {
+        if (byShard[s].empty()) continue;
+        KVStore& store = server_.shard(s).store();
+        std::vector<std::string> created;
+        {
+            auto lock = store.acquireLock();
+            for (auto& key : byShard[s]) {
+                std::string error;
+                if (store.adoptKey(decoded, key, key, decoded.getTtlMs(key), replace, error))
+                    created.push_back(std::move(key));
+                else
+                    stats.fail(error);
+            }
+            if (store.hasWatchedKeys()) store.touchKeys(created);
+            if (store.hasTracking()) store.invalidateKeys(created);
+        }
+        stats.restoredKeys += created.size();
+        restored = restored || !created.empty();
+        if (!created.empty()) markReady(s, std::move(created));
+    }
+    if (origin && restored && feedReplication_)
+        server_.replication().feed(args);
+}
+
+//----------------------
+// Cluster
+//----------------------
+static bool parseSlot(const std::string& arg, int& slot) {
+    if (arg.empty() || arg.size() > 5 || !std::all_of(arg.begin(), arg.end(), ::isdigit)) return false;
+    slot = std::stoi(arg);
+    return slot < Cluster::kSlots;
+}
+
+bool Shard::clusterCommand(Client& client, const std::string& cmd, std::vector<std::string>& args) {
+    Cluster& cluster = server_.cluster();
+    if (cmd == "MIGRATE") {
+        reply(client, migrate(args));
+        return true;
+    }
+    if (cmd != "CLUSTER" && cmd != "ASKING") return false;
+    std::string sub = args.size() > 1 ? args[1] : "";
+    std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+
+    // KEYSLOT is a pure function and also answers outside cluster mode
+    if (cmd == "CLUSTER" && sub == "KEYSLOT" && args.size() == 3) {
+        reply(client, ":" + std::to_string(keyHashSlot(args[2])) + "\r\n");
+        return true;
+    }
+    if (!cluster.enabled()) {
+        reply(client, "-ERR This instance has cluster support disabled\r\n");
+        return true;
+    }
+    if (cmd == "ASKING") {
+        client.asking = true;
+        reply(client, "+OK\r\n");
+        return true;
+    }
+
+    int slot = 0;
+    std::string error;
+    if (sub == "INFO" && args.size() == 2) {
+        reply(client, bulkString(cluster.infoText()));
+    } else if (sub == "MYID" && args.size() == 2) {
+        reply(client, bulkString(cluster.myId()));
+    } else if (sub == "NODES" && args.size() == 2) {
+        reply(client, bulkString(cluster.nodesText()));
+    } else if (sub == "SLOTS" && args.size() == 2) {
+        reply(client, cluster.slotsReply());
+    } else if ((sub == "COUNTKEYSINSLOT" && args.size() == 3) || (sub == "GETKEYSINSLOT" && args.size() == 4)) {
+        if (!parseSlot(args[2], slot)) {
+            reply(client, "-ERR Invalid or out of range slot\r\n");
+            return true;
+        }
+        // A slot never spans shards, see KVServer::shardForKey
+        KVStore& store = server_.shard(slot % server_.shardCount()).store();
+        if (sub == "COUNTKEYSINSLOT") {
+            reply(client, ":" + std::to_string(store.countKeysInSlot(slot)) + "\r\n");
+            return true;
+        }
+        long count = std::atol(args[3].c_str());
+        if (count < 0 || !std::all_of(args[3].begin(), args[3].end(), ::isdigit)) {
+            reply(client, "-ERR Invalid number of keys\r\n");
+            return true;
+        }
+        auto keys = store.getKeysInSlot(slot, static_cast<size_t>(count));
+        std::string response = "*" + std::to_string(keys.size()) + "\r\n";
+        for (const auto& key : keys)
+            response += bulkString(key);
+        reply(client, response);
+    } else if (sub == "MEET" && args.size() == 4) {
+        int port = std::atoi(args[3].c_str());
+        if (port <= 0 || port > 65535) {
+            reply(client, "-ERR Invalid TCP base port specified: " + args[3] + "\r\n");
+            return true;
+        }
+        cluster.meet(args[2], port);
+        reply(client, "+OK\r\n");
+    } else if (sub == "FORGET" && args.size() == 3) {
+        reply(client, cluster.forget(args[2], error) ? "+OK\r\n" : "-" + error + "\r\n");
+    } else if ((sub == "ADDSLOTS" || sub == "DELSLOTS") && args.size() > 2) {
+        std::vector<int> slots;
+        for (size_t i = 2; i < args.size(); i++) {
+            if (!parseSlot(args[i], slot)) {
+                reply(client, "-ERR Invalid or out of range slot\r\n");
+                return true;
+            }
+            slots.push_back(slot);
+        }
+        bool ok = sub == "ADDSLOTS" ? cluster.addSlots(slots, error) : cluster.delSlots(slots, error);
+        reply(client, ok ? "+OK\r\n" : "-" + error + "\r\n");
+    } else if (sub == "ADDSLOTSRANGE" && args.size() > 2 && args.size() % 2 == 0) {
+        std::vector<int> slots;
+        for (size_t i = 2; i < args.size(); i += 2) {
+            int first, last;
+            if (!parseSlot(args[i], first) || !parseSlot(args[i + 1], last) || first > last) {
+                reply(client, "-ERR Invalid or out of range slot\r\n");
+                return true;
+            }
+            for (int s = first; s <= last; s++)
+                slots.push_back(s);
+        }
+        reply(client, cluster.addSlots(slots, error) ? "+OK\r\n" : "-" + error + "\r\n");
+    } else if (sub == "SETSLOT" && (args.size() == 4 || args.size() == 5)) {
+        std::string state = args[3];
+        std::transform(state.begin(), state.end(), state.begin(), ::toupper);
+        if (!parseSlot(args[2], slot)) {
+            reply(client, "-ERR Invalid or out of range slot\r\n");
+        } else if ((state == "STABLE") != (args.size() == 4)) {
+            reply(client, "-ERR Invalid CLUSTER SETSLOT action or number of arguments\r\n");
+        } else {
+            bool ok = cluster.setSlot(slot, state, args.size() == 5 ? args[4] : "", error);
+            reply(client, ok ? "+OK\r\n" : "-" + error + "\r\n");
+        }
+    } else {
+        reply(client, "-ERR Unknown CLUSTER subcommand or wrong number of arguments\r\n");
+    }
+    return true;
+}
+
+/*
+ * Check that this node serves the slot of keys, otherwise the redirection reply.
+ * While a slot migrates, keys already moved are served by the target (ASK);
+ * a command on a mix of moved and present keys has to be retried (TRYAGAIN).
+ */
+std::string Shard::clusterRedirect(const std::vector<std::string>& keys, bool asking) {
+    if (keys.empty()) return "";
+    int slot = keyHashSlot(keys[0]);
+    for (size_t i = 1; i < keys.size(); i++) {
+        if (keyHashSlot(keys[i]) != slot)
+            return "-CROSSSLOT Keys in request don't hash to the same slot\r\n";
+    }
+    Cluster& cluster = server_.cluster();
+    SlotRoute route = cluster.route(slot);
+    if (route.owner < 0)
+        return "-CLUSTERDOWN Hash slot not served\r\n";
+    if (route.owner != 0) {
+        if (asking && route.importingFrom >= 0) return "";
+        return "-MOVED " + std::to_string(slot) + " " + cluster.nodeAddress(route.owner) + "\r\n";
+    }
+    if (route.migratingTo < 0) return "";
+
+    KVStore& store = server_.shard(server_.shardForKey(keys[0])).store();
+    size_t missing = 0;
+    for (const auto& key : keys) {
+        if (store.getKeyType(key) == "none") missing++;
+    }
+    if (missing == 0) return "";
+    if (missing == keys.size())
+        return "-ASK " + std::to_string(slot) + " " + cluster.nodeAddress(route.migratingTo) + "\r\n";
+    return "-TRYAGAIN Multiple keys request during rehashing of slot\r\n";
+}
+
+// Blocking connect bounded by timeoutMs; -1 on failure
+static int connectWithTimeout(const std::string& host, int port, int timeoutMs) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0 || !result)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int rc = fd < 0 ? -1 : connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    if (rc < 0 && errno == EINPROGRESS) {
+        pollfd pfd{fd, POLLOUT, 0};
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (poll(&pfd, 1, timeoutMs) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+            rc = 0;
+    }
+    if (rc < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * MIGRATE host port key|"" db timeout [COPY] [REPLACE] [KEYS key...]
+ * Keys are sent as RESTORE commands (after ASKING, so an importing target
+ * accepts them) and deleted once the target acknowledged all of them. Like
+ * in Redis the call is synchronous for the calling shard, but no store lock
+ * is held over the network round trip: the keys are watched before they are
+ * dumped and a key written meanwhile is kept instead of deleted, and reported
+ * with -TRYAGAIN since the target's copy is stale.
+ */
+std::string Shard::migrate(const std::vector<std::string>& args) {
+    if (args.size() < 6)
+        return "-ERR wrong number of arguments for 'migrate' command\r\n";
+    if (server_.replication().isReplica())
+        return "-READONLY You can't write against a read only replica.\r\n";
+    int port = std::atoi(args[2].c_str());
+    long timeoutMs = std::atol(args[5].c_str());
+    if (port <= 0 || port > 65535 || timeoutMs < 0)
+        return "-ERR syntax error\r\n";
+    if (args[4] != "0")
+        return "-ERR Only database 0 is supported\r\n";
+    if (timeoutMs == 0) timeoutMs = 1000;
+
+    bool copy = false, replace = false;
+    std::vector<std::string> keys;
+    for (size_t i = 6; i < args.size(); i++) {
+        std::string option = args[i];
+        std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+        if (option == "COPY") {
+            copy = true;
+        } else if (option == "REPLACE") {
+            replace = true;
+        } else if (option == "KEYS" && args[3].empty() && i + 1 < args.size()) {
+            keys.assign(args.begin() + i + 1, args.end());
+            break;
+        } else {
+            return "-ERR syntax error\r\n";
+        }
+    }
+    if (keys.empty()) keys.push_back(args[3]);
+
+    std::string request;
+    size_t expected = 0;
+    if (server_.cluster().enabled()) {
+        request += encodeCommand({"ASKING"});
+        expected++;
+    }
+    // Watched first, so any write after the DUMP changes the version checked before DEL
+    std::vector<std::pair<std::string, uint64_t>> moved;
+    for (const auto& key : keys) {
+        KVStore& store = server_.shard(server_.shardForKey(key)).store();
+        auto lock = store.acquireLock();
+        uint64_t version = store.watchKey(key);
+        std::string payload;
+        if (!store.dumpKey(key, payload)) {
+            store.unwatchKey(key);
+            continue;
+        }
+        std::vector<std::string> restore = {"RESTORE", key, std::to_string(store.getTtlMs(key)), payload};
+        if (replace) restore.push_back("REPLACE");
+        request += encodeCommand(restore);
+        moved.emplace_back(key, version);
+        expected++;
+    }
+    if (moved.empty())
+        return "+NOKEY\r\n";
+    auto unwatchMoved = [this, &moved]() {
+        for (const auto& entry : moved)
+            server_.shard(server_.shardForKey(entry.first)).store().unwatchKey(entry.first);
+    };
+
+    int fd = connectWithTimeout(args[1], port, static_cast<int>(timeoutMs));
+    if (fd < 0) {
+        unwatchMoved();
+        return "-IOERR error or timeout connecting to the client\r\n";
+    }
+    // Each reply of ASKING and RESTORE is a single status or error line
+    std::string response;
+    size_t sent = 0, lines = 0;
+    bool failed = false;
+    while (!failed && lines < expected) {
+        pollfd pfd{fd, static_cast<short>(sent < request.size() ? POLLIN | POLLOUT : POLLIN), 0};
+        if (poll(&pfd, 1, static_cast<int>(timeoutMs)) != 1) {
+            failed = true;
+            break;
+        }
+        if ((pfd.revents & POLLOUT) && sent < request.size()) {
+            ssize_t n = send(fd, request.data() + sent, request.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN) failed = true;
+            if (n > 0) sent += static_cast<size_t>(n);
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buf[4096];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0 && !(n < 0 && errno == EAGAIN)) failed = true;
+            if (n > 0) {
+                response.append(buf, static_cast<size_t>(n));
+                lines = std::count(response.begin(), response.end(), '\n');
+            }
+        }
+    }
+    close(fd);
+    if (failed) {
+        unwatchMoved();
+        return "-IOERR error or timeout reading to target instance\r\n";
+    }
+
+    std::istringstream replies(response);
+    std::string line;
+    while (std::getline(replies, line)) {
+        if (!line.empty() && line[0] == '-') {
+            unwatchMoved();
+            if (line.back() == '\r') line.pop_back();
+            return "-ERR Target instance replied with error: " + line.substr(1) + "\r\n";
+        }
+    }
+    size_t written = 0;
+    if (!copy) {
+        Replication& repl = server_.replication();
+        std::unique_lock<std::mutex> feedLock;
+        if (feedReplication_)
+            feedLock = std::unique_lock<std::mutex>(repl.writeMutex());
+        for (const auto& entry : moved) {
+            KVStore& store = server_.shard(server_.shardForKey(entry.first)).store();
+            auto lock = store.acquireLock();
+            // Written while the target was restoring it: the newer local value stays
+            if (store.keyVersion(entry.first) != entry.second) {
+                written++;
+                continue;
+            }
+            std::vector<std::string> del = {"DEL", entry.first};
+            CommandProcessor(store).execute(del);
+            if (feedLock.owns_lock()) repl.feed(del);
+        }
+    }
+    unwatchMoved();
+    if (written > 0)
+        return "-TRYAGAIN " + std::to_string(written) + " key(s) written during the migration were kept, migrate them again with REPLACE\r\n";
+    return "+OK\r\n";
+}
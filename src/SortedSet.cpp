@@ -0,0 +1,317 @@
+#include "../include/SortedSet.h"
+
+#include <algorithm>
+#include <random>
+
+static bool entryLess(double score, const std::string& member, double otherScore, const std::string& otherMember) {
+    return score < otherScore || (score == otherScore && member < otherMember);
+}
+
+static bool aboveMin(double score, const ScoreRange& range) {
+    return range.minExclusive ? score > range.min : score >= range.min;
+}
+
+static bool belowMax(double score, const ScoreRange& range) {
+    return range.maxExclusive ? score < range.max : score <= range.max;
+}
+
+//----------------------
+// SkipList
+//----------------------
+SkipList::SkipList() : tail_(nullptr), length_(0), level_(1) {
+    header_ = new Node{0, std::string(), nullptr, std::vector<Level>(kMaxLevel, Level{nullptr, 0})};
+}
+
+SkipList::~SkipList() {
+    Node* node = header_;
+    while (node) {
+        Node* next = node->levels[0].forward;
+        delete node;
+        node = next;
+    }
+}
+
+// Each level is kept with probability 1/4, as in Redis
+int SkipList::randomLevel() {
+    static thread_local std::mt19937 rng(std::random_device{}());
+    int level = 1;
+    while (level < kMaxLevel && (rng() & 3) == 0)
+        level++;
+    return level;
+}
+
+void SkipList::insert(double score, const std::string& member) {
+    Node* update[kMaxLevel];
+    size_t rank[kMaxLevel];
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        rank[i] = i == level_ - 1 ? 0 : rank[i + 1];
+        while (x->levels[i].forward &&
+               entryLess(x->levels[i].forward->score, x->levels[i].forward->member, score, member)) {
+            rank[i] += x->levels[i].span;
+            x = x->levels[i].forward;
+        }
+        update[i] = x;
+    }
+
+    int level = randomLevel();
+    if (level > level_) {
+        for (int i = level_; i < level; i++) {
+            rank[i] = 0;
+            update[i] = header_;
+            update[i]->levels[i].span = length_;
+        }
+        level_ = level;
+    }
+
+    x = new Node{score, member, nullptr, std::vector<Level>(level)};
+    for (int i = 0; i < level; i++) {
+        x->levels[i].forward = update[i]->levels[i].forward;
+        update[i]->levels[i].forward = x;
+        // update[i] now skips to x, x takes over the remainder of its span
+        x->levels[i].span = update[i]->levels[i].span - (rank[0] - rank[i]);
+        update[i]->levels[i].span = (rank[0] - rank[i]) + 1;
+    }
+    for (int i = level; i < level_; i++)
+        update[i]->levels[i].span++;
+
+    x->backward = update[0] == header_ ? nullptr : update[0];
+    if (x->levels[0].forward)
+        x->levels[0].forward->backward = x;
+    else
+        tail_ = x;
+    length_++;
+}
+
+bool SkipList::remove(double score, const std::string& member) {
+    Node* update[kMaxLevel];
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels[i].forward &&
+               entryLess(x->levels[i].forward->score, x->levels[i].forward->member, score, member))
+            x = x->levels[i].forward;
+        update[i] = x;
+    }
+    x = x->levels[0].forward;
+    if (!x || x->score != score || x->member != member)
+        return false;
+
+    for (int i = 0; i < level_; i++) {
+        if (update[i]->levels[i].forward == x) {
+            update[i]->levels[i].span += x->levels[i].span - 1;
+            update[i]->levels[i].forward = x->levels[i].forward;
+        } else {
+            update[i]->levels[i].span--;
+        }
+    }
+    if (x->levels[0].forward)
+        x->levels[0].forward->backward = x->backward;
+    else
+        tail_ = x->backward;
+    while (level_ > 1 && !header_->levels[level_ - 1].forward)
+        level_--;
+    length_--;
+    delete x;
+    return true;
+}
+
+size_t SkipList::rank(double score, const std::string& member) const {
+    size_t traversed = 0;
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels[i].forward &&
+               !entryLess(score, member, x->levels[i].forward->score, x->levels[i].forward->member)) {
+            traversed += x->levels[i].span;
+            x = x->levels[i].forward;
+        }
+        if (x != header_ && x->score == score && x->member == member)
+            return traversed - 1;
+    }
+    return traversed - 1;
+}
+
+SkipList::Node* SkipList::nodeByRank(size_t rank) const {
+    size_t traversed = 0;
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels[i].forward && traversed + x->levels[i].span <= rank) {
+            traversed += x->levels[i].span;
+            x = x->levels[i].forward;
+        }
+        if (traversed == rank) return x;
+    }
+    return nullptr;
+}
+
+void SkipList::rangeByRank(size_t start, size_t count, bool reverse, std::vector<ScoredMember>& out) const {
+    if (count == 0 || start >= length_) return;
+    Node* x = nodeByRank(reverse ? length_ - start : start + 1);
+    for (; x && count > 0; count--) {
+        out.push_back(ScoredMember{x->score, x->member});
+        x = reverse ? x->backward : x->levels[0].forward;
+    }
+}
+
+size_t SkipList::countBelow(const ScoreRange& range) const {
+    size_t traversed = 0;
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels[i].forward && !aboveMin(x->levels[i].forward->score, range)) {
+            traversed += x->levels[i].span;
+            x = x->levels[i].forward;
+        }
+    }
+    return traversed;
+}
+
+size_t SkipList::countUpTo(const ScoreRange& range) const {
+    size_t traversed = 0;
+    Node* x = header_;
+    for (int i = level_ - 1; i >= 0; i--) {
+        while (x->levels[i].forward && belowMax(x->levels[i].forward->score, range)) {
+            traversed += x->levels[i].span;
+            x = x->levels[i].forward;
+        }
+    }
+    return traversed;
+}
+
+//----------------------
+// SortedSet
+//----------------------
+size_t SortedSet::size() const {
+    return list_ ? list_->size() : compact_.size();
+}
+
+bool SortedSet::score(const std::string& member, double& score) const {
+    if (list_) {
+        auto it = dict_.find(member);
+        if (it == dict_.end()) return false;
+        score = it->second;
+        return true;
+    }
+    for (const auto& entry : compact_) {
+        if (entry.member == member) {
+            score = entry.score;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool SortedSet::set(const std::string& member, double score) {
+    if (!list_) {
+        auto it = std::find_if(compact_.begin(), compact_.end(),
+                               [&](const ScoredMember& entry) { return entry.member == member; });
+        if (it != compact_.end()) {
+            if (it->score == score) return false;
+            compact_.erase(it);
+        } else if (compact_.size() >= kMaxCompactEntries || member.size() > kMaxCompactMember) {
+            convert();
+        }
+    }
+    if (!list_) {
+        auto pos = std::lower_bound(compact_.begin(), compact_.end(), score,
+                                    [&](const ScoredMember& entry, double) {
+                                        return entryLess(entry.score, entry.member, score, member);
+                                    });
+        compact_.insert(pos, ScoredMember{score, member});
+        return true;
+    }
+
+    auto it = dict_.find(member);
+    if (it != dict_.end()) {
+        if (it->second == score) return false;
+        list_->remove(it->second, member);
+        it->second = score;
+    } else {
+        dict_.emplace(member, score);
+    }
+    list_->insert(score, member);
+    return true;
+}
+
+bool SortedSet::remove(const std::string& member) {
+    if (list_) {
+        auto it = dict_.find(member);
+        if (it == dict_.end()) return false;
+        list_->remove(it->second, member);
+        dict_.erase(it);
+        return true;
+    }
+    auto it = std::find_if(compact_.begin(), compact_.end(),
+                           [&](const ScoredMember& entry) { return entry.member == member; });
+    if (it == compact_.end()) return false;
+    compact_.erase(it);
+    return true;
+}
+
+long SortedSet::rank(const std::string& member, bool reverse) const {
+    long index = -1;
+    if (list_) {
+        auto it = dict_.find(member);
+        if (it == dict_.end()) return -1;
+        index = static_cast<long>(list_->rank(it->second, member));
+    } else {
+        for (size_t i = 0; i < compact_.size(); i++) {
+            if (compact_[i].member == member) {
+                index = static_cast<long>(i);
+                break;
+            }
+        }
+        if (index < 0) return -1;
+    }
+    return reverse ? static_cast<long>(size()) - 1 - index : index;
+}
+
+std::vector<ScoredMember> SortedSet::rangeByRank(size_t start, size_t stop, bool reverse) const {
+    std::vector<ScoredMember> out;
+    if (start > stop || start >= size()) return out;
+    size_t count = std::min(stop, size() - 1) - start + 1;
+    out.reserve(count);
+    if (list_) {
+        list_->rangeByRank(start, count, reverse, out);
+    } else if (!reverse) {
+        out.assign(compact_.begin() + start, compact_.begin() + start + count);
+    } else {
+        for (size_t i = 0; i < count; i++)
+            out.push_back(compact_[compact_.size() - 1 - start - i]);
+    }
+    return out;
+}
+
+// Members in range occupy ascending ranks [lo, hi); LIMIT skips ranks instead of nodes
+std::vector<ScoredMember> SortedSet::rangeByScore(const ScoreRange& range, bool reverse, size_t offset, long count) const {
+    size_t lo, hi;
+    if (list_) {
+        lo = list_->countBelow(range);
+        hi = list_->countUpTo(range);
+    } else {
+        lo = std::partition_point(compact_.begin(), compact_.end(),
+                                  [&](const ScoredMember& entry) { return !aboveMin(entry.score, range); }) - compact_.begin();
+        hi = std::partition_point(compact_.begin(), compact_.end(),
+                                  [&](const ScoredMember& entry) { return belowMax(entry.score, range); }) - compact_.begin();
+    }
+    if (hi <= lo || offset >= hi - lo || count == 0) return {};
+    size_t take = hi - lo - offset;
+    if (count > 0) take = std::min(take, static_cast<size_t>(count));
+
+    size_t start = reverse ? size() - hi + offset : lo + offset;
+    return rangeByRank(start, start + take - 1, reverse);
+}
+
+std::vector<ScoredMember> SortedSet::entries() const {
+    if (!list_) return compact_;
+    return size() ? rangeByRank(0, size() - 1, false) : std::vector<ScoredMember>();
+}
+
+void SortedSet::convert() {
+    list_.reset(new SkipList());
+    dict_.reserve(compact_.size() * 2);
+    for (const auto& entry : compact_) {
+        list_->insert(entry.score, entry.member);
+        dict_.emplace(entry.member, entry.score);
+    }
+    compact_.clear();
+    compact_.shrink_to_fit();
+}
@@ -0,0 +1,70 @@
+#include "../include/Tracking.h"
+
+#include <algorithm>
+#include <set>
+
+void TrackingTable::track(const std::string& key, const Tracker& tracker, std::vector<Invalidation>& out) {
+    auto it = keys_.find(key);
+    if (it == keys_.end()) {
+        // Make room first so the key just read is not the one pushed out
+        while (maxKeys_ > 0 && keys_.size() >= maxKeys_)
+            evictRandomKey(out);
+        it = keys_.emplace(key, std::vector<Tracker>()).first;
+    }
+    auto& readers = it->second;
+    if (std::find(readers.begin(), readers.end(), tracker) == readers.end())
+        readers.push_back(tracker);
+}
+
+void TrackingTable::invalidate(const std::string& key, std::vector<Invalidation>& out) {
+    auto it = keys_.find(key);
+    if (it != keys_.end()) {
+        for (const auto& tracker : it->second)
+            out.push_back({tracker, key, false});
+        keys_.erase(it);
+    }
+    // One message per target even if several of its prefixes match
+    size_t first = out.size();
+    for (const auto& entry : prefixes_) {
+        if (key.compare(0, entry.prefix.size(), entry.prefix) != 0) continue;
+        bool queued = false;
+        for (size_t i = first; i < out.size() && !queued; i++)
+            queued = out[i].target == entry.target;
+        if (!queued) out.push_back({entry.target, key, false});
+    }
+}
+
+void TrackingTable::invalidateAll(std::vector<Invalidation>& out) {
+    std::set<std::pair<int, uint64_t>> targets;
+    for (const auto& entry : keys_) {
+        for (const auto& tracker : entry.second)
+            targets.emplace(tracker.shard, tracker.clientId);
+    }
+    for (const auto& entry : prefixes_)
+        targets.emplace(entry.target.shard, entry.target.clientId);
+    for (const auto& target : targets)
+        out.push_back({Tracker{target.second, target.first}, std::string(), true});
+    keys_.clear();
+}
+
+void TrackingTable::addPrefix(uint64_t owner, const Tracker& target, const std::string& prefix) {
+    prefixes_.push_back({prefix, owner, target});
+}
+
+void TrackingTable::removePrefixes(uint64_t owner) {
+    prefixes_.erase(std::remove_if(prefixes_.begin(), prefixes_.end(),
+                                   [owner](const PrefixEntry& entry) { return entry.owner == owner; }),
+                    prefixes_.end());
+}
+
+// Start at a random bucket and take the first key found, as Redis picks a random key
+void TrackingTable::evictRandomKey(std::vector<Invalidation>& out) {
+    size_t buckets = keys_.bucket_count();
+    size_t bucket = rng_() % buckets;
+    while (keys_.bucket_size(bucket) == 0)
+        bucket = (bucket + 1) % buckets;
+    auto it = keys_.find(keys_.begin(bucket)->first);
+    for (const auto& tracker : it->second)
+        out.push_back({tracker, it->first, false});
+    keys_.erase(it);
+}
@@ -0,0 +1,161 @@
+#include "../include/TrafficCapture.h"
+
+static const char kCaptureMagic[4] = {'K', 'V', 'C', 'P'};
+static const char kCaptureVersion = 1;
+// Records a shard buffers before writing them out
+static const size_t kBlockSize = 64 * 1024;
+
+static void putVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool getVarint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF) return false;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+TrafficCapture::TrafficCapture(int shards)
+    : active_(false), maxBytes_(0), bytesWritten_(0), recordsWritten_(0), truncated_(false) {
+    for (int i = 0; i < shards; i++)
+        buffers_.emplace_back(new ShardBuffer());
+}
+
+TrafficCapture::~TrafficCapture() {
+    stop();
+}
+
+bool TrafficCapture::start(const std::string& path, uint64_t maxBytes) {
+    if (active_) return false;
+    // Left over from a capture that hit its size limit
+    for (auto& buffer : buffers_) {
+        std::lock_guard<std::mutex> guard(buffer->mutex);
+        buffer->data.clear();
+        buffer->records = 0;
+    }
+    std::lock_guard<std::mutex> guard(fileMutex_);
+    if (active_) return false;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) return false;
+
+    auto wallClock = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::string header(kCaptureMagic, sizeof(kCaptureMagic));
+    header.push_back(kCaptureVersion);
+    for (int i = 0; i < 8; i++)
+        header.push_back(static_cast<char>(static_cast<uint64_t>(wallClock) >> (8 * i)));
+    file.write(header.data(), header.size());
+    if (!file) return false;
+
+    file_ = std::move(file);
+    path_ = path;
+    maxBytes_ = maxBytes;
+    bytesWritten_ = header.size();
+    recordsWritten_ = 0;
+    truncated_ = false;
+    startedAt_ = std::chrono::steady_clock::now();
+    active_ = true;
+    return true;
+}
+
+void TrafficCapture::stop() {
+    active_ = false;
+    // No record is appended once a shard's mutex was taken after clearing active_
+    for (auto& buffer : buffers_) {
+        std::lock_guard<std::mutex> guard(buffer->mutex);
+        writeBuffer(*buffer);
+    }
+    std::lock_guard<std::mutex> guard(fileMutex_);
+    if (file_.is_open()) file_.close();
+}
+
+void TrafficCapture::record(int shard, uint64_t clientId, const std::vector<std::string>& args) {
+    ShardBuffer& buffer = *buffers_[shard];
+    std::lock_guard<std::mutex> guard(buffer.mutex);
+    if (!active_) return;
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - startedAt_).count();
+    putVarint(buffer.data, static_cast<uint64_t>(micros));
+    putVarint(buffer.data, clientId);
+    putVarint(buffer.data, args.size());
+    for (const auto& arg : args) {
+        putVarint(buffer.data, arg.size());
+        buffer.data += arg;
+    }
+    buffer.records++;
+    if (buffer.data.size() >= kBlockSize)
+        writeBuffer(buffer);
+}
+
+void TrafficCapture::flush(int shard) {
+    if (!active_) return;
+    ShardBuffer& buffer = *buffers_[shard];
+    std::lock_guard<std::mutex> guard(buffer.mutex);
+    writeBuffer(buffer);
+}
+
+// Caller holds buffer.mutex
+void TrafficCapture::writeBuffer(ShardBuffer& buffer) {
+    if (buffer.data.empty()) return;
+    std::lock_guard<std::mutex> guard(fileMutex_);
+    if (file_.is_open() && !truncated_) {
+        file_.write(buffer.data.data(), buffer.data.size());
+        file_.flush();
+        bytesWritten_ += buffer.data.size();
+        recordsWritten_ += buffer.records;
+        // The file is closed by the next stop(); shards stop appending right away
+        if (!file_ || (maxBytes_ > 0 && bytesWritten_ >= maxBytes_)) {
+            truncated_ = true;
+            active_ = false;
+        }
+    }
+    buffer.data.clear();
+    buffer.records = 0;
+}
+
+std::string TrafficCapture::status() {
+    std::lock_guard<std::mutex> guard(fileMutex_);
+    std::string state = active_ ? "recording" : truncated_ ? "stopped at size limit" : "stopped";
+    return "state=" + state + " path=" + path_ + " records=" + std::to_string(recordsWritten_) +
+           " bytes=" + std::to_string(bytesWritten_);
+}
+
+//----------------------
+// Reading
+//----------------------
+bool CaptureReader::open(const std::string& path) {
+    in_.open(path, std::ios::binary);
+    char header[sizeof(kCaptureMagic) + 1 + 8];
+    if (!in_ || !in_.read(header, sizeof(header))) return false;
+    if (std::string(header, sizeof(kCaptureMagic)) != std::string(kCaptureMagic, sizeof(kCaptureMagic)) ||
+        header[sizeof(kCaptureMagic)] != kCaptureVersion)
+        return false;
+    startTime_ = 0;
+    for (int i = 0; i < 8; i++)
+        startTime_ |= static_cast<uint64_t>(static_cast<unsigned char>(header[sizeof(kCaptureMagic) + 1 + i])) << (8 * i);
+    return true;
+}
+
+bool CaptureReader::next(CapturedCommand& command) {
+    uint64_t argc;
+    if (!getVarint(in_, command.micros) || !getVarint(in_, command.clientId) || !getVarint(in_, argc))
+        return false;
+    command.args.clear();
+    for (uint64_t i = 0; i < argc; i++) {
+        uint64_t len;
+        if (!getVarint(in_, len) || len > (uint64_t(1) << 32)) return false;
+        std::string arg(len, '\0');
+        if (len > 0 && !in_.read(&arg[0], len)) return false;
+        command.args.push_back(std::move(arg));
+    }
+    return true;
+}
@@ -0,0 +1,469 @@
+#include "../include/UringBackend.h"
+#include "../include/Shard.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Operation encoded in the top byte of user_data, client id in the rest
+enum UringOp : uint64_t { OP_ACCEPT = 1, OP_WAKEUP = 2, OP_RECV = 3, OP_SEND = 4 };
+static const int kOpShift = 56;
+static const size_t kMaxIov = 64;
+static const uint64_t kIdMask = (1ULL << kOpShift) - 1;
+
+static const unsigned kQueueDepth = 1024;
+static const unsigned kBufCount = 512;        // must be a power of two
+static const size_t kBufSize = 8 * 1024;
+static const unsigned short kBufGroup = 0;
+static const unsigned kSlabCount = 64;
+static const size_t kSlabSize = 16 * 1024;
+
+static uint64_t encodeOp(UringOp op, uint64_t id) {
+    return (static_cast<uint64_t>(op) << kOpShift) | (id & kIdMask);
+}
+
+UringBackend::UringBackend(IoHandler& handler, bool registeredBuffers)
+    : handler_(handler), useRegisteredBuffers_(registeredBuffers), ringFd_(-1),
+      listenFd_(-1), wakeupFd_(-1), wakeupValue_(0),
+      sqRing_(nullptr), sqRingSize_(0), sqHead_(nullptr), sqTail_(nullptr), sqMask_(0),
+      sqEntries_(0), sqLocalTail_(0), sqes_(nullptr), sqesSize_(0),
+      cqRing_(nullptr), cqRingSize_(0), cqHead_(nullptr), cqTail_(nullptr), cqMask_(0), cqes_(nullptr),
+      bufRing_(nullptr), bufRingSize_(0), bufPool_(nullptr), bufTail_(0), slabPool_(nullptr) {}
+
+UringBackend::~UringBackend() {
+    for (auto& entry : conns_)
+        close(entry.second.fd);
+    if (ringFd_ != -1) close(ringFd_);
+    if (sqes_) munmap(sqes_, sqesSize_);
+    if (cqRing_ && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+    if (sqRing_) munmap(sqRing_, sqRingSize_);
+    if (bufRing_) munmap(bufRing_, bufRingSize_);
+    if (bufPool_) munmap(bufPool_, kBufCount * kBufSize);
+    if (slabPool_) munmap(slabPool_, kSlabCount * kSlabSize);
+}
+
+bool UringBackend::init(int listenFd, int wakeupFd) {
+    listenFd_ = listenFd;
+    wakeupFd_ = wakeupFd;
+    if (!setupRing() || !setupBufferRing()) return false;
+    if (useRegisteredBuffers_)
+        setupRegisteredBuffers();
+    armAccept();
+    armWakeup();
+    return true;
+}
+
+bool UringBackend::setupRing() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = kQueueDepth * 4;
+    ringFd_ = syscall(__NR_io_uring_setup, kQueueDepth, &params);
+    if (ringFd_ < 0) {
+        // Older kernels reject the optimisation flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = kQueueDepth * 4;
+        ringFd_ = syscall(__NR_io_uring_setup, kQueueDepth, &params);
+    }
+    if (ringFd_ < 0) return false;
+
+    // Waiting with a timeout relies on IORING_ENTER_EXT_ARG
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+        return false;
+
+    // Multishot recv arrived together with IORING_OP_SEND_ZC (Linux 6.0)
+    size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    std::vector<char> probeBuf(probeSize, 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probeBuf.data());
+    if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE, probe, 256) < 0)
+        return false;
+    if (probe->last_op < IORING_OP_SEND_ZC || !(probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+        return false;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        sqRing_ = nullptr;
+        return false;
+    }
+    if (singleMmap) {
+        cqRing_ = sqRing_;
+    } else {
+        cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            cqRing_ = nullptr;
+            return false;
+        }
+    }
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sqRing_);
+    sqHead_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries_ = params.sq_entries;
+    sqLocalTail_ = *sqTail_;
+    // Slots map one-to-one onto SQEs, so the indirection array is filled once
+    unsigned* sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < sqEntries_; i++)
+        sqArray[i] = i;
+
+    char* cq = static_cast<char*>(cqRing_);
+    cqHead_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+bool UringBackend::setupBufferRing() {
+    bufRingSize_ = kBufCount * sizeof(io_uring_buf);
+    void* ring = mmap(nullptr, bufRingSize_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* pool = mmap(nullptr, kBufCount * kBufSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED || pool == MAP_FAILED) return false;
+    // io_uring_buf_ring's flexible array is misplaced when compiled as C++,
+    // so the entries are addressed directly; the tail overlays bufs[0].resv
+    bufRing_ = static_cast<io_uring_buf*>(ring);
+    bufPool_ = static_cast<char*>(pool);
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(bufRing_);
+    reg.ring_entries = kBufCount;
+    reg.bgid = kBufGroup;
+    if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+
+    for (unsigned i = 0; i < kBufCount; i++)
+        recycleBuffer(static_cast<unsigned short>(i));
+    return true;
+}
+
+void UringBackend::setupRegisteredBuffers() {
+    void* pool = mmap(nullptr, kSlabCount * kSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+        useRegisteredBuffers_ = false;
+        return;
+    }
+    slabPool_ = static_cast<char*>(pool);
+    std::vector<iovec> iovecs(kSlabCount);
+    for (unsigned i = 0; i < kSlabCount; i++) {
+        iovecs[i].iov_base = slabPool_ + i * kSlabSize;
+        iovecs[i].iov_len = kSlabSize;
+    }
+    if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iovecs.data(), kSlabCount) < 0) {
+        std::cerr << "io_uring: buffer registration failed, sending from heap buffers\n";
+        useRegisteredBuffers_ = false;
+        return;
+    }
+    for (int i = kSlabCount - 1; i >= 0; i--)
+        freeSlabs_.push_back(i);
+}
+
+// Hand a receive buffer back to the kernel
+void UringBackend::recycleBuffer(unsigned short bid) {
+    io_uring_buf* buf = &bufRing_[bufTail_ & (kBufCount - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(bufPool_ + bid * kBufSize);
+    buf->len = kBufSize;
+    buf->bid = bid;
+    bufTail_++;
+    __atomic_store_n(&bufRing_[0].resv, bufTail_, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe* UringBackend::getSqe() {
+    unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+    if (sqLocalTail_ - head >= sqEntries_) {
+        // Queue full: submit what we have without waiting
+        enter(0, 0);
+        head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+        if (sqLocalTail_ - head >= sqEntries_) return nullptr;
+    }
+    io_uring_sqe* sqe = &sqes_[sqLocalTail_ & sqMask_];
+    memset(sqe, 0, sizeof(*sqe));
+    sqLocalTail_++;
+    return sqe;
+}
+
+// Submit all queued SQEs and optionally wait for completions, in one syscall
+void UringBackend::enter(unsigned minComplete, int timeoutMs) {
+    __atomic_store_n(sqTail_, sqLocalTail_, __ATOMIC_RELEASE);
+    unsigned toSubmit = sqLocalTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+
+    __kernel_timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = static_cast<long long>(timeoutMs % 1000) * 1000000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    int ret = syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags, &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+}
+
+void UringBackend::poll(int timeoutMs) {
+    bool completionsReady = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE) != *cqHead_;
+    enter(completionsReady || timeoutMs == 0 ? 0 : 1, timeoutMs);
+    reap();
+}
+
+void UringBackend::reap() {
+    unsigned head = *cqHead_;
+    unsigned tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        const io_uring_cqe& cqe = cqes_[head & cqMask_];
+        uint64_t userData = cqe.user_data;
+        int res = cqe.res;
+        unsigned cqeFlags = cqe.flags;
+        head++;
+        __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+
+        uint64_t op = userData >> kOpShift;
+        uint64_t id = userData & kIdMask;
+        bool more = cqeFlags & IORING_CQE_F_MORE;
+
+        if (op == OP_ACCEPT) {
+            if (res >= 0)
+                handler_.onAccept(res);
+            if (!more) armAccept();
+            continue;
+        }
+        if (op == OP_WAKEUP) {
+            armWakeup();
+            continue;
+        }
+
+        auto it = conns_.find(id);
+        if (it == conns_.end()) continue;
+
+        if (op == OP_RECV) {
+            if (!more) it->second.pendingOps--;
+            if (res > 0 && (cqeFlags & IORING_CQE_F_BUFFER)) {
+                unsigned short bid = cqeFlags >> IORING_CQE_BUFFER_SHIFT;
+                if (!it->second.closing)
+                    handler_.onData(id, bufPool_ + bid * kBufSize, res);
+                recycleBuffer(bid);
+            }
+            // The handler may have closed the client or added others
+            it = conns_.find(id);
+            if (it == conns_.end()) continue;
+            if (res == 0 || (res < 0 && res != -ENOBUFS)) {
+                if (!it->second.closing)
+                    handler_.onClosed(id);
+            } else if (!more && !it->second.closing) {
+                armRecv(id, it->second);
+            }
+        } else if (op == OP_SEND) {
+            Connection& conn = it->second;
+            conn.pendingOps--;
+            conn.sending = false;
+            if (conn.slab >= 0) {
+                freeSlabs_.push_back(conn.slab);
+                conn.slab = -1;
+            }
+            if (res < 0) {
+                if (!conn.closing)
+                    handler_.onClosed(id);
+            } else if (!conn.sendQueue.empty()) {
+                size_t sent = res;
+                while (sent > 0 && !conn.sendQueue.empty()) {
+                    size_t left = conn.sendQueue.front()->size() - conn.sendQueuePos;
+                    if (sent < left) {
+                        conn.sendQueuePos += sent;
+                        break;
+                    }
+                    sent -= left;
+                    conn.sendQueue.pop_front();
+                    conn.sendQueuePos = 0;
+                }
+                if (!conn.sendQueue.empty())
+                    submitSend(id, conn);
+                else if (!conn.closing)
+                    handler_.onWritable(id);
+            } else {
+                conn.sendPos += res;
+                if (conn.sendPos < conn.sendBuf.size()) {
+                    submitSend(id, conn);
+                } else {
+                    conn.sendBuf.clear();
+                    conn.sendPos = 0;
+                    if (!conn.closing)
+                        handler_.onWritable(id);
+                }
+            }
+        }
+        release(id);
+    }
+}
+
+void UringBackend::armAccept() {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenFd_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = encodeOp(OP_ACCEPT, 0);
+}
+
+void UringBackend::armWakeup() {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeupFd_;
+    sqe->addr = reinterpret_cast<uint64_t>(&wakeupValue_);
+    sqe->len = sizeof(wakeupValue_);
+    sqe->user_data = encodeOp(OP_WAKEUP, 0);
+}
+
+void UringBackend::armRecv(uint64_t id, Connection& conn) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+    sqe->user_data = encodeOp(OP_RECV, id);
+    conn.pendingOps++;
+}
+
+void UringBackend::submitSend(uint64_t id, Connection& conn) {
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe) return;  // retried by the next flush
+    if (!conn.sendQueue.empty()) {
+        // Shared buffers go out in place through one gathered sendmsg
+        conn.iov.clear();
+        for (const auto& buf : conn.sendQueue) {
+            if (conn.iov.size() == kMaxIov) break;
+            size_t skip = conn.iov.empty() ? conn.sendQueuePos : 0;
+            conn.iov.push_back({const_cast<char*>(buf->data() + skip), buf->size() - skip});
+        }
+        conn.msg = msghdr{};
+        conn.msg.msg_iov = conn.iov.data();
+        conn.msg.msg_iovlen = conn.iov.size();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = conn.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&conn.msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = encodeOp(OP_SEND, id);
+        conn.sending = true;
+        conn.pendingOps++;
+        return;
+    }
+    const char* data = conn.sendBuf.data() + conn.sendPos;
+    size_t len = conn.sendBuf.size() - conn.sendPos;
+    if (useRegisteredBuffers_ && len <= kSlabSize && !freeSlabs_.empty()) {
+        // Small replies go out of pre-registered memory, skipping per-send page pinning
+        conn.slab = freeSlabs_.back();
+        freeSlabs_.pop_back();
+        char* slab = slabPool_ + conn.slab * kSlabSize;
+        memcpy(slab, data, len);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = reinterpret_cast<uint64_t>(slab);
+        sqe->buf_index = static_cast<uint16_t>(conn.slab);
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd = conn.fd;
+    sqe->len = static_cast<uint32_t>(std::min<size_t>(len, 1U << 30));
+    sqe->user_data = encodeOp(OP_SEND, id);
+    conn.sending = true;
+    conn.pendingOps++;
+}
+
+void UringBackend::addClient(Client& client) {
+    Connection& conn = conns_[client.id];
+    conn.fd = client.fd;
+    armRecv(client.id, conn);
+}
+
+void UringBackend::removeClient(Client& client) {
+    auto it = conns_.find(client.id);
+    if (it == conns_.end()) {
+        close(client.fd);
+        return;
+    }
+    // In-flight operations complete with errors once the socket is shut down
+    it->second.closing = true;
+    shutdown(it->second.fd, SHUT_RDWR);
+    release(client.id);
+}
+
+// Close a shut-down connection once the kernel no longer references it
+void UringBackend::release(uint64_t id) {
+    auto it = conns_.find(id);
+    if (it == conns_.end() || !it->second.closing || it->second.pendingOps > 0) return;
+    if (it->second.slab >= 0)
+        freeSlabs_.push_back(it->second.slab);
+    close(it->second.fd);
+    conns_.erase(it);
+}
+
+FlushResult UringBackend::flush(Client& client) {
+    auto it = conns_.find(client.id);
+    if (it == conns_.end()) return FlushResult::Failed;
+    Connection& conn = it->second;
+    if (conn.sending) return FlushResult::Pending;
+    if (!conn.sendQueue.empty() || conn.sendPos < conn.sendBuf.size()) {
+        submitSend(client.id, conn);
+        return FlushResult::Pending;
+    }
+    if (client.pendingOutput() == 0) {
+        client.outBuf.clear();
+        client.outPos = 0;
+        return FlushResult::Drained;
+    }
+
+    if (!client.outQueue.empty()) {
+        // Shared buffers change hands by reference; private bytes follow them
+        conn.sendQueue.swap(client.outQueue);
+        conn.sendQueuePos = client.outQueuePos;
+        client.outQueuePos = 0;
+        client.outQueueBytes = 0;
+        if (client.outPos < client.outBuf.size()) {
+            if (client.outPos == 0)
+                conn.sendQueue.push_back(std::make_shared<const std::string>(std::move(client.outBuf)));
+            else
+                conn.sendQueue.push_back(std::make_shared<const std::string>(client.outBuf, client.outPos));
+        }
+        client.outBuf.clear();
+        client.outPos = 0;
+        submitSend(client.id, conn);
+        return FlushResult::Pending;
+    }
+
+    // Take ownership of the pending output; new replies accumulate in a fresh buffer
+    if (client.outPos == 0)
+        conn.sendBuf.swap(client.outBuf);
+    else
+        conn.sendBuf.assign(client.outBuf, client.outPos, std::string::npos);
+    conn.sendPos = 0;
+    client.outBuf.clear();
+    client.outPos = 0;
+    submitSend(client.id, conn);
+    return FlushResult::Pending;
+}
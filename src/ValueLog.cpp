@@ -0,0 +1,215 @@
+#include "../include/ValueLog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Logs smaller than this are never compacted
+static const uint64_t kMinCompactBytes = 32 * 1024 * 1024;
+// Values larger than this fraction of the cache are not cached
+static const size_t kMaxCachedShare = 8;
+
+static bool writeAll(int fd, const char* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static bool readAll(int fd, char* data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// Values do not outlive the process: the file is unlinked right away and
+// its space returns to the file system when the descriptor is closed, even on a crash
+static int openUnlinked(const std::string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) unlink(path.c_str());
+    return fd;
+}
+
+ValueLog::ValueLog(const std::string& path, size_t cacheBytes)
+    : path_(path), map_(nullptr), mapSize_(0), end_(0), liveBytes_(0), nextHandle_(0),
+      cacheLimit_(cacheBytes), cacheBytes_(0), compacting_(false), compactAfter_(0) {
+    fd_ = openUnlinked(path_);
+    if (fd_ < 0)
+        std::cerr << "Cannot open value log " << path_ << ": " << strerror(errno) << "\n";
+}
+
+ValueLog::~ValueLog() {
+    if (compactor_.joinable()) compactor_.join();
+    if (map_) munmap(map_, mapSize_);
+    if (fd_ != -1) close(fd_);
+}
+
+uint64_t ValueLog::append(const std::string& value) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (fd_ == -1 || value.size() > UINT32_MAX) return 0;
+    if (!writeAll(fd_, value.data(), value.size(), end_)) return 0;
+    uint64_t handle = ++nextHandle_;
+    index_[handle] = Location{end_, static_cast<uint32_t>(value.size())};
+    end_ += value.size();
+    liveBytes_ += value.size();
+    return handle;
+}
+
+// Map the whole file; called under the mutex when a read goes past the current mapping
+bool ValueLog::mapFile() {
+    if (map_) munmap(map_, mapSize_);
+    map_ = nullptr;
+    mapSize_ = 0;
+    if (end_ == 0) return true;
+    void* addr = mmap(nullptr, end_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (addr == MAP_FAILED) return false;
+    map_ = static_cast<char*>(addr);
+    mapSize_ = end_;
+    return true;
+}
+
+bool ValueLog::read(uint64_t handle, std::string& value) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto cached = cache_.find(handle);
+    if (cached != cache_.end()) {
+        cacheOrder_.splice(cacheOrder_.begin(), cacheOrder_, cached->second);
+        value = cached->second->second;
+        return true;
+    }
+    auto it = index_.find(handle);
+    if (it == index_.end()) return false;
+    const Location& loc = it->second;
+    if (loc.offset + loc.length > mapSize_ && !mapFile()) return false;
+    value.assign(map_ + loc.offset, loc.length);
+    cacheValue(handle, value);
+    return true;
+}
+
+void ValueLog::cacheValue(uint64_t handle, const std::string& value) {
+    if (value.size() > cacheLimit_ / kMaxCachedShare) return;
+    cacheOrder_.emplace_front(handle, value);
+    cache_[handle] = cacheOrder_.begin();
+    cacheBytes_ += value.size();
+    while (cacheBytes_ > cacheLimit_) {
+        cacheBytes_ -= cacheOrder_.back().second.size();
+        cache_.erase(cacheOrder_.back().first);
+        cacheOrder_.pop_back();
+    }
+}
+
+void ValueLog::uncache(uint64_t handle) {
+    auto cached = cache_.find(handle);
+    if (cached == cache_.end()) return;
+    cacheBytes_ -= cached->second->second.size();
+    cacheOrder_.erase(cached->second);
+    cache_.erase(cached);
+}
+
+void ValueLog::release(uint64_t handle) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = index_.find(handle);
+    if (it == index_.end()) return;
+    liveBytes_ -= it->second.length;
+    index_.erase(it);
+    uncache(handle);
+    maybeCompact();
+}
+
+void ValueLog::clear() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    index_.clear();
+    cache_.clear();
+    cacheOrder_.clear();
+    cacheBytes_ = 0;
+    liveBytes_ = 0;
+    maybeCompact();
+}
+
+// Called under the mutex after values were released
+void ValueLog::maybeCompact() {
+    if (compacting_ || end_ < std::max(kMinCompactBytes, compactAfter_) || liveBytes_ * 2 >= end_) return;
+    compacting_ = true;
+    // A previous compactor has already finished its work
+    if (compactor_.joinable()) compactor_.join();
+    compactor_ = std::thread([this]() { compact(); });
+}
+
+/*
+ * Copy the values that were live when compaction started into a new file,
+ * without holding the mutex, then under the mutex copy what was appended in
+ * the meantime, repoint the handles still live and swap the files.
+ */
+void ValueLog::compact() {
+    std::vector<std::pair<uint64_t, Location>> live;
+    uint64_t lastHandle;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        live.assign(index_.begin(), index_.end());
+        lastHandle = nextHandle_;
+    }
+    std::sort(live.begin(), live.end(), [](const std::pair<uint64_t, Location>& a,
+                                           const std::pair<uint64_t, Location>& b) {
+        return a.second.offset < b.second.offset;
+    });
+
+    int newFd = openUnlinked(path_ + ".compact");
+    bool ok = newFd >= 0;
+    uint64_t newEnd = 0;
+    std::unordered_map<uint64_t, Location> moved;
+    std::string buf;
+    // The old file is only appended to meanwhile, copied ranges stay valid
+    for (size_t i = 0; ok && i < live.size(); i++) {
+        const Location& loc = live[i].second;
+        buf.resize(loc.length);
+        ok = readAll(fd_, &buf[0], loc.length, loc.offset) && writeAll(newFd, buf.data(), loc.length, newEnd);
+        moved[live[i].first] = Location{newEnd, loc.length};
+        newEnd += loc.length;
+    }
+
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (const auto& entry : index_) {
+        if (!ok) break;
+        if (entry.first <= lastHandle) continue;
+        const Location& loc = entry.second;
+        buf.resize(loc.length);
+        ok = readAll(fd_, &buf[0], loc.length, loc.offset) && writeAll(newFd, buf.data(), loc.length, newEnd);
+        moved[entry.first] = Location{newEnd, loc.length};
+        newEnd += loc.length;
+    }
+    if (!ok) {
+        // Keep using the old file; the garbage ratio is unchanged, so retrying at
+        // once would fail again (e.g. on a full disk) until the log has grown
+        std::cerr << "Value log compaction failed: " << strerror(errno) << "\n";
+        if (newFd >= 0) close(newFd);
+        compactAfter_ = end_ + kMinCompactBytes;
+        compacting_ = false;
+        return;
+    }
+    for (auto& entry : index_)
+        entry.second = moved[entry.first];
+    if (map_) munmap(map_, mapSize_);
+    map_ = nullptr;
+    mapSize_ = 0;
+    close(fd_);
+    fd_ = newFd;
+    end_ = newEnd;
+    compactAfter_ = 0;
+    compacting_ = false;
+}
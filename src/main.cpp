@@ -1,32 +1,104 @@
 #include "../include/KVServer.h"
 #include "../include/KVStore.h"
+#include <algorithm>
 #include <iostream>
+#include <string>
 #include <thread>
 #include <chrono>
 
 int main(int argc, char* argv[]) {
-    int listenPort = 6379; // default Redis port
-    if (argc >= 2) listenPort = std::stoi(argv[1]); 
+    ServerConfig config; // default Redis port 6379
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            // 0 means one shard per available core
+            config.threads = std::stoi(argv[++i]);
+            if (config.threads <= 0)
+                config.threads = std::max(1u, std::thread::hardware_concurrency());
+        } else if (arg == "--io-backend" && i + 1 < argc) {
+            config.io.backend = argv[++i];
+        } else if (arg == "--io-registered-buffers") {
+            config.io.registeredBuffers = true;
+        } else if (arg == "--replicaof" && i + 2 < argc) {
+            config.replicaOfHost = argv[++i];
+            config.replicaOfPort = std::stoi(argv[++i]);
+        } else if (arg == "--repl-backlog-size" && i + 1 < argc) {
+            config.replBacklogSize = std::max(1L, std::stol(argv[++i]));
+        } else if (arg == "--pubsub-output-limit" && i + 1 < argc) {
+            config.outputLimits[CLIENT_PUBSUB].hard = std::stoul(argv[++i]);
+        } else if (arg == "--client-output-buffer-limit" && i + 4 < argc) {
+            // <normal|pubsub|replica> <hard bytes> <soft bytes> <soft seconds>
+            std::string cls = argv[++i];
+            int idx = cls == "normal" ? CLIENT_NORMAL : cls == "pubsub" ? CLIENT_PUBSUB :
+                      cls == "replica" ? CLIENT_REPLICA : -1;
+            OutputBufferLimit limit{std::stoul(argv[i + 1]), std::stoul(argv[i + 2]), std::stoi(argv[i + 3])};
+            i += 3;
+            if (idx < 0) {
+                std::cerr << "Unknown client class " << cls << "\n";
+                return 1;
+            }
+            config.outputLimits[idx] = limit;
+        } else if (arg == "--client-query-buffer-limit" && i + 1 < argc) {
+            config.maxQueryBuffer = std::stoul(argv[++i]);
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            config.idleTimeout = std::max(0, std::stoi(argv[++i]));
+        } else if (arg == "--lazyfree-threshold" && i + 1 < argc) {
+            config.lazyFreeThreshold = std::stoul(argv[++i]);
+        } else if (arg == "--tiered-storage" && i + 1 < argc) {
+            config.tieredPath = argv[++i];
+        } else if (arg == "--tiered-memory" && i + 1 < argc) {
+            config.tieredMemory = std::stoul(argv[++i]);
+        } else if (arg == "--tiered-min-value" && i + 1 < argc) {
+            config.tieredMinValue = std::stoul(argv[++i]);
+        } else if (arg == "--tiered-cache" && i + 1 < argc) {
+            config.tieredCache = std::stoul(argv[++i]);
+        } else if (arg == "--compression-threshold" && i + 1 < argc) {
+            config.compressionThreshold = std::stoul(argv[++i]);
+        } else if (arg == "--capture" && i + 1 < argc) {
+            config.capturePath = argv[++i];
+        } else if (arg == "--capture-max-bytes" && i + 1 < argc) {
+            config.captureMaxBytes = std::stoull(argv[++i]);
+        } else if (arg == "--tracking-table-max-keys" && i + 1 < argc) {
+            config.trackingTableMaxKeys = std::stoul(argv[++i]);
+        } else if (arg == "--cluster") {
+            config.clusterEnabled = true;
+        } else if (arg == "--cluster-nodes" && i + 1 < argc) {
+            // Comma-separated host:port list; slots are split evenly in this order
+            config.clusterEnabled = true;
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size()) {
+                size_t comma = list.find(',', start);
+                if (comma == std::string::npos) comma = list.size();
+                if (comma > start) config.clusterNodes.push_back(list.substr(start, comma - start));
+                start = comma + 1;
+            }
+        } else if (arg == "--cluster-config-file" && i + 1 < argc) {
+            config.clusterConfigFile = argv[++i];
+        } else {
+            config.port = std::stoi(arg);
+        }
+    }
+
+    KVServer server(config);
 
-    if (KVStore::instance().loadFromDisk("snapshot.kvdb"))
+    if (server.loadSnapshot("snapshot.kvdb"))
         std::cout << "Data loaded from snapshot.kvdb\n";
-    else 
+    else
         std::cout << "No snapshot found or load failed; starting fresh.\n";
 
-    KVServer server(listenPort);
-
     // Background persistence: save database every 300 seconds
-    std::thread snapshotThread([](){
+    std::thread snapshotThread([&server](){
         while (true) {
             std::this_thread::sleep_for(std::chrono::seconds(300));
-            if (!KVStore::instance().saveToDisk("snapshot.kvdb"))
+            if (!server.saveSnapshot("snapshot.kvdb"))
                 std::cerr << "Error saving snapshot\n";
-            else 
+            else
                 std::cout << "Snapshot saved to snapshot.kvdb\n";
         }
     });
     snapshotThread.detach();
-    
+
     server.start();
     return 0;
 }
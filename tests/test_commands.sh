@@ -5,18 +5,121 @@ set -e
 # Requires redis-cli to be installed
 
 PORT=${1:-6379}
+# Blocks that need server options start their own server on this port
+SCRATCH_PORT=${SCRATCH_PORT:-7390}
+ROOT="$(cd "$(dirname "$0")/.." && pwd)"
+BINARY="$ROOT/lite-kvstore"
+FAILURES=0
 
-echo "Running tests against port $PORT..."
-echo "=================================="
+# start_server <options...>: run a server in a scratch directory (SERVER_DIR)
+# on SCRATCH_PORT, or on SERVER_PORT if set; stop_server stops all of them
+SERVER_PIDS=()
+SERVER_DIRS=()
+start_server() {
+    local port=${SERVER_PORT:-$SCRATCH_PORT}
+    SERVER_DIR=$(mktemp -d)
+    (cd "$SERVER_DIR" && exec "$BINARY" "$port" "$@" > server.log 2>&1) &
+    SERVER_PIDS+=($!)
+    SERVER_DIRS+=("$SERVER_DIR")
+    for _ in $(seq 1 50); do
+        if [ "$(echo PING | redis-cli -p "$port" 2>/dev/null)" = "PONG" ]; then return 0; fi
+        sleep 0.1
+    done
+    echo "FAIL: server on port $port with $* did not start"
+    FAILURES=$((FAILURES + 1))
+}
+
+stop_server() {
+    local pid
+    for pid in "${SERVER_PIDS[@]}"; do
+        kill -INT "$pid" 2>/dev/null || true
+        wait "$pid" 2>/dev/null || true
+    done
+    rm -rf "${SERVER_DIRS[@]}"
+    SERVER_PIDS=()
+    SERVER_DIRS=()
+}
+
+# compare <label> <actual> <expected>; SORT=1 compares sorted lines
+compare() {
+    local actual=$2
+    if [ -n "$SORT" ]; then actual=$(echo "$actual" | sort); fi
+    if [ "$actual" != "$3" ]; then
+        echo "FAIL: $1" | head -3
+        echo "  expected: $3" | head -3
+        echo "  actual:   $actual" | head -3
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# check <port> <command lines> <expected output>
+check() {
+    compare "$2" "$(echo "$2" | redis-cli -p "$1" 2>&1)" "$3"
+}
+
+# check_near <port> <command> <expected number> <percent>: for estimates
+check_near() {
+    local actual
+    actual=$(echo "$2" | redis-cli -p "$1" 2>&1) || true
+    if ! [[ "$actual" =~ ^[0-9]+$ ]] || [ $((actual * 100)) -lt $(($3 * (100 - $4))) ] ||
+       [ $((actual * 100)) -gt $(($3 * (100 + $4))) ]; then
+        compare "$2" "$actual" "$3 within $4%"
+    fi
+}
+
+# check_stream <port> <label> <expected output> < <(producer): the commands are
+# sent as the producer writes them, so it can pause or use another connection
+check_stream() {
+    compare "$2" "$(redis-cli -p "$1" 2>&1)" "$3"
+}
 
+# check_log <text>: the log of the last server started must contain text
+check_log() {
+    if ! grep -qF "$1" "$SERVER_DIR/server.log"; then
+        echo "FAIL: no \"$1\" in the server log"
+        FAILURES=$((FAILURES + 1))
+    fi
+}
+
+# wait_for <port> <command lines> <expected output>: poll for up to 5 s until
+# the reply matches, for state that settles asynchronously; check then compares
+wait_for() {
+    for _ in $(seq 1 50); do
+        if [ "$(echo "$2" | redis-cli -p "$1" 2>&1)" = "$3" ]; then return 0; fi
+        sleep 0.1
+    done
+}
+
+# later <port> <command lines>: send them from another connection in 0.2 s
+later() {
+    (sleep 0.2; echo "$2" | redis-cli -p "$1" > /dev/null) &
+}
+
+# big <prefix> <length>: prefix followed by length zeros
+big() { printf "%s%0${2}d" "$1" 0; }
+
+# resp <args...>: one command in RESP, for connections held open with /dev/tcp
+resp() {
+    local out="*$#\r\n" arg
+    for arg in "$@"; do out+="\$${#arg}\r\n$arg\r\n"; done
+    printf "%b" "$out"
+}
+
+# smoke_suite <port>: every command once with the replies printed, then
+# checks of the behaviour that matters
+smoke_suite() {
 # Filter out comment lines and pipe to redis-cli
-sed '/^#/d' << 'EOF' | redis-cli -p $PORT
+sed '/^#/d' << 'EOF' | redis-cli -p "$1"
 # Clear existing data
 FLUSHALL
 
 # Test: General Commands
 PING
 ECHO "Hello World"
+CLIENT SETNAME tester
+CLIENT GETNAME
+CLIENT ID
+CLIENT LIST
 
 # Test: String Operations
 SET username alice
@@ -30,6 +133,16 @@ GET counter
 SET session abc123
 EXPIRE session 60
 RENAME username user
+SET temp1 "a"
+SET temp2 "b"
+UNLINK temp1 temp2
+DUMP user
+DUMP nosuchkey
+RESTORE user 0 "not a payload"
+
+# Test: Cluster (hash slots are computed outside cluster mode too)
+CLUSTER KEYSLOT user
+CLUSTER KEYSLOT {user}.profile
 
 # Test: List Operations
 RPUSH tasks "task1" "task2" "task3"
@@ -46,6 +159,12 @@ LGET tasks
 RPUSH nums 1 2 1 3 1 4 1
 LREM nums 2 1
 LGET nums
+LMOVE nums moved LEFT RIGHT
+BLPOP nums 1
+BRPOP empty 0.1
+RPUSH jobs "job1"
+BLMOVE jobs moved LEFT LEFT 1
+LGET moved
 
 # Test: Hash Operations
 HSET user:1 name "Bob"
@@ -64,10 +183,470 @@ HGETALL user:1
 HMSET user:2 name "Eve" city "NYC" role "admin"
 HGETALL user:2
 
+# Test: Sorted Set Operations
+ZADD board 100 "alice" 80 "bob" 95 "carol"
+ZADD board XX CH 90 "bob"
+ZINCRBY board 10 "carol"
+ZCARD board
+ZSCORE board "carol"
+ZRANK board "bob"
+ZREVRANK board "carol"
+ZRANGE board 0 -1 WITHSCORES
+ZREVRANGE board 0 1
+ZRANGE board (90 +inf BYSCORE LIMIT 0 1
+ZRANGE board +inf -inf BYSCORE REV WITHSCORES
+ZREM board "alice"
+ZCARD board
+
+# Test: HyperLogLog
+PFADD visitors "alice" "bob" "carol"
+PFADD visitors "alice"
+PFCOUNT visitors
+PFADD {visitors}.mobile "carol" "dave"
+PFCOUNT visitors {visitors}.mobile
+PFMERGE {visitors}.all visitors {visitors}.mobile
+PFCOUNT {visitors}.all
+TYPE visitors
+
+# Test: Bitmaps
+SETBIT flags 7 1
+SETBIT flags 7 0
+GETBIT flags 7
+SET {flags}.a "foobar"
+BITCOUNT {flags}.a
+BITCOUNT {flags}.a 1 1
+BITCOUNT {flags}.a 5 30 BIT
+BITPOS {flags}.a 1
+BITPOS {flags}.a 0 2 -1 BYTE
+SET {flags}.b "abcdef"
+BITOP AND {flags}.and {flags}.a {flags}.b
+GET {flags}.and
+BITOP NOT {flags}.not {flags}.a
+BITFIELD counters INCRBY u2 100 1 OVERFLOW SAT INCRBY u2 102 1
+BITFIELD counters SET i8 #1 -100 GET i8 #1 GET u8 8
+
+# Test: Pub/Sub
+PUBLISH news "no subscribers yet"
+
+# Test: Replication
+ROLE
+
+# Test: Transactions
+MULTI
+SET tx:a "1"
+RPUSH tx:list "x" "y"
+GET tx:a
+EXEC
+WATCH tx:a
+MULTI
+SET tx:a "2"
+EXEC
+GET tx:a
+MULTI
+SET tx:a
+EXEC
+
+# Test: Client-side caching (invalidations need a subscribed REDIRECT connection)
+CLIENT TRACKING ON
+CLIENT GETREDIR
+
+# Test: Traffic capture
+CAPTURE STATUS
+
+# Test: Bulk loading (commands in bulk mode get no reply, see --pipe)
+BULKLOAD END
+BULKRESTORE "not a payload"
+
 # Cleanup
-FLUSHALL
+FLUSHALL ASYNC
 EOF
 
+# Transactions: a write from another connection to a WATCHed key aborts EXEC,
+# so does a command rejected while queuing; DISCARD drops the queue
+check "$1" "$(printf '%s\n' MULTI "SET tx:a 1" "RPUSH tx:list x y" "GET tx:a" EXEC)" \
+      "$(printf '%s\n' OK QUEUED QUEUED QUEUED OK 2 1)"
+check_stream "$1" "WATCH tx:w, SET tx:w elsewhere, EXEC" "$(printf '%s\n' OK OK OK QUEUED "" 2)" < <(
+    printf 'SET tx:w 1\nWATCH tx:w\n'
+    sleep 0.2
+    echo "SET tx:w 2" | redis-cli -p "$1" > /dev/null
+    printf 'MULTI\nSET tx:w 3\nEXEC\nGET tx:w\n')
+check "$1" "$(printf '%s\n' MULTI "SET tx:a" "SET tx:a 9" EXEC "GET tx:a")" \
+      "$(printf '%s\n' OK "ERR wrong number of arguments for 'set' command" QUEUED \
+                        "EXECABORT Transaction discarded because of previous errors." 1)"
+check "$1" "$(printf '%s\n' MULTI "SET tx:a 2" "DEL tx:list" DISCARD "GET tx:a" "LLEN tx:list")" \
+      "$(printf '%s\n' OK QUEUED QUEUED OK 1 2)"
+check "$1" "UNLINK tx:a tx:list tx:w" "3"
+
+# Blocking commands wake on a push from another connection, and a push of one
+# element serves exactly one of two waiters; the other times out with nil
+later "$1" "RPUSH bl:q a"
+check "$1" "BLPOP bl:q 5" "$(printf '%s\n' bl:q a)"
+later "$1" "RPUSH bl:q a b"
+check "$1" "BRPOP bl:none bl:q 5" "$(printf '%s\n' bl:q b)"
+later "$1" "LPUSH bl:src c"
+check "$1" "$(printf '%s\n' "BLMOVE bl:src bl:dst LEFT RIGHT 5" "LGET bl:dst")" "$(printf '%s\n' c c)"
+check "$1" "BRPOP bl:none 0.1" ""
+WAITERS=$(mktemp -d)
+echo "BLPOP bl:one 1" | redis-cli -p "$1" > "$WAITERS/1" &
+WAITER1=$!
+echo "BLPOP bl:one 1" | redis-cli -p "$1" > "$WAITERS/2" &
+WAITER2=$!
+sleep 0.2
+check "$1" "RPUSH bl:one x" "1"
+wait "$WAITER1" "$WAITER2"
+compare "two BLPOP waiters, one RPUSH" "$(cat "$WAITERS"/* | sort | tr '\n' ' ')" " bl:one x "
+rm -rf "$WAITERS"
+check "$1" "$(printf 'LLEN %s\n' bl:q bl:one)" "$(printf '%s\n' 1 0)"
+
+# Sorted sets, compact up to 128 members and a skiplist from the 129th on
+check "$1" "ZADD z:b 100 alice 80 bob 95 carol 12.5 dan" "4"
+check "$1" "ZRANGE z:b 0 -1 WITHSCORES" "$(printf '%s\n' dan 12.5 bob 80 carol 95 alice 100)"
+check "$1" "ZRANGE z:b (80 +inf BYSCORE LIMIT 0 1" "carol"
+check "$1" "ZRANGE z:b +inf -inf BYSCORE REV LIMIT 1 2" "$(printf '%s\n' carol bob)"
+check "$1" "ZREVRANGE z:b 0 1 WITHSCORES" "$(printf '%s\n' alice 100 carol 95)"
+check "$1" "$(printf 'ZRANK z:b %s\n' carol nobody)" "$(printf '%s\n' 2 "")"
+check "$1" "ZADD z:big $(for i in $(seq 1 128); do echo -n "$i m$i "; done)" "128"
+check "$1" "$(printf '%s\n' "ZRANK z:big m64" "ZADD z:big 0.5 m0" "ZCARD z:big" "ZRANK z:big m64" "ZREVRANK z:big m0")" \
+      "$(printf '%s\n' 63 1 129 64 128)"
+check "$1" "ZRANGE z:big 0 2" "$(printf '%s\n' m0 m1 m2)"
+check "$1" "ZRANGE z:big (126 +inf BYSCORE LIMIT 1 5 WITHSCORES" "$(printf '%s\n' m128 128)"
+check "$1" "$(printf '%s\n' "ZINCRBY z:big 200 m1" "ZREVRANGE z:big 0 1" "ZREM z:big m1 m2" "ZRANK z:big m3")" \
+      "$(printf '%s\n' 201 m1 m128 2 1)"
+# A member over 64 bytes also needs the skiplist
+check "$1" "$(printf '%s\n' "ZADD z:long 2 $(big l 64) 1 short" "ZRANGE z:long 0 -1")" "$(printf '%s\n' 2 short "$(big l 64)")"
+
+# HyperLogLog: small counts are exact; past 750 registers a sketch turns dense,
+# and merging or counting a sparse and a dense sketch gives their union
+check "$1" "$(printf '%s\n' "PFADD hll:a alice bob carol" "PFADD hll:a alice" "PFCOUNT hll:a")" "$(printf '%s\n' 1 0 3)"
+check "$1" "PFADD hll:dense $(seq -f 'e%g' 1 2000 | tr '\n' ' ')" "1"
+check "$1" "PFADD hll:sparse $(seq -f 'e%g' 1901 2100 | tr '\n' ' ')" "1"
+check_near "$1" "PFCOUNT hll:dense" 2000 2
+check_near "$1" "PFCOUNT hll:sparse" 200 2
+check_near "$1" "PFCOUNT hll:dense hll:sparse" 2100 2
+UNION=$(echo "PFCOUNT hll:dense hll:sparse" | redis-cli -p "$1")
+check "$1" "$(printf '%s\n' "PFMERGE hll:all hll:sparse hll:dense" "PFCOUNT hll:all")" "$(printf '%s\n' OK "$UNION")"
+check "$1" "$(printf '%s\n' "PFMERGE hll:a hll:sparse" "PFCOUNT hll:a")" "$(printf '%s\n' OK "$(echo "PFCOUNT hll:a hll:sparse" | redis-cli -p "$1")")"
+
+# Bitmaps of 512 bytes and more take the vectorized paths: "U" is 0x55, "0" 0x30
+check "$1" "SET bm:u $(head -c 1000 /dev/zero | tr '\0' U)" "OK"
+check "$1" "SET bm:z $(big "" 1000)" "OK"
+check "$1" "$(printf '%s\n' "BITCOUNT bm:u" "BITCOUNT bm:u 100 899" "BITCOUNT bm:u 5 7999 BIT" "BITCOUNT bm:z")" \
+      "$(printf '%s\n' 4000 3200 3998 2000)"
+check "$1" "$(printf '%s\n' "BITOP AND bm:and bm:u bm:z" "BITCOUNT bm:and" "BITOP OR bm:or bm:u bm:z" "GET bm:or")" \
+      "$(printf '%s\n' 1000 1000 1000 "$(head -c 1000 /dev/zero | tr '\0' u)")"
+check "$1" "$(printf '%s\n' "BITOP XOR bm:x bm:u bm:z bm:or" "BITCOUNT bm:x" "BITOP NOT bm:n bm:u" "BITCOUNT bm:n")" \
+      "$(printf '%s\n' 1000 1000 1000 4000)"
+check "$1" "$(printf '%s\n' "SETBIT bm:far 7999 1" "BITPOS bm:far 1" "BITPOS bm:z 1")" "$(printf '%s\n' 0 7999 2)"
+# BITFIELD overflow: SAT clamps, FAIL returns nil and leaves the value, WRAP wraps
+check "$1" "BITFIELD bf SET u8 0 250 OVERFLOW SAT INCRBY u8 0 10 OVERFLOW FAIL INCRBY u8 0 1 OVERFLOW WRAP INCRBY u8 0 1" \
+      "$(printf '%s\n' 0 255 "" 0)"
+check "$1" "BITFIELD bf:i OVERFLOW SAT INCRBY i8 0 -200 INCRBY i8 0 300 OVERFLOW FAIL INCRBY i8 0 1 GET i8 0" \
+      "$(printf '%s\n' -128 127 "" 127)"
+
+# Pub/Sub: PUBLISH returns the number of receivers, channel subscribers get
+# message pushes and pattern subscribers pmessage pushes
+SUBS=$(mktemp -d)
+redis-cli -p "$1" SUBSCRIBE ps:news > "$SUBS/channel" &
+SUB1=$!
+redis-cli -p "$1" PSUBSCRIBE 'ps:*' > "$SUBS/pattern" &
+SUB2=$!
+sleep 0.2
+check "$1" "$(printf '%s\n' "PUBLISH ps:news hello" "PUBLISH ps:other x" "PUBLISH other y")" "$(printf '%s\n' 2 1 0)"
+sleep 0.2
+{ kill "$SUB1" "$SUB2"; wait "$SUB1" "$SUB2"; } 2> /dev/null || true
+compare "SUBSCRIBE ps:news" "$(cat "$SUBS/channel")" "$(printf '%s\n' subscribe ps:news 1 message ps:news hello)"
+compare "PSUBSCRIBE ps:*" "$(cat "$SUBS/pattern")" \
+        "$(printf '%s\n' psubscribe 'ps:*' 1 pmessage 'ps:*' ps:news hello pmessage 'ps:*' ps:other x)"
+rm -rf "$SUBS"
+
+# Bulk loading: commands between BEGIN and END get no reply, END reports the
+# counts, and commands that fail (all-shard, wrong arity) are counted as errors
+exec 3<>"/dev/tcp/127.0.0.1/$1"
+{ resp BULKLOAD BEGIN RESERVE string 100; resp SET bk:a 1; resp RPUSH bk:l x y; resp GET bk:a
+  resp FLUSHALL; resp SET bk:b; resp BULKLOAD END; } >&3
+BULK=""
+for _ in 1 2 3; do IFS= read -r -t 5 line <&3 && BULK+="${line%$'\r'}"$'\n'; done
+exec 3>&-
+compare "BULKLOAD BEGIN ... END" "${BULK%$'\n'}" "$(printf '%s\n' +OK '$93' \
+        "commands=5 restored_keys=0 errors=2 first_error=ERR 'FLUSHALL' is not allowed during BULKLOAD")"
+check "$1" "$(printf '%s\n' "GET bk:a" "LLEN bk:l" "TYPE bk:b")" "$(printf '%s\n' 1 2 none)"
+check "$1" "$(printf '%s\n' "BULKLOAD BEGIN RESERVE nope 1" "BULKLOAD BEGIN RESERVE string x")" \
+      "$(printf '%s\n' "ERR Unknown type 'nope' for RESERVE" "ERR syntax error")"
+
+# Client-side caching: keys read by a tracking connection, misses included, and
+# keys under a BCAST prefix are invalidated on the REDIRECT connection when
+# another connection writes them
+INVALIDATE=$(mktemp)
+redis-cli -p "$1" SUBSCRIBE __redis__:invalidate > "$INVALIDATE" &
+SUB1=$!
+sleep 0.2
+REDIRECT=$(echo "CLIENT LIST" | redis-cli -p "$1" | sed -n 's/^id=\([0-9]*\) .*cmd=subscribe$/\1/p')
+check_stream "$1" "CLIENT TRACKING ON REDIRECT" "$(printf '%s\n' OK OK 1 "" OK "$REDIRECT")" < <(
+    printf '%s\n' "SET tr:a 1" "CLIENT TRACKING ON REDIRECT $REDIRECT" "GET tr:a" "GET tr:b"
+    sleep 0.2
+    printf '%s\n' "SET tr:a 2" "SET tr:b 1" "SET tr:c 1" | redis-cli -p "$1" > /dev/null
+    sleep 0.2
+    printf '%s\n' "CLIENT TRACKING ON REDIRECT $REDIRECT BCAST PREFIX tr:p" "CLIENT GETREDIR"
+    sleep 0.2
+    printf '%s\n' "SET tr:p1 1" "SET tr:q 1" | redis-cli -p "$1" > /dev/null
+    sleep 0.2)
+{ kill "$SUB1"; wait "$SUB1"; } 2> /dev/null || true
+compare "invalidations on __redis__:invalidate" "$(cat "$INVALIDATE")" \
+        "$(printf '%s\n' subscribe __redis__:invalidate 1 message __redis__:invalidate tr:a \
+                          message __redis__:invalidate tr:b message __redis__:invalidate tr:p1)"
+rm -f "$INVALIDATE"
+check "$1" "$(printf '%s\n' "CLIENT TRACKING ON REDIRECT 999999" "CLIENT TRACKING ON PREFIX tr: REDIRECT 1")" \
+      "$(printf '%s\n' "ERR The client ID you want redirect to does not exist" \
+                        "ERR PREFIX option requires BCAST mode to be enabled")"
+
+# UNLINK counts only the keys that existed, a big list freed in the background
+# included; FLUSHALL ASYNC leaves an empty keyspace behind at once
+check "$1" "$(printf '%s\n' "SET ul:a 1" "RPUSH ul:big $(seq -s ' ' 1 5000)" "UNLINK ul:a ul:missing ul:big" \
+                             "TYPE ul:a" "LLEN ul:big")" "$(printf '%s\n' OK 5000 2 none 0)"
+check "$1" "$(printf '%s\n' "SET fl:a 1" "RPUSH fl:big $(seq -s ' ' 1 5000)" "FLUSHALL ASYNC" "KEYS *" "GET fl:a" "LLEN fl:big")" \
+      "$(printf '%s\n' OK 5000 OK "" "" 0)"
+check "$1" "FLUSHALL LAZY" "ERR syntax error"
+}
+
+echo "Running tests against port $PORT..."
+echo "=================================="
+smoke_suite "$PORT"
+
+# Test: Thread-per-core mode
+echo ""
+echo "Thread-per-core mode (--threads 2) on port $SCRATCH_PORT..."
+start_server --threads 2
+# Writers on several connections at once; keys spread over both shards
+WRITERS=()
+for conn in 1 2 3 4; do
+    (for i in $(seq 1 50); do echo "SET t:$conn:$i v$conn.$i"; done | redis-cli -p "$SCRATCH_PORT" > /dev/null) &
+    WRITERS+=($!)
+done
+wait "${WRITERS[@]}"
+for conn in 1 2 3 4; do
+    check "$SCRATCH_PORT" "$(for i in $(seq 1 50); do echo "GET t:$conn:$i"; done)" \
+          "$(for i in $(seq 1 50); do echo "v$conn.$i"; done)"
+done
+# KEYS and FLUSHALL run on every shard
+SORT=1 check "$SCRATCH_PORT" "KEYS" "$(for conn in 1 2 3 4; do for i in $(seq 1 50); do echo "t:$conn:$i"; done; done | sort)"
+check "$SCRATCH_PORT" "FLUSHALL" "OK"
+check "$SCRATCH_PORT" "KEYS" ""
+# "a" and "b" hash to different shards, {a}-tagged keys to the same one
+check "$SCRATCH_PORT" "RPUSH a x" "1"
+check "$SCRATCH_PORT" "LMOVE a b LEFT RIGHT" "CROSSSLOT Keys in request don't hash to the same shard"
+check "$SCRATCH_PORT" "LMOVE a {a}.b LEFT RIGHT" "x"
+# EXEC and WATCH across both shards
+check "$SCRATCH_PORT" "$(printf '%s\n' MULTI "SET a 1" "SET b 2" EXEC "GET a" "GET b")" \
+      "$(printf '%s\n' OK QUEUED QUEUED OK OK 1 2)"
+check_stream "$SCRATCH_PORT" "WATCH a b, SET b elsewhere, EXEC" "$(printf '%s\n' OK OK QUEUED QUEUED "" 1 3)" < <(
+    echo "WATCH a b"
+    sleep 0.2
+    echo "SET b 3" | redis-cli -p "$SCRATCH_PORT" > /dev/null
+    printf '%s\n' MULTI "SET a 4" "SET b 4" EXEC "GET a" "GET b")
+stop_server
+
+# Test: Pub/Sub output limit, a subscriber that never reads is disconnected
+echo ""
+echo "Pub/Sub output limit on port $SCRATCH_PORT..."
+start_server --pubsub-output-limit 65536
+exec 3<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT"
+resp SUBSCRIBE ps:slow >&3
+sleep 0.2
+for i in $(seq 1 10); do echo "PUBLISH ps:slow $(big m 100000)"; done | redis-cli -p "$SCRATCH_PORT" > /dev/null
+wait_for "$SCRATCH_PORT" "PUBLISH ps:slow x" "0"
+check "$SCRATCH_PORT" "PUBLISH ps:slow x" "0"
+exec 3>&-
+check_log "(pubsub) exceeded its output buffer limit"
+stop_server
+
+# Test: Client limits and CLIENT LIST
+echo ""
+echo "Client limits on port $SCRATCH_PORT..."
+start_server --client-output-buffer-limit normal 40000 0 0 --client-query-buffer-limit 65536 --timeout 1
+# client_list: CLIENT LIST sorted, without the fields that differ between runs
+client_list() {
+    printf 'CLIENT SETNAME probe\nCLIENT LIST\n' | redis-cli -p "$SCRATCH_PORT" |
+        sed -E -e 1d -e '/^$/d' -e 's/(id|addr|fd|age|idle)=[^ ]*/\1=_/g' | sort
+}
+exec 3<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT" 4<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT"
+{ resp MULTI; resp SET a 1; } >&3
+resp SUBSCRIBE c1 >&4
+sleep 0.2
+PROBE="id=_ addr=_ fd=_ name=probe age=_ idle=_ flags=N shard=0 sub=0 psub=0 multi=-1 qbuf=26 obl=0 oll=0 omem=0 class=normal cmd=client"
+SUBSCRIBER="id=_ addr=_ fd=_ name= age=_ idle=_ flags=P shard=0 sub=1 psub=0 multi=-1 qbuf=0 obl=0 oll=0 omem=0 class=pubsub cmd=subscribe"
+compare "CLIENT LIST" "$(client_list)" "$(printf '%s\n' "$PROBE" "$SUBSCRIBER" \
+    "id=_ addr=_ fd=_ name= age=_ idle=_ flags=x shard=0 sub=0 psub=0 multi=1 qbuf=0 obl=0 oll=0 omem=0 class=normal cmd=set" | sort)"
+# --timeout closes the idle connection in MULTI but not the subscriber
+sleep 2.5
+compare "CLIENT LIST after --timeout" "$(client_list)" "$(printf '%s\n' "$PROBE" "$SUBSCRIBER" | sort)"
+exec 3>&- 4>&-
+# A client that sends requests without reading the replies passes the output hard limit
+check "$SCRATCH_PORT" "SET out $(big o 30000)" "OK"
+exec 3<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT"
+for i in $(seq 1 1000); do resp GET out; done >&3
+sleep 0.2
+exec 3>&-
+# A request that stays incomplete past the query buffer limit; a smaller one is served
+check "$SCRATCH_PORT" "SET in $(big i 30000)" "OK"
+exec 3<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT"
+printf '*3\r\n$3\r\nSET\r\n$2\r\nin\r\n$100000\r\n%s' "$(big i 70000)" >&3
+sleep 0.2
+exec 3>&-
+check_log "(normal) exceeded its output buffer limit"
+check_log "exceeded the query buffer limit"
+check "$SCRATCH_PORT" "GET in" "$(big i 30000)"
+stop_server
+
+# Test: Replication between two processes
+REPLICA_PORT=$((SCRATCH_PORT + 1))
+echo ""
+echo "Replication from port $SCRATCH_PORT to $REPLICA_PORT..."
+start_server
+check "$SCRATCH_PORT" "$(printf '%s\n' "SET r:a 1" "RPUSH r:list x y" "HSET r:h f v")" "$(printf '%s\n' OK 2 1)"
+SERVER_PORT=$REPLICA_PORT start_server
+check "$REPLICA_PORT" "REPLICAOF 127.0.0.1 $SCRATCH_PORT" "OK"
+# Full sync, then the stream applied in order
+wait_for "$REPLICA_PORT" "GET r:a" "1"
+check "$REPLICA_PORT" "$(printf '%s\n' "GET r:a" "LGET r:list" "HGET r:h f")" "$(printf '%s\n' 1 x y v)"
+check "$SCRATCH_PORT" "$(printf '%s\n' "DEL r:a" "SET r:b 2")" "$(printf '%s\n' 1 OK)"
+wait_for "$REPLICA_PORT" "GET r:b" "2"
+check "$REPLICA_PORT" "$(printf '%s\n' "GET r:b" "GET r:a")" "$(printf '%s\n' 2 "")"
+check "$REPLICA_PORT" "SET r:c 1" "READONLY You can't write against a read only replica."
+# Both sides report the same offset once the replica has acknowledged it
+OFFSET=$(echo ROLE | redis-cli -p "$SCRATCH_PORT" | sed -n 2p)
+ROLE_PRIMARY=$(printf '%s\n' master "$OFFSET" 127.0.0.1 "$REPLICA_PORT" "$OFFSET")
+wait_for "$SCRATCH_PORT" "ROLE" "$ROLE_PRIMARY"
+check "$SCRATCH_PORT" "ROLE" "$ROLE_PRIMARY"
+check "$REPLICA_PORT" "ROLE" "$(printf '%s\n' slave 127.0.0.1 "$SCRATCH_PORT" connected "$OFFSET")"
+stop_server
+
+# Test: Two-node cluster, slots 0-8191 on the first node and the rest on the second
+NODE_A=$SCRATCH_PORT
+NODE_B=$((SCRATCH_PORT + 1))
+echo ""
+echo "Cluster on ports $NODE_A and $NODE_B..."
+for port in "$NODE_A" "$NODE_B"; do
+    SERVER_PORT=$port start_server --cluster-nodes "127.0.0.1:$NODE_A,127.0.0.1:$NODE_B"
+done
+ID_A=$(echo "CLUSTER MYID" | redis-cli -p "$NODE_A")
+ID_B=$(echo "CLUSTER MYID" | redis-cli -p "$NODE_B")
+# "bar" is in slot 5061, "foo" in 12182; a hash tag keeps {bar} keys in 5061
+check "$NODE_A" "$(printf 'CLUSTER KEYSLOT %s\n' bar foo {bar}.y)" "$(printf '%s\n' 5061 12182 5061)"
+check "$NODE_A" "SET foo 1" "MOVED 12182 127.0.0.1:$NODE_B"
+check "$NODE_A" "$(printf '%s\n' "SET bar 1" "RENAME bar {bar}.y" "SET {bar}.z 2" "RENAME {bar}.y foo")" \
+      "$(printf '%s\n' OK OK OK "CROSSSLOT Keys in request don't hash to the same slot")"
+# Move slot 5061: during the migration the source answers -ASK for keys it no
+# longer has and the target serves them only after ASKING
+check "$NODE_B" "CLUSTER SETSLOT 5061 IMPORTING $ID_A" "OK"
+check "$NODE_A" "CLUSTER SETSLOT 5061 MIGRATING $ID_B" "OK"
+check "$NODE_A" "MIGRATE 127.0.0.1 $NODE_B {bar}.y 0 1000" "OK"
+check "$NODE_A" "$(printf 'GET %s\n' {bar}.y {bar}.z)" "$(printf '%s\n' "ASK 5061 127.0.0.1:$NODE_B" 2)"
+check "$NODE_B" "GET {bar}.y" "MOVED 5061 127.0.0.1:$NODE_A"
+check "$NODE_B" "$(printf '%s\n' ASKING "GET {bar}.y")" "$(printf '%s\n' OK 1)"
+check "$NODE_A" "MIGRATE 127.0.0.1 $NODE_B \"\" 0 1000 KEYS {bar}.z" "OK"
+for port in "$NODE_A" "$NODE_B"; do
+    check "$port" "CLUSTER SETSLOT 5061 NODE $ID_B" "OK"
+done
+check "$NODE_A" "GET {bar}.y" "MOVED 5061 127.0.0.1:$NODE_B"
+check "$NODE_B" "$(printf 'GET %s\n' {bar}.y {bar}.z)" "$(printf '%s\n' 1 2)"
+stop_server
+
+# Test: Tiered storage, with room for only four large values in memory
+echo ""
+echo "Tiered storage on port $SCRATCH_PORT..."
+start_server --tiered-storage values.vlog --tiered-memory 4096 --tiered-min-value 512
+for i in $(seq 1 20); do
+    check "$SCRATCH_PORT" "SET s$i $(big "v$i" 1000)" "OK"
+done
+check "$SCRATCH_PORT" "$(for i in $(seq 1 20); do echo "GET s$i"; done)" \
+      "$(for i in $(seq 1 20); do big "v$i" 1000; echo; done)"
+check "$SCRATCH_PORT" "BITCOUNT s7" "2010"
+# Overwrite, edit, rename and delete spilled values, then spill the results in turn
+check "$SCRATCH_PORT" "SET s1 small" "OK"
+check "$SCRATCH_PORT" "SET s2 $(big w2 1000)" "OK"
+# SETBIT edits in place: "v" becomes "w", the last "0" a "1"
+check "$SCRATCH_PORT" "SETBIT s3 7 1" "0"
+check "$SCRATCH_PORT" "SETBIT s4 8015 1" "0"
+check "$SCRATCH_PORT" "RENAME s5 r5" "OK"
+check "$SCRATCH_PORT" "DEL s6" "1"
+for i in $(seq 21 30); do
+    check "$SCRATCH_PORT" "SET s$i $(big "v$i" 1000)" "OK"
+done
+check "$SCRATCH_PORT" "$(printf 'GET %s\n' s1 s2 s3 s4 r5 s5 s6)" \
+      "$(printf '%s\n' small "$(big w2 1000)" "$(big w3 1000)" "$(big v4 999)1" "$(big v5 1000)" "" "")"
+check "$SCRATCH_PORT" "$(for i in $(seq 7 30); do echo "GET s$i"; done)" \
+      "$(for i in $(seq 7 30); do big "v$i" 1000; echo; done)"
+stop_server
+
+# Test: Compression, values over the threshold stored compressed when they shrink
+echo ""
+echo "Compression on port $SCRATCH_PORT..."
+start_server --compression-threshold 64
+# Hex digests do not repeat, so LZ4 cannot shrink them
+NOISE=$(for i in $(seq 1 40); do echo "$i" | md5sum | cut -c1-32; done | tr -d '\n')
+check "$SCRATCH_PORT" "$(printf 'SET %s\n' "z $(big z 2000)" "n $NOISE" "s short")" "$(printf 'OK\nOK\nOK')"
+check "$SCRATCH_PORT" "$(printf 'GET %s\n' z n s)" "$(printf '%s\n' "$(big z 2000)" "$NOISE" short)"
+check "$SCRATCH_PORT" "BITCOUNT z" "4005"
+# SETBIT edits the raw bytes: the last "0" of z becomes a "1", the leading "b" of NOISE a "B"
+check "$SCRATCH_PORT" "SETBIT z 16007 1" "0"
+check "$SCRATCH_PORT" "SETBIT n 2 0" "1"
+check "$SCRATCH_PORT" "RENAME z z2" "OK"
+check "$SCRATCH_PORT" "$(printf 'GET %s\n' z2 n)" "$(printf '%s\n' "$(big z 1999)1" "B${NOISE:1}")"
+# Plain values that begin like a frame, under and over the threshold, read back
+# unchanged; setting a bit of the NUL makes them printable
+check "$SCRATCH_PORT" "SET f \"\\x00LZ4 not a frame\"" "OK"
+check "$SCRATCH_PORT" "SET g \"\\x00LZ4$(big "" 2000)\"" "OK"
+check "$SCRATCH_PORT" "$(printf 'BITCOUNT %s\n' f g)" "$(printf '51\n4010')"
+check "$SCRATCH_PORT" "$(printf 'SETBIT %s 1 1\n' f g)" "$(printf '0\n0')"
+check "$SCRATCH_PORT" "$(printf 'GET %s\n' f g)" "$(printf '%s\n' "@LZ4 not a frame" "@LZ4$(big "" 2000)")"
+stop_server
+
+# Test: kv-replay, with a connection that finishes long before the other and is closed idle
+echo ""
+echo "Capture and replay on port $SCRATCH_PORT..."
+start_server --timeout 1
+exec 3<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT" 4<>"/dev/tcp/127.0.0.1/$SCRATCH_PORT"
+resp CAPTURE START traffic.cap >&3
+head -c 5 <&3 > /dev/null
+check "$SCRATCH_PORT" "CAPTURE START other.cap" "ERR A capture is already running"
+resp SET a 1 >&3
+for i in 1 2 3 4; do resp SET b "$i" >&4; sleep 0.6; done
+exec 3>&- 4>&-
+check "$SCRATCH_PORT" "CAPTURE STOP" "OK"
+# Five writes, plus the CAPTURE commands that kv-replay skips
+check "$SCRATCH_PORT" "CAPTURE STATUS" "state=stopped path=traffic.cap records=7 bytes=126"
+check "$SCRATCH_PORT" "FLUSHALL" "OK"
+if REPLAY=$("$ROOT/kv-replay" "$SERVER_DIR/traffic.cap" --port "$SCRATCH_PORT"); then
+    REPLAY_RC=0
+else
+    REPLAY_RC=$?
+fi
+if [ "$REPLAY_RC" -ne 0 ] || ! echo "$REPLAY" | grep -q "^Replayed 5 commands"; then
+    echo "FAIL: kv-replay exited with $REPLAY_RC"
+    echo "$REPLAY" | head -3
+    FAILURES=$((FAILURES + 1))
+fi
+check "$SCRATCH_PORT" "$(printf 'GET %s\n' a b)" "$(printf '1\n4')"
+stop_server
+
+# Test: I/O backends, the smoke suite once on each
+for backend in epoll io_uring; do
+    echo ""
+    echo "Smoke suite with the $backend backend on port $SCRATCH_PORT..."
+    start_server --io-backend "$backend"
+    if grep -q "falling back to epoll" "$SERVER_DIR/server.log"; then
+        echo "io_uring is not available on this kernel, skipped"
+    else
+        smoke_suite "$SCRATCH_PORT"
+        check "$SCRATCH_PORT" "PING" "PONG"
+    fi
+    stop_server
+done
+
 echo ""
 echo "=================================="
+if [ "$FAILURES" -gt 0 ]; then
+    echo "$FAILURES check(s) failed"
+    exit 1
+fi
 echo "Tests completed!"
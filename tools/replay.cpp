@@ -0,0 +1,551 @@
+/*
+ * kv-replay: replays a traffic capture (CAPTURE START or --capture) against a
+ * server and reports throughput and latency.
+ *
+ *   kv-replay <capture file> [--host <host>] [--port <port>] [--speed <factor> | --max]
+ *                            [--threads <n>] [--drain-timeout <seconds>]
+ *
+ * Every captured connection is replayed on a connection of its own, so the
+ * original concurrency is kept. A connection sends its commands one at a
+ * time in capture order: at the captured time divided by --speed (1 by
+ * default), or as soon as the previous reply arrived with --max. Latency is
+ * measured from sending a command to its complete reply; in timed mode the
+ * delay between a command's due time and its sending is reported as lag.
+ */
+#include "../include/TrafficCapture.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+// Commands that change how a connection receives replies, or the server's role
+static const std::unordered_set<std::string> kSkipped = {
+    "CAPTURE", "SUBSCRIBE", "PSUBSCRIBE", "UNSUBSCRIBE", "PUNSUBSCRIBE", "MONITOR",
+    "PSYNC", "SYNC", "REPLCONF", "REPLICAOF", "SLAVEOF", "SHUTDOWN", "QUIT",
+};
+
+//----------------------
+// Latency Histogram
+//----------------------
+// Log-linear buckets in microseconds: 32 per power of two, about 3% precision
+class Histogram {
+public:
+    Histogram() : buckets_(size_t(64) << kSubBits, 0) {}
+
+    void add(uint64_t value) {
+        buckets_[bucketOf(value)]++;
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < buckets_.size(); i++)
+            buckets_[i] += other.buckets_[i];
+        count_ += other.count_;
+        sum_ += other.sum_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t max() const { return max_; }
+    double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100 * count_));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets_.size(); i++) {
+            seen += buckets_[i];
+            if (seen >= rank && seen > 0) return std::min(lowerBound(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static const int kSubBits = 5;
+    std::vector<uint64_t> buckets_;
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < (uint64_t(1) << kSubBits)) return value;
+        int shift = 63 - __builtin_clzll(value) - kSubBits;
+        return (static_cast<size_t>(shift + 1) << kSubBits) + ((value >> shift) & ((1 << kSubBits) - 1));
+    }
+
+    static uint64_t lowerBound(size_t bucket) {
+        if (bucket < (size_t(1) << kSubBits)) return bucket;
+        int shift = static_cast<int>(bucket >> kSubBits) - 1;
+        return (uint64_t((1 << kSubBits) + (bucket & ((1 << kSubBits) - 1)))) << shift;
+    }
+};
+
+//----------------------
+// Capture Loading
+//----------------------
+struct ReplayCommand {
+    uint64_t micros;        // since the first replayed command
+    std::string request;    // RESP encoding
+    uint32_t name;          // index into Workload::names
+};
+
+struct ReplayConnection {
+    std::vector<ReplayCommand> commands;
+    size_t next = 0;        // next command to send
+    int fd = -1;
+    std::string in;         // reply bytes not yet complete
+    std::string out;
+    size_t outPos = 0;
+    bool inFlight = false;
+    bool failed = false;
+    Clock::time_point sentAt;
+};
+
+struct Workload {
+    std::vector<ReplayConnection> connections;
+    std::vector<std::string> names;
+    uint64_t commands = 0;
+    uint64_t skipped = 0;
+    uint64_t duration = 0;  // microseconds from the first to the last command
+};
+
+static std::string encodeRequest(const std::vector<std::string>& args) {
+    std::string out = "*" + std::to_string(args.size()) + "\r\n";
+    for (const auto& arg : args)
+        out += "$" + std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    return out;
+}
+
+static bool loadCapture(const std::string& path, Workload& workload) {
+    CaptureReader reader;
+    if (!reader.open(path)) return false;
+    std::unordered_map<uint64_t, size_t> connectionOf;
+    std::unordered_map<std::string, uint32_t> nameIds;
+    std::vector<std::vector<ReplayCommand>> commands;
+    uint64_t first = UINT64_MAX, last = 0;
+    CapturedCommand captured;
+    while (reader.next(captured)) {
+        if (captured.args.empty()) continue;
+        std::string name = captured.args[0];
+        std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+        if (kSkipped.count(name)) {
+            workload.skipped++;
+            continue;
+        }
+        auto id = nameIds.emplace(name, static_cast<uint32_t>(workload.names.size()));
+        if (id.second) workload.names.push_back(name);
+        auto conn = connectionOf.emplace(captured.clientId, commands.size());
+        if (conn.second) commands.emplace_back();
+        commands[conn.first->second].push_back({captured.micros, encodeRequest(captured.args), id.first->second});
+        first = std::min(first, captured.micros);
+        last = std::max(last, captured.micros);
+        workload.commands++;
+    }
+
+    // Shards write their blocks independently; a connection's records are already in order
+    workload.connections.resize(commands.size());
+    for (size_t i = 0; i < commands.size(); i++) {
+        for (auto& command : commands[i])
+            command.micros -= first;
+        workload.connections[i].commands = std::move(commands[i]);
+    }
+    workload.duration = workload.commands ? last - first : 0;
+    return true;
+}
+
+//----------------------
+// Replies
+//----------------------
+// Length of the complete reply at pos, 0 if more bytes are needed, -1 if malformed
+static long replyLength(const std::string& buf, size_t pos) {
+    if (pos >= buf.size()) return 0;
+    size_t eol = buf.find("\r\n", pos);
+    if (eol == std::string::npos) return 0;
+    long header = static_cast<long>(eol + 2 - pos);
+    switch (buf[pos]) {
+    case '+': case '-': case ':': case '_': case ',': case '#':
+        return header;
+    case '$': {
+        long len = std::atol(buf.c_str() + pos + 1);
+        if (len < 0) return header;
+        if (buf.size() < eol + 2 + static_cast<size_t>(len) + 2) return 0;
+        return header + len + 2;
+    }
+    case '*': case '>': {
+        long count = std::atol(buf.c_str() + pos + 1);
+        long total = header;
+        for (long i = 0; i < count; i++) {
+            long len = replyLength(buf, pos + total);
+            if (len <= 0) return len;
+            total += len;
+        }
+        return total;
+    }
+    default:
+        return -1;
+    }
+}
+
+//----------------------
+// Replay
+//----------------------
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 6379;
+    double speed = 1;
+    bool maxSpeed = false;
+    int threads = 0;
+    int drainTimeout = 10;  // seconds to wait for replies once every command was sent
+};
+
+struct WorkerStats {
+    Histogram latency;
+    Histogram lag;
+    std::vector<Histogram> byCommand;
+    uint64_t errors = 0;
+    uint64_t unanswered = 0;
+    uint64_t failedConnections = 0;
+};
+
+static int connectTo(const Options& options) {
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(options.host.c_str(), std::to_string(options.port).c_str(), &hints, &result) != 0)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) return -1;
+    int optVal = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optVal, sizeof(optVal));
+    return fd;
+}
+
+class Worker {
+public:
+    Worker(const Options& options, Workload& workload, std::vector<size_t> connections)
+        : options_(options), workload_(workload), connections_(std::move(connections)) {
+        stats_.byCommand.resize(workload.names.size());
+        for (size_t index : connections_)
+            unsent_ += workload.connections[index].commands.size();
+        remaining_ = connections_.size();
+    }
+
+    // Connect every connection; false if the server cannot be reached
+    bool connectAll() {
+        epoll_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_ < 0) return false;
+        for (size_t index : connections_) {
+            ReplayConnection& conn = workload_.connections[index];
+            conn.fd = connectTo(options_);
+            if (conn.fd < 0) return false;
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u64 = index;
+            epoll_ctl(epoll_, EPOLL_CTL_ADD, conn.fd, &event);
+        }
+        return true;
+    }
+
+    // Replay this worker's connections with command times counted from start
+    void run(Clock::time_point start) {
+        start_ = start;
+        for (size_t index : connections_)
+            schedule(index);
+        Clock::time_point drainDeadline = Clock::time_point::max();
+        std::vector<epoll_event> events(256);
+        while (remaining_ > 0) {
+            Clock::time_point now = Clock::now();
+            while (!due_.empty() && due_.top().first <= now) {
+                size_t index = due_.top().second;
+                if (!options_.maxSpeed)
+                    stats_.lag.add(micros(due_.top().first, now));
+                due_.pop();
+                send(index, now);
+            }
+            // Everything was sent, wait a bounded time for the last replies (blocking commands may never get one)
+            if (unsent_ == 0 && drainDeadline == Clock::time_point::max())
+                drainDeadline = now + std::chrono::seconds(options_.drainTimeout);
+            if (now >= drainDeadline) break;
+
+            int timeoutMs = 100;
+            if (!due_.empty()) {
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due_.top().first - now).count();
+                timeoutMs = static_cast<int>(std::min<long>(timeoutMs, std::max<long>(0, wait)));
+            }
+            int n = epoll_wait(epoll_, events.data(), static_cast<int>(events.size()), timeoutMs);
+            for (int i = 0; i < n; i++) {
+                size_t index = events[i].data.u64;
+                if (events[i].events & EPOLLOUT) flushOutput(index);
+                if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) readReplies(index);
+            }
+        }
+
+        for (size_t index : connections_) {
+            ReplayConnection& conn = workload_.connections[index];
+            if (conn.inFlight) stats_.unanswered++;
+            if (conn.fd >= 0) close(conn.fd);
+        }
+        close(epoll_);
+    }
+
+    const WorkerStats& stats() const { return stats_; }
+
+private:
+    const Options& options_;
+    Workload& workload_;
+    std::vector<size_t> connections_;
+    Clock::time_point start_;
+    int epoll_ = -1;
+    uint64_t unsent_ = 0;           // commands not sent yet, of connections still replaying
+    size_t remaining_ = 0;          // connections with commands to send or a reply to wait for
+    WorkerStats stats_;
+    using Due = std::pair<Clock::time_point, size_t>;
+    std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due_;
+
+    static uint64_t micros(Clock::time_point from, Clock::time_point to) {
+        return to <= from ? 0 : std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    }
+
+    // Queue the connection's next command for its due time
+    void schedule(size_t index) {
+        ReplayConnection& conn = workload_.connections[index];
+        if (conn.failed || conn.next >= conn.commands.size()) return;
+        Clock::time_point due = start_;
+        if (!options_.maxSpeed) {
+            double offset = conn.commands[conn.next].micros / options_.speed;
+            due += std::chrono::microseconds(static_cast<int64_t>(offset));
+        }
+        due_.push({due, index});
+    }
+
+    void send(size_t index, Clock::time_point now) {
+        ReplayConnection& conn = workload_.connections[index];
+        if (conn.failed) return;
+        conn.out = conn.commands[conn.next].request;
+        conn.outPos = 0;
+        conn.inFlight = true;
+        conn.sentAt = now;
+        unsent_--;
+        flushOutput(index);
+    }
+
+    void flushOutput(size_t index) {
+        ReplayConnection& conn = workload_.connections[index];
+        while (conn.outPos < conn.out.size()) {
+            ssize_t n = ::send(conn.fd, conn.out.data() + conn.outPos, conn.out.size() - conn.outPos,
+                               MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.outPos += n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n < 0 && errno == EINTR) continue;
+            fail(index);
+            return;
+        }
+        // Watch for writability only while a request is partially sent
+        epoll_event event{};
+        event.events = conn.outPos < conn.out.size() ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.u64 = index;
+        epoll_ctl(epoll_, EPOLL_CTL_MOD, conn.fd, &event);
+    }
+
+    void readReplies(size_t index) {
+        ReplayConnection& conn = workload_.connections[index];
+        char buf[64 * 1024];
+        while (true) {
+            ssize_t n = recv(conn.fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0) {
+                conn.in.append(buf, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fail(index);
+                return;
+            }
+            break;
+        }
+
+        long len = conn.inFlight ? replyLength(conn.in, 0) : 0;
+        if (len < 0 || (!conn.inFlight && !conn.in.empty())) {
+            fail(index);
+            return;
+        }
+        if (len == 0) return;
+
+        Clock::time_point now = Clock::now();
+        uint64_t latency = micros(conn.sentAt, now);
+        stats_.latency.add(latency);
+        stats_.byCommand[conn.commands[conn.next].name].add(latency);
+        if (conn.in[0] == '-') stats_.errors++;
+        conn.in.erase(0, len);
+        conn.inFlight = false;
+        // Done: a later close by the server (e.g. --timeout) is not a failure
+        if (++conn.next == conn.commands.size()) {
+            remaining_--;
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, conn.fd, nullptr);
+        }
+        schedule(index);
+    }
+
+    // The server closed the connection or sent something unexpected; its remaining commands are dropped
+    void fail(size_t index) {
+        ReplayConnection& conn = workload_.connections[index];
+        if (conn.failed || conn.next == conn.commands.size()) return;
+        conn.failed = true;
+        stats_.failedConnections++;
+        unsent_ -= conn.commands.size() - conn.next - (conn.inFlight ? 1 : 0);
+        if (conn.inFlight) stats_.unanswered++;
+        conn.inFlight = false;
+        remaining_--;
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, conn.fd, nullptr);
+    }
+};
+
+//----------------------
+// Report
+//----------------------
+static void printLatency(const char* label, const Histogram& h) {
+    std::printf("%s avg %.1f  p50 %llu  p90 %llu  p99 %llu  p99.9 %llu  max %llu\n", label, h.mean(),
+                (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+                (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9),
+                (unsigned long long)h.max());
+}
+
+static void usage() {
+    std::cerr << "Usage: kv-replay <capture file> [--host <host>] [--port <port>] [--speed <factor> | --max]\n"
+                 "                 [--threads <n>] [--drain-timeout <seconds>]\n";
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    std::string path;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--host" && i + 1 < argc) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--speed" && i + 1 < argc) {
+            options.speed = std::atof(argv[++i]);
+        } else if (arg == "--max") {
+            options.maxSpeed = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (arg == "--drain-timeout" && i + 1 < argc) {
+            options.drainTimeout = std::max(0, std::atoi(argv[++i]));
+        } else if (path.empty() && arg[0] != '-') {
+            path = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (path.empty() || options.speed <= 0) {
+        usage();
+        return 1;
+    }
+
+    Workload workload;
+    if (!loadCapture(path, workload)) {
+        std::cerr << "Cannot read capture file " << path << "\n";
+        return 1;
+    }
+    std::printf("Capture: %llu commands on %zu connections over %.2f s (%llu skipped)\n",
+                (unsigned long long)workload.commands, workload.connections.size(), workload.duration / 1e6,
+                (unsigned long long)workload.skipped);
+    if (workload.connections.empty()) return 0;
+
+    int threads = options.threads > 0 ? options.threads : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    threads = std::min<int>(threads, static_cast<int>(workload.connections.size()));
+    std::vector<std::vector<size_t>> assigned(threads);
+    for (size_t i = 0; i < workload.connections.size(); i++)
+        assigned[i % threads].push_back(i);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back(new Worker(options, workload, std::move(assigned[t])));
+        if (!workers.back()->connectAll()) {
+            std::cerr << "Cannot connect to " << options.host << ":" << options.port << "\n";
+            return 1;
+        }
+    }
+
+    // Connections are all open before the clock starts
+    Clock::time_point start = Clock::now();
+    std::vector<std::thread> running;
+    for (auto& worker : workers)
+        running.emplace_back([&worker, start]() { worker->run(start); });
+    for (auto& t : running)
+        t.join();
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    WorkerStats total;
+    total.byCommand.resize(workload.names.size());
+    for (const auto& worker : workers) {
+        const WorkerStats& stats = worker->stats();
+        total.latency.merge(stats.latency);
+        total.lag.merge(stats.lag);
+        for (size_t i = 0; i < stats.byCommand.size(); i++)
+            total.byCommand[i].merge(stats.byCommand[i]);
+        total.errors += stats.errors;
+        total.unanswered += stats.unanswered;
+        total.failedConnections += stats.failedConnections;
+    }
+
+    uint64_t replies = total.latency.count();
+    char pace[32] = "max";
+    if (!options.maxSpeed)
+        std::snprintf(pace, sizeof(pace), "%gx", options.speed);
+    std::printf("Replayed %llu commands in %.2f s at %s speed: %.0f ops/s, %llu error replies\n",
+                (unsigned long long)replies, elapsed, pace, elapsed > 0 ? replies / elapsed : 0.0,
+                (unsigned long long)total.errors);
+    if (total.unanswered || total.failedConnections)
+        std::printf("%llu commands unanswered, %llu connections closed early\n",
+                    (unsigned long long)total.unanswered, (unsigned long long)total.failedConnections);
+    printLatency("Latency (us):", total.latency);
+    if (!options.maxSpeed)
+        printLatency("Schedule lag (us):", total.lag);
+
+    std::vector<size_t> order(workload.names.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return total.byCommand[a].count() > total.byCommand[b].count();
+    });
+    std::printf("Per command (us):\n");
+    for (size_t i : order) {
+        const Histogram& h = total.byCommand[i];
+        if (h.count() == 0) continue;
+        std::printf("  %-16s %10llu  avg %.1f  p50 %llu  p99 %llu  max %llu\n", workload.names[i].c_str(),
+                    (unsigned long long)h.count(), h.mean(), (unsigned long long)h.percentile(50),
+                    (unsigned long long)h.percentile(99), (unsigned long long)h.max());
+    }
+    return total.failedConnections ? 2 : 0;
+}